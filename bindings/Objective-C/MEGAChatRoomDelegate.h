@@ -12,5 +12,6 @@
 - (void)onMessageLoaded:(MEGAChatSdk *)api message:(MEGAChatMessage *)message;
 - (void)onMessageReceived:(MEGAChatSdk *)api message:(MEGAChatMessage *)message;
 - (void)onMessageUpdate:(MEGAChatSdk *)api message:(MEGAChatMessage *)message;
+- (void)onMessageStatusRangeChange:(MEGAChatSdk *)api chatId:(uint64_t)chatId fromIndex:(NSInteger)fromIndex toIndex:(NSInteger)toIndex status:(NSInteger)status;
 
 @end
@@ -13,6 +13,7 @@ public:
     void onMessageLoaded(megachat::MegaChatApi *api, megachat::MegaChatMessage *message);
     void onMessageReceived(megachat::MegaChatApi *api, megachat::MegaChatMessage *message);
     void onMessageUpdate(megachat::MegaChatApi *api, megachat::MegaChatMessage *message);
+    void onMessageStatusRangeChange(megachat::MegaChatApi *api, megachat::MegaChatHandle chatid, int fromIndex, int toIndex, int status);
     
 private:
     MEGAChatSdk *megaChatSDK;
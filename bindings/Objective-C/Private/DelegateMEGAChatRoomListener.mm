@@ -58,3 +58,13 @@ void DelegateMEGAChatRoomListener::onMessageUpdate(megachat::MegaChatApi *api, m
         });
     }
 }
+
+void DelegateMEGAChatRoomListener::onMessageStatusRangeChange(megachat::MegaChatApi *api, megachat::MegaChatHandle chatid, int fromIndex, int toIndex, int status) {
+    if (listener != nil && [listener respondsToSelector:@selector(onMessageStatusRangeChange:chatId:fromIndex:toIndex:status:)]) {
+        MEGAChatSdk *tempMegaChatSDK = this->megaChatSDK;
+        id<MEGAChatRoomDelegate> tempListener = this->listener;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [tempListener onMessageStatusRangeChange:tempMegaChatSDK chatId:chatid fromIndex:fromIndex toIndex:toIndex status:status];
+        });
+    }
+}
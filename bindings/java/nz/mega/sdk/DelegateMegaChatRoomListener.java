@@ -87,6 +87,17 @@ class DelegateMegaChatRoomListener extends MegaChatRoomListener {
         }
     }
 
+    @Override
+    public void onMessageStatusRangeChange(MegaChatApi api, final long chatid, final int fromIndex, final int toIndex, final int status){
+        if (listener != null) {
+            megaChatApi.runCallback(new Runnable() {
+                public void run() {
+                    listener.onMessageStatusRangeChange(megaChatApi, chatid, fromIndex, toIndex, status);
+                }
+            });
+        }
+    }
+
 //
 //    /**
 //     * This function is called when a request is about to start being processed.
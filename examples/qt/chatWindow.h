@@ -584,6 +584,20 @@ public:
         if (widget)
             widget->updateStatus(newStatus);
     }
+    virtual void onMessageStatusRangeChange(chatd::Idx fromIdx, chatd::Idx toIdx, chatd::Message::Status newStatus)
+    {
+        mRoom.onMessageStatusRangeChange(fromIdx, toIdx, newStatus);
+        bool ours = (newStatus == chatd::Message::kDelivered);
+        for (chatd::Idx i = fromIdx; i <= toIdx; i++)
+        {
+            auto& msg = mChat->at(i);
+            if ((msg.userid == mChat->client().userId()) != ours)
+                continue;
+            auto widget = widgetFromMessage(msg);
+            if (widget)
+                widget->updateStatus(newStatus);
+        }
+    }
     virtual void onLastTextMessageUpdated(const chatd::LastTextMsg& msg)
     {
         mRoom.onLastTextMessageUpdated(msg);
@@ -604,6 +618,7 @@ public:
         assert(item->listWidget()->row(item) == mHistAddPos);
 #endif
         mHistAddPos++;
+        widget->mMessage = const_cast<chatd::Message*>(&msg); //the sent one was moved to history
         widget->mIndex = idx;
         widget->updateStatus(chatd::Message::kServerReceived);
         widget->updateToolTip();
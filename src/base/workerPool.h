@@ -0,0 +1,84 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+
+namespace karere
+{
+/** @brief A fixed set of threads that run posted tasks in FIFO order.
+ * Tasks must not touch state owned by the app thread - results are passed back
+ * to it via \c marshallCall()
+ */
+class WorkerPool
+{
+protected:
+    std::vector<std::thread> mThreads;
+    std::deque<std::function<void()>> mTasks;
+    std::mutex mMutex;
+    std::condition_variable mTaskCond;
+    std::condition_variable mIdleCond;
+    size_t mBusy = 0;
+    bool mStop = false;
+    void threadFunc()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for (;;)
+        {
+            mTaskCond.wait(lock, [this]() { return mStop || !mTasks.empty(); });
+            if (mTasks.empty()) //stopping, and nothing left to do
+                return;
+            auto task = std::move(mTasks.front());
+            mTasks.pop_front();
+            mBusy++;
+            lock.unlock();
+            task();
+            task = nullptr; //release captures outside of the lock
+            lock.lock();
+            if (--mBusy == 0 && mTasks.empty())
+                mIdleCond.notify_all();
+        }
+    }
+public:
+    explicit WorkerPool(unsigned numThreads)
+    {
+        if (!numThreads)
+            numThreads = 1;
+        for (unsigned i = 0; i < numThreads; i++)
+            mThreads.emplace_back(&WorkerPool::threadFunc, this);
+    }
+    /** @brief Runs the tasks that are still queued, then joins the threads */
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mTaskCond.notify_all();
+        for (auto& thread: mThreads)
+            thread.join();
+    }
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+    unsigned size() const { return (unsigned)mThreads.size(); }
+    void post(std::function<void()>&& task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTasks.push_back(std::move(task));
+        }
+        mTaskCond.notify_one();
+    }
+    /** @brief Blocks until there are no queued or running tasks */
+    void waitIdle()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mIdleCond.wait(lock, [this]() { return mTasks.empty() && !mBusy; });
+    }
+};
+}
+#endif
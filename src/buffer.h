@@ -151,6 +151,11 @@ public:
     }
 };
 
+/** A Buffer owns its memory, unless it was set up via borrow(). A borrowed buffer
+ * (non-NULL mBuf, but zero mBufSize) references memory owned by someone else
+ * (i.e. a received websocket frame), which is never freed or written to - the
+ * data is copied to an owned block before the first modification.
+ */
 class Buffer: public StaticBuffer
 {
 protected:
@@ -162,7 +167,39 @@ protected:
         mBufSize = 0;
         mDataSize = 0;
     }
+    /** Makes the buffer reference external memory without copying it.
+     * The caller must guarantee that the memory outlives the buffer, or
+     * at least until it is modified */
+    void borrow(const char* data, size_t datalen)
+    {
+        if (mBufSize)
+            ::free(mBuf);
+        if (data && datalen)
+        {
+            mBuf = (char*)data;
+            mBufSize = 0;
+            mDataSize = datalen;
+        }
+        else
+        {
+            zero();
+        }
+    }
+    /** If the buffer is borrowed, copies the data to a block that we own */
+    void unshare(size_t reserve=0)
+    {
+        if (!isBorrowed())
+            return;
+        size_t size = mDataSize+reserve;
+        char* copy = (char*)::malloc(size);
+        if (!copy)
+            throw std::runtime_error("Buffer::unshare: Out of memory allocating block of size "+ std::to_string(size));
+        memcpy(copy, mBuf, mDataSize);
+        mBuf = copy;
+        mBufSize = size;
+    }
 public:
+    bool isBorrowed() const { return mBuf && !mBufSize; }
     char* buf() { return mBuf;}
     const char* buf() const { return mBuf;}
     size_t bufSize() const { return mBufSize;}
@@ -205,17 +242,22 @@ public:
     Buffer(const std::string& src)
     {
         mBufSize = withNull ? src.size()+1 : src.size();
+        if (!mBufSize)
+        {
+            zero();
+            return;
+        }
         mBuf = (char*)malloc(mBufSize);
         memcpy(mBuf, src.c_str(), mBufSize);
         mDataSize = mBufSize;
     }
     void assign(const void* data, size_t datalen)
     {
-        if (mBuf)
+        if (mBufSize) //a borrowed block is just dropped
         {
             if (datalen <= mBufSize)
             {
-                memcpy(mBuf, data, datalen);
+                memmove(mBuf, data, datalen); //data may be a part of our own block
                 mDataSize = datalen;
                 return;
             }
@@ -236,8 +278,14 @@ public:
     void copyFrom(const StaticBuffer& src) { assign(src.buf(), src.dataSize()); }
     void reserve(size_t size)
     {
-        if (!mBuf)
+        if (isBorrowed())
         {
+            unshare(size);
+        }
+        else if (!mBuf)
+        {
+            if (!size)
+                return;
             mBuf = (char*)::malloc(size);
             mBufSize = size;
             assert(mDataSize == 0);
@@ -259,13 +307,14 @@ public:
     }
     void setDataSize(size_t size)
     {
-        if (size > mBufSize)
+        if (size > (isBorrowed() ? mDataSize : mBufSize))
             throw std::runtime_error("setDataSize: Attempted to set dataSize to span beyond bufferSize");
         mDataSize = size;
     }
     char* writePtr(size_t offset, size_t dataLen)
     {
         auto reqdSize = offset+dataLen;
+        unshare((reqdSize > mDataSize) ? (reqdSize - mDataSize) : 0);
         if (reqdSize > mBufSize)
         {
             reserve(reqdSize);
@@ -280,7 +329,7 @@ public:
     char* appendPtr(size_t dataLen) { return writePtr(mDataSize, dataLen); }
     void takeFrom(Buffer&& other)
     {
-        if (mBuf)
+        if (mBufSize)
             ::free(mBuf);
         mBuf = other.mBuf;
         mBufSize = other.mBufSize;
@@ -296,6 +345,7 @@ public:
         if (!data)
             return *this;
         auto reqdSize = offset+datalen;
+        unshare((reqdSize > mDataSize) ? (reqdSize - mDataSize) : 0);
         if (reqdSize <= mDataSize)
         {
             ::memcpy(mBuf+offset, data, datalen);
@@ -342,16 +392,14 @@ public:
     void clear() { mDataSize = 0; }
     void free()
     {
-        if (!mBuf)
-            return;
-        ::free(mBuf);
-        mBuf = nullptr;
-        mBufSize = mDataSize = 0;
+        if (mBufSize)
+            ::free(mBuf);
+        zero();
     }
 
     ~Buffer()
     {
-        if (mBuf)
+        if (mBufSize)
             ::free(mBuf);
     }
 };
@@ -31,6 +31,7 @@
 #include <codecvt> //for nonWhitespaceStr()
 #include <locale>
 #include "strongvelope/strongvelope.h"
+#include "strongvelope/verifiedMsgCache.h"
 #include "base64.h"
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -72,6 +73,11 @@ std::string encodeFirstName(const std::string& first);
           mOwnPresence(Presence::kInvalid),
           mPresencedClient(&api, this, *this, caps)
 {
+    //called from the db writer thread
+    db.setWriteErrorHandler([](const std::string& msg)
+    {
+        KR_LOG_ERROR("Error writing to database: %s", msg.c_str());
+    });
 }
 
 KARERE_EXPORT const std::string& createAppDir(const char* dirname, const char *envVarName)
@@ -133,6 +139,23 @@ std::string Client::dbPath(const std::string& sid) const
     return path;
 }
 
+std::string Client::verifiedMsgCachePath(const std::string& sid) const
+{
+    auto path = dbPath(sid);
+    path.insert(path.size()-3, "-verified");
+    return path;
+}
+
+void Client::openVerifiedMsgCache()
+{
+    mVerifiedMsgCache.reset(new strongvelope::VerifiedMsgCache);
+    if (!mVerifiedMsgCache->open(verifiedMsgCachePath(mSid)))
+    {
+        KR_LOG_WARNING("Can't open the verified message cache, received messages will always be verified");
+        mVerifiedMsgCache.reset();
+    }
+}
+
 bool Client::openDb(const std::string& sid)
 {
     assert(!sid.empty());
@@ -145,7 +168,7 @@ bool Client::openDb(const std::string& sid)
         return false;
     }
 
-    bool ok = db.open(path.c_str(), false);
+    bool ok = db.open(path.c_str(), false, true);
     if (!ok)
     {
         KR_LOG_WARNING("Error opening database");
@@ -186,6 +209,14 @@ void Client::heartbeat()
     {
         db.timedCommit();
     }
+    if (mVerifiedMsgCache)
+    {
+        mVerifiedMsgCache->timedCommit();
+    }
+    if (chatd)
+    {
+        chatd->trimHistory();
+    }
 
     if (mConnState != kConnected)
     {
@@ -332,6 +363,7 @@ promise::Promise<void> Client::initWithNewSession(const char* sid, const std::st
 
     mSid = sid;
     createDb();
+    openVerifiedMsgCache();
 
 // We have a complete snapshot of the SDK contact and chat list state.
 // Commit it with the accompanying scsn
@@ -341,19 +373,52 @@ promise::Promise<void> Client::initWithNewSession(const char* sid, const std::st
     mMyEmail = getMyEmailFromSdk();
     db.query("insert or replace into vars(name,value) values('my_email', ?)", mMyEmail);
 
+    mSharedKeyCache.reset();
     mUserAttrCache.reset(new UserAttrCache(*this));
+    mSharedKeyCache.reset(new strongvelope::SharedKeyCache(*mUserAttrCache));
 
     return loadOwnKeysFromApi()
     .then([this, scsn, contactList, chatList]()
     {
         loadContactListFromApi(*contactList);
-        chatd.reset(new chatd::Client(this, mMyHandle));
+        createChatdClient();
         assert(chats->empty());
         chats->onChatsUpdate(*chatList);
         commit(scsn);
     });
 }
 
+void Client::createChatdClient()
+{
+    chatd.reset(new chatd::Client(this, mMyHandle));
+    applyChatdSettings();
+}
+
+void Client::setChatdSettings(const ChatdSettings& settings)
+{
+    mChatdSettings = settings;
+    if (chatd)
+        applyChatdSettings();
+}
+
+void Client::applyChatdSettings()
+{
+    chatd->options = mChatdSettings.options;
+    chatd->maxHistInRamPerChat = mChatdSettings.maxHistInRamPerChat;
+    chatd->maxHistInRam = mChatdSettings.maxHistInRam;
+    chatd->maxDecryptAhead = mChatdSettings.maxDecryptAhead;
+    for (auto& item: *chats)
+    {
+        auto room = item.second;
+        if (room->hasChatdChat())
+            static_cast<strongvelope::ProtocolHandler*>(room->chat().crypto())
+                ->setMaxKeysInRam(maxKeysInRam());
+    }
+    auto pool = chatd->decryptPool();
+    if ((pool ? pool->size() : 0) != mChatdSettings.decryptThreads)
+        chatd->setDecryptThreads(mChatdSettings.decryptThreads);
+}
+
 void Client::commit(const std::string& scsn)
 {
     if (scsn.empty())
@@ -444,7 +509,10 @@ void Client::initWithDbSession(const char* sid)
         }
         assert(db);
         assert(!mSid.empty());
+        openVerifiedMsgCache();
+        mSharedKeyCache.reset();
         mUserAttrCache.reset(new UserAttrCache(*this));
+        mSharedKeyCache.reset(new strongvelope::SharedKeyCache(*mUserAttrCache));
 
         mMyHandle = getMyHandleFromDb();
         assert(mMyHandle);
@@ -463,7 +531,7 @@ void Client::initWithDbSession(const char* sid)
         loadOwnKeysFromDb();
         contactList->loadFromDb();
         mContactsLoaded = true;
-        chatd.reset(new chatd::Client(this, mMyHandle));
+        createChatdClient();
         chats->loadFromDb();
     }
     catch(std::runtime_error& e)
@@ -652,11 +720,7 @@ void Client::onRequestFinish(::mega::MegaApi* apiObj, ::mega::MegaRequest *reque
 void Client::wipeDb(const std::string& sid)
 {
     assert(!sid.empty());
-    if (db)
-    {
-        sqlite3_close(db);
-        db = nullptr;
-    }
+    db.close();
     std::string path = dbPath(sid);
     remove(path.c_str());
     struct stat info;
@@ -668,7 +732,7 @@ void Client::createDb()
 {
     wipeDb(mSid);
     std::string path = dbPath(mSid);
-    if (!db.open(path.c_str(), false))
+    if (!db.open(path.c_str(), false, true))
         throw std::runtime_error("Can't access application database at "+mAppDir);
     createDbSchema(); //calls commit() at the end
 }
@@ -1101,16 +1165,29 @@ void Client::terminate(bool deleteDb)
 #endif
 
     disconnect();
+    mSharedKeyCache.reset();
     mUserAttrCache.reset();
+    if (mVerifiedMsgCache)
+    {
+        mVerifiedMsgCache->close();
+    }
 
     if (deleteDb && !mSid.empty())
     {
         wipeDb(mSid);
+        remove(verifiedMsgCachePath(mSid).c_str());
     }
     else if (db)
     {
         KR_LOG_INFO("Doing final COMMIT to database");
-        db.commit();
+        try
+        {
+            db.flushWrites(true);
+        }
+        catch(std::exception& e)
+        {
+            KR_LOG_ERROR("Error writing to database: %s", e.what());
+        }
         db.close();
     }
 }
@@ -1199,6 +1276,30 @@ ChatRoom::ChatRoom(ChatRoomList& aParent, const uint64_t& chatid, bool aIsGroup,
     mOwnPriv(aOwnPriv), mTitleString(aTitle), mCreationTs(ts)
 {}
 
+int ChatRoom::unreadCount() const
+{
+    if (!mChat && mSummary.haveUnreadCount)
+        return mSummary.unreadCount;
+    return chat().unreadMsgCount();
+}
+
+uint32_t ChatRoom::lastMessageTs() const
+{
+    if (!mChat)
+        return (mSummary.lastTs > mCreationTs) ? mSummary.lastTs : mCreationTs;
+    return mChat->lastMessageTs();
+}
+
+uint8_t ChatRoom::lastTextMessage(chatd::LastTextMsg*& msg)
+{
+    if (!mChat && mSummary.lastTextMsg.isValid())
+    {
+        msg = &mSummary.lastTextMsg;
+        return chatd::LastTextMsgState::kHave;
+    }
+    return chat().lastTextMessage(msg);
+}
+
 //chatd::Listener
 void ChatRoom::onLastMessageTsUpdated(uint32_t ts)
 {
@@ -1220,11 +1321,23 @@ ApiPromise ChatRoom::requestRevokeAccess(mega::MegaNode *node, mega::MegaHandle
     return parent.client.api.call(&::mega::MegaApi::removeAccessInChat, chatid(), node, userHandle);
 }
 
+size_t Client::maxKeysInRam() const
+{
+    return mChatdSettings.maxKeysInRam
+        ? mChatdSettings.maxKeysInRam
+        : (size_t)strongvelope::ProtocolHandler::kDefaultMaxKeysInRam;
+}
+
 strongvelope::ProtocolHandler* Client::newStrongvelope(karere::Id chatid)
 {
-    return new strongvelope::ProtocolHandler(mMyHandle,
+    auto handler = new strongvelope::ProtocolHandler(mMyHandle,
         StaticBuffer(mMyPrivCu25519, 32), StaticBuffer(mMyPrivEd25519, 32),
-        StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, db, chatid, appCtx);
+        StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, *mSharedKeyCache,
+        mVerifiedMsgCache.get(), db, chatid, appCtx);
+    handler->setMaxKeysInRam(maxKeysInRam());
+    if (mChatdSettings.sendKeyMaxAge)
+        handler->pruneKeys(mChatdSettings.sendKeyMaxAge);
+    return handler;
 }
 
 void ChatRoom::createChatdChat(const karere::SetOfIds& initialUsers)
@@ -1261,7 +1374,7 @@ void PeerChatRoom::initWithChatd()
 
 void PeerChatRoom::connect()
 {
-    mChat->connect();
+    chat().connect();
 }
 
 promise::Promise<void> PeerChatRoom::mediaCall(AvFlags av)
@@ -1352,7 +1465,8 @@ IApp::IGroupChatListItem* GroupChatRoom::addAppItem()
 }
 
 GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
-    unsigned char aShard, chatd::Priv aOwnPriv, uint32_t ts, const std::string& title)
+    unsigned char aShard, chatd::Priv aOwnPriv, uint32_t ts, const std::string& title,
+    const Summary& summary)
 :ChatRoom(parent, chatid, true, aShard, aOwnPriv, ts, title),
 mHasTitle(!title.empty()), mRoomGui(nullptr)
 {
@@ -1376,7 +1490,8 @@ mHasTitle(!title.empty()), mRoomGui(nullptr)
     });
 
     notifyTitleChanged();
-    initWithChatd();
+    //the chatd::Chat is created on demand, see ChatRoom::chat()
+    mSummary = summary;
     mRoomGui = addAppItem();
     mIsInitializing = false;
 }
@@ -1397,7 +1512,7 @@ void GroupChatRoom::connect()
     if (chat().onlineState() != chatd::kChatStateOffline)
         return;
 
-    mChat->connect();
+    chat().connect();
     if (mHasTitle)
     {
         decryptTitle()
@@ -1420,14 +1535,16 @@ IApp::IPeerChatListItem* PeerChatRoom::addAppItem()
 }
 
 PeerChatRoom::PeerChatRoom(ChatRoomList& parent, const uint64_t& chatid,
-    unsigned char aShard, chatd::Priv aOwnPriv, const uint64_t& peer, chatd::Priv peerPriv, uint32_t ts)
+    unsigned char aShard, chatd::Priv aOwnPriv, const uint64_t& peer, chatd::Priv peerPriv, uint32_t ts,
+    const Summary& summary)
 :ChatRoom(parent, chatid, false, aShard, aOwnPriv, ts), mPeer(peer),
   mPeerPriv(peerPriv), mContact(*parent.client.contactList->contactFromUserId(peer)),
   mRoomGui(nullptr)
 {
     //mTitleString is set by Contact::attachChatRoom() via updateTitle()
     mContact.attachChatRoom(*this); //defers title callbacks so they are not called during construction
-    initWithChatd();
+    //the chatd::Chat is created on demand, see ChatRoom::chat()
+    mSummary = summary;
     mRoomGui = addAppItem();
     mIsInitializing = false;
 }
@@ -1462,7 +1579,7 @@ PeerChatRoom::~PeerChatRoom()
     if (mRoomGui && (parent.client.initState() != Client::kInitTerminated))
         parent.client.app.chatListHandler()->removePeerChatItem(*mRoomGui);
     auto chatd = parent.client.chatd.get();
-    if (chatd)
+    if (chatd && mChat)
         chatd->leave(mChatid);
 }
 
@@ -1596,7 +1713,7 @@ void GroupChatRoom::deleteSelf()
             return;
         }
 
-        auto db = parent.client.db;
+        auto& db = parent.client.db;
         db.query("delete from chat_peers where chatid=?", mChatid);
         db.query("delete from chats where chatid=?", mChatid);
         delete this;
@@ -1609,7 +1726,8 @@ ChatRoomList::ChatRoomList(Client& aClient)
 
 void ChatRoomList::loadFromDb()
 {
-    SqliteStmt stmt(client.db, "select chatid, ts_created ,shard, own_priv, peer, peer_priv, title from chats");
+    SqliteStmt stmt(client.db, "select chatid, ts_created ,shard, own_priv, peer, peer_priv, title, unread_count, "
+        "last_ts, last_msg_type, last_msg_idx, last_msgid, last_msg_sender, last_msg from chats");
     while(stmt.step())
     {
         auto chatid = stmt.uint64Col(0);
@@ -1618,12 +1736,25 @@ void ChatRoomList::loadFromDb()
             KR_LOG_WARNING("ChatRoomList: Attempted to load from db cache a chatid that is already in memory");
             continue;
         }
+        ChatRoom::Summary summary;
+        if (sqlite3_column_type(stmt, 7) != SQLITE_NULL)
+        {
+            summary.unreadCount = stmt.intCol(7);
+            summary.haveUnreadCount = true;
+        }
+        summary.lastTs = stmt.uintCol(8);
+        if (sqlite3_column_type(stmt, 9) != SQLITE_NULL)
+        {
+            Buffer buf(128);
+            stmt.blobCol(13, buf);
+            summary.lastTextMsg.assign(buf, stmt.intCol(9), stmt.uint64Col(11), stmt.uintCol(10), stmt.uint64Col(12));
+        }
         auto peer = stmt.uint64Col(4);
         ChatRoom* room;
         if (peer != uint64_t(-1))
-            room = new PeerChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), peer, (chatd::Priv)stmt.intCol(5), stmt.intCol(1));
+            room = new PeerChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), peer, (chatd::Priv)stmt.intCol(5), stmt.intCol(1), summary);
         else
-            room = new GroupChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), stmt.intCol(1), stmt.stringCol(6));
+            room = new GroupChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), stmt.intCol(1), stmt.stringCol(6), summary);
         emplace(chatid, room);
     }
 }
@@ -1738,7 +1869,8 @@ void ChatRoomList::removeRoom(GroupChatRoom& room)
 
 void GroupChatRoom::setRemoved()
 {
-    mChat->disconnect();
+    if (mChat)
+        mChat->disconnect();
     mOwnPriv = chatd::PRIV_NOTPRESENT;
     parent.client.db.query("update chats set own_priv=-1 where chatid=?", mChatid);
     notifyExcludedFromChat();
@@ -1875,7 +2007,7 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& aCh
     }
 
     //save to db
-    auto db = parent.client.db;
+    auto& db = parent.client.db;
     db.query("delete from chat_peers where chatid=?", mChatid);
     db.query(
         "insert or replace into chats(chatid, shard, peer, peer_priv, "
@@ -2036,7 +2168,7 @@ GroupChatRoom::~GroupChatRoom()
         parent.client.app.chatListHandler()->removeGroupChatItem(*mRoomGui);
 
     auto chatd = parent.client.chatd.get();
-    if (chatd)
+    if (chatd && mChat)
         chatd->leave(mChatid);
 
     for (auto& m: mPeers)
@@ -2103,7 +2235,7 @@ bool ChatRoom::syncRoomPropertiesWithApi(const mega::MegaTextChat &chat)
         throw std::runtime_error("syncWithApi: Shard number of chat can't change");
     if (chat.isGroup() != mIsGroup)
         throw std::runtime_error("syncWithApi: isGroup flag can't change");
-    auto db = parent.client.db;
+    auto& db = parent.client.db;
     chatd::Priv ownPriv = (chatd::Priv)chat.getOwnPrivilege();
     if (ownPriv != mOwnPriv)
     {
@@ -2131,13 +2263,15 @@ void ChatRoom::setAppChatHandler(IApp::IChatHandler* handler)
     if (mAppChatHandler)
         throw std::runtime_error("App chat handler is already set, remove it first");
 
+    // instantiate the chatd::Chat first, its init() must not see the handler yet
+    auto& chat = this->chat();
     mAppChatHandler = handler;
     chatd::DbInterface* dummyIntf = nullptr;
 // mAppChatHandler->init() may rely on some events, so we need to set mChatWindow as listener before
 // calling init(). This is safe, as and we will not get any async events before we
 //return to the event loop
-    mChat->setListener(mAppChatHandler);
-    mAppChatHandler->init(*mChat, dummyIntf);
+    chat.setListener(mAppChatHandler);
+    mAppChatHandler->init(chat, dummyIntf);
 }
 
 void ChatRoom::removeAppChatHandler()
@@ -2146,6 +2280,7 @@ void ChatRoom::removeAppChatHandler()
         return;
     mAppChatHandler = nullptr;
     mChat->setListener(this);
+    mChat->resetGetHistory(); //the app doesn't display the history anymore, it can be evicted
 }
 
 void GroupChatRoom::onUserJoin(Id userid, chatd::Priv privilege)
@@ -2268,7 +2403,7 @@ void GroupChatRoom::onUnreadChanged()
 bool GroupChatRoom::syncMembers(const UserPrivMap& users)
 {
     bool changed = false;
-    auto db = parent.client.db;
+    auto& db = parent.client.db;
     for (auto ourIt=mPeers.begin(); ourIt!=mPeers.end();)
     {
         auto userid = ourIt->first;
@@ -2377,7 +2512,8 @@ bool GroupChatRoom::syncWithApi(const mega::MegaTextChat& chat)
         if (mOwnPriv != chatd::PRIV_NOTPRESENT)
         {
             //we were reinvited
-            mChat->disable(false);
+            if (mChat)
+                mChat->disable(false);
             notifyRejoinedChat();
             if (parent.client.connected())
                 connect();
@@ -2469,7 +2605,9 @@ void Client::connectToChatd()
     for (auto& item: *chats)
     {
         auto& chat = *item.second;
-        if (!chat.chat().isDisabled())
+        // don't instantiate the chatd::Chat of a room we are not a member of
+        bool disabled = chat.hasChatdChat() ? chat.chat().isDisabled() : !chat.isActive();
+        if (!disabled)
             chat.connect();
     }
 }
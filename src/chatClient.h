@@ -20,7 +20,7 @@ namespace strophe { class Connection; }
 
 namespace mega { class MegaTextChat; class MegaTextChatList; }
 
-namespace strongvelope { class ProtocolHandler; }
+namespace strongvelope { class ProtocolHandler; class SharedKeyCache; class VerifiedMsgCache; }
 
 struct sqlite3;
 class Buffer;
@@ -55,6 +55,15 @@ class ChatRoom: public chatd::Listener, public DeleteTrackable
 {
     //@cond PRIVATE
 public:
+    /** Room state that the chat list needs, as persisted in the db. Used
+     * instead of the chatd::Chat until the latter is instantiated */
+    struct Summary
+    {
+        int unreadCount = 0;
+        bool haveUnreadCount = false;
+        uint32_t lastTs = 0;
+        chatd::LastTextMsgState lastTextMsg;
+    };
     ChatRoomList& parent;
 protected:
     IApp::IChatHandler* mAppChatHandler = nullptr;
@@ -65,11 +74,13 @@ protected:
     chatd::Priv mOwnPriv;
     chatd::Chat* mChat = nullptr;
     bool mIsInitializing = true;
+    Summary mSummary;
     std::string mTitleString;
     uint32_t mCreationTs;
     void notifyTitleChanged();
     bool syncRoomPropertiesWithApi(const ::mega::MegaTextChat& chat);
     void switchListenerToApp();
+    virtual void initWithChatd() = 0;
     void createChatdChat(const karere::SetOfIds& initialUsers); //We can't do the join in the ctor, as chatd may fire callbcks synchronously from join(), and the derived class will not be constructed at that point.
     void notifyExcludedFromChat();
     void notifyRejoinedChat();
@@ -95,11 +106,32 @@ public:
 
     virtual ~ChatRoom(){}
 
-    /** @brief returns the chatd::Chat chat object associated with the room */
-    chatd::Chat& chat() { return *mChat; }
+    /** @brief returns the chatd::Chat chat object associated with the room.
+     * Rooms loaded from the db create it (and its crypto and db layers) on first access */
+    chatd::Chat& chat()
+    {
+        if (!mChat)
+            initWithChatd();
+        return *mChat;
+    }
 
     /** @brief returns the chatd::Chat chat object associated with the room */
-    const chatd::Chat& chat() const { return *mChat; }
+    const chatd::Chat& chat() const { return const_cast<ChatRoom*>(this)->chat(); }
+
+    /** @brief Whether the chatd::Chat object of the room has been created */
+    bool hasChatdChat() const { return mChat != nullptr; }
+
+    /** @brief The number of unread messages. Served from the persisted room
+     * summary if the chatd::Chat is not instantiated yet */
+    int unreadCount() const;
+
+    /** @brief The timestamp of the newest message, from the room summary if
+     * the chatd::Chat is not instantiated yet */
+    uint32_t lastMessageTs() const;
+
+    /** @brief Same as \c chatd::Chat::lastTextMessage(), but served from the
+     * room summary if the chatd::Chat is not instantiated yet */
+    uint8_t lastTextMessage(chatd::LastTextMsg*& msg);
 
     /** @brief The chatid of the chatroom */
     const uint64_t& chatid() const { return mChatid; }
@@ -122,10 +154,10 @@ public:
     bool isActive() const { return mOwnPriv != chatd::PRIV_NOTPRESENT; }
 
     /** @brief The online state reported by chatd for that chatroom */
-    chatd::ChatState chatdOnlineState() const { return mChat->onlineState(); }
+    chatd::ChatState chatdOnlineState() const { return mChat ? mChat->onlineState() : chatd::kChatStateOffline; }
 
     /** @brief send a notification to the chatroom that the user is typing. */
-    virtual void sendTypingNotification() { mChat->sendTypingNotification(); }
+    virtual void sendTypingNotification() { chat().sendTypingNotification(); }
 
     /** @brief The application-side event handler that receives events from
      * the chatd chatroom and events about title, online status and unread
@@ -195,14 +227,14 @@ protected:
     virtual bool syncWithApi(const mega::MegaTextChat& chat);
     bool syncPeerPriv(chatd::Priv priv);
     static uint64_t getSdkRoomPeer(const ::mega::MegaTextChat& chat);
-    void initWithChatd();
+    virtual void initWithChatd();
     virtual void connect();
     void updateTitle(const std::string& title);
     friend class Contact;
     friend class ChatRoomList;
     PeerChatRoom(ChatRoomList& parent, const uint64_t& chatid,
             unsigned char shard, chatd::Priv ownPriv, const uint64_t& peer,
-            chatd::Priv peerPriv, uint32_t ts);
+            chatd::Priv peerPriv, uint32_t ts, const Summary& summary);
     PeerChatRoom(ChatRoomList& parent, const mega::MegaTextChat& room, Contact& contact);
     ~PeerChatRoom();
     //@endcond
@@ -294,7 +326,7 @@ public:
     virtual IApp::IChatListItem* roomGui() { return mRoomGui; }
     void deleteSelf(); //<Deletes the room from db and then immediately destroys itself (i.e. delete this)
     void makeTitleFromMemberNames();
-    void initWithChatd();
+    virtual void initWithChatd();
     void setRemoved();
     virtual void connect();
     promise::Promise<void> memberNamesResolved() const;
@@ -305,7 +337,7 @@ public:
     GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& chat);
     GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
                   unsigned char aShard, chatd::Priv aOwnPriv, uint32_t ts,
-                  const std::string& title);
+                  const std::string& title, const Summary& summary);
     ~GroupChatRoom();
 public:
     virtual promise::Promise<void> mediaCall(AvFlags av);
@@ -333,7 +365,7 @@ public:
      */
     virtual Presence presence() const
     {
-        return (mChat->onlineState() == chatd::kChatStateOnline)
+        return (chatdOnlineState() == chatd::kChatStateOnline)
                 ? Presence::kOnline
                 : Presence::kOffline;
     }
@@ -544,6 +576,12 @@ protected:
     Id mMyHandle = Id::null(); //mega::UNDEF
     std::string mSid;
     std::unique_ptr<UserAttrCache> mUserAttrCache;
+    /** Pairwise keys shared by the strongvelope instances of all chats. Declared
+     * after (and so destroyed before) mUserAttrCache, as it is subscribed to it */
+    std::unique_ptr<strongvelope::SharedKeyCache> mSharedKeyCache;
+    /** Authenticated and decrypted messages, kept in a separate db file that
+     * survives rebuilds of the main db. Removed only on logout */
+    std::unique_ptr<strongvelope::VerifiedMsgCache> mVerifiedMsgCache;
     std::string mMyEmail;
     ConnState mConnState = kDisconnected;
     promise::Promise<void> mConnectPromise;
@@ -628,6 +666,8 @@ public:
     unsigned short mMyPubRsaLen = 0;
     IApp::ILoginDialog::Handle mLoginDlg;
     UserAttrCache& userAttrCache() const { return *mUserAttrCache; }
+    /** @brief The x25519 shared key cache, i.e. for its hit/miss counters */
+    strongvelope::SharedKeyCache& sharedKeyCache() const { return *mSharedKeyCache; }
     presenced::Client& presenced() { return mPresencedClient; }
     bool contactsLoaded() const { return mContactsLoaded; }
     ConnState connState() const { return mConnState; }
@@ -782,6 +822,31 @@ public:
      * @brief Returns our own presence, as received by the presenced client
      */
     Presence ownPresence() const { return mOwnPresence; }
+    /** @brief Settings of the chatd client. They are kept here, as the chatd
+     * client is (re)created at login, and are applied to it on creation */
+    struct ChatdSettings
+    {
+        /** Mask of chatd::Client::kOptXXX flags */
+        uint32_t options = 0;
+        /** See chatd::Client::maxHistInRamPerChat and maxHistInRam */
+        size_t maxHistInRamPerChat = 0;
+        size_t maxHistInRam = 0;
+        /** See chatd::Client::setDecryptThreads() */
+        unsigned decryptThreads = 0;
+        /** See chatd::Client::maxDecryptAhead, used with kOptDecryptAhead */
+        unsigned maxDecryptAhead = 256;
+        /** Max send keys kept in RAM per chat, see strongvelope::ProtocolHandler::
+         * setMaxKeysInRam(). 0 keeps the default of ProtocolHandler */
+        size_t maxKeysInRam = 0;
+        /** Send keys received more than that many seconds ago are deleted from the
+         * db when a chat is loaded, see strongvelope::ProtocolHandler::pruneKeys().
+         * 0 keeps all keys */
+        uint32_t sendKeyMaxAge = 0;
+    };
+    const ChatdSettings& chatdSettings() const { return mChatdSettings; }
+    /** @brief Stores the settings, and applies them to the chatd client, if any */
+    void setChatdSettings(const ChatdSettings& settings);
+
     /** @brief Creates a group chatroom with the specified peers, privileges
      * and title.
      * @param peers A vector of userhandle and privilege pairs for each of
@@ -815,8 +880,13 @@ protected:
     std::string mLastScsn;
     void heartbeat();
     InitState mInitState = kInitCreated;
+    ChatdSettings mChatdSettings;
+    void createChatdClient();
+    void applyChatdSettings();
     void setInitState(InitState newState);
     std::string dbPath(const std::string& sid) const;
+    std::string verifiedMsgCachePath(const std::string& sid) const;
+    void openVerifiedMsgCache();
     bool openDb(const std::string& sid);
     void createDb();
     void wipeDb(const std::string& sid);
@@ -831,6 +901,7 @@ protected:
     void loadContactListFromApi();
     void loadContactListFromApi(::mega::MegaUserList& contactList);
     strongvelope::ProtocolHandler* newStrongvelope(karere::Id chatid);
+    size_t maxKeysInRam() const;
     promise::Promise<void> connectToPresenced(Presence pres);
     promise::Promise<void> connectToPresencedWithUrl(const std::string& url, Presence forcedPres);
  //   void setOwnPresence(Presence pres);
@@ -82,6 +82,47 @@ Client::Client(karere::Client *client, Id userId)
 {
 }
 
+void Client::setDecryptThreads(unsigned numThreads)
+{
+    mDecryptPool.reset(numThreads ? new karere::WorkerPool(numThreads) : nullptr);
+    CHATD_LOG_DEBUG("Decrypt pool: %u threads", numThreads);
+}
+
+size_t Client::trimHistory(bool aggressive)
+{
+    size_t evicted = 0;
+    size_t total = 0;
+    std::vector<Chat*> chats;
+    for (auto& item: mChatForChatId)
+    {
+        auto& chat = *item.second;
+        if (aggressive)
+            evicted += chat.trimHistory(0);
+        else if (maxHistInRamPerChat)
+            evicted += chat.trimHistory(maxHistInRamPerChat);
+        total += chat.size();
+        chats.push_back(&chat);
+    }
+    if (aggressive || !maxHistInRam || total <= maxHistInRam)
+        return evicted;
+
+    // over the global limit - trim the biggest chats first
+    std::sort(chats.begin(), chats.end(), [](Chat* a, Chat* b) { return a->size() > b->size(); });
+    for (auto chat: chats)
+    {
+        size_t excess = total - maxHistInRam;
+        size_t size = chat->size();
+        auto count = chat->trimHistory((size > excess) ? size - excess : 0);
+        evicted += count;
+        total -= count;
+        if (total <= maxHistInRam)
+            break;
+    }
+    if (evicted)
+        CHATD_LOG_DEBUG("trimHistory: evicted %zu messages, %zu left in RAM", evicted, total);
+    return evicted;
+}
+
 Chat& Client::createChat(Id chatid, int shardNo, const std::string& url,
     Listener* listener, const karere::SetOfIds& users, ICrypto* crypto, uint32_t chatCreationTs, bool isGroup)
 {
@@ -238,6 +279,7 @@ void Connection::onSocketClose(int errcode, int errtype, const std::string& reas
         mShardNo, reason.c_str());
     
     disableInactivityTimer();
+    mSendBatch.clear(); //lost with the socket, same as if they were already sent
     auto oldState = mState;
     mState = kStateDisconnected;
 
@@ -445,16 +487,70 @@ bool Connection::sendBuf(Buffer&& buf)
 {
     if (!isLoggedIn() && !isConnected())
         return false;
-    
+
+    if (!mSendBatch.empty())
+    {
+        // preserve ordering with the queued commands
+        queueCommand(buf);
+        buf.free();
+        return flushSendBatch();
+    }
     bool rc = wsSendMessage(buf.buf(), buf.dataSize());
     buf.free();
     return rc;
 }
+
+bool Connection::queueCommand(const StaticBuffer& cmd)
+{
+    if (!isLoggedIn() && !isConnected())
+        return false;
+
+    if (!mSendBatch.empty() && (mSendBatch.dataSize() + cmd.dataSize() > kMaxSendBatchSize))
+    {
+        flushSendBatch();
+    }
+    mSendBatch.append(cmd);
+    if (!mSendBatchFlushPending)
+    {
+        mSendBatchFlushPending = true;
+        auto wptr = weakHandle();
+        marshallCall([wptr, this]()
+        {
+            if (wptr.deleted())
+                return;
+            mSendBatchFlushPending = false;
+            flushSendBatch();
+        }, mClient.karereClient->appCtx);
+    }
+    return true;
+}
+
+bool Connection::flushSendBatch()
+{
+    if (mSendBatch.empty())
+        return true;
+
+    if (!isLoggedIn() && !isConnected())
+    {
+        mSendBatch.clear();
+        return false;
+    }
+    // sending is destructive to the buffer content, but we keep the memory for the next batch
+    bool rc = wsSendMessage(mSendBatch.buf(), mSendBatch.dataSize());
+    mSendBatch.clear();
+    if (!rc)
+    {
+        CHATD_LOG_WARNING("shard %d: Error sending batch of queued commands", mShardNo);
+    }
+    return rc;
+}
+
 bool Chat::sendCommand(Command&& cmd)
 {
     if (krLoggerWouldLog(krLogChannel_chatd, krLogLevelDebug))
         logSend(cmd);
-    bool result = mConnection.sendBuf(std::move(cmd));
+    bool result = mConnection.queueCommand(cmd);
+    cmd.free();
     if (!result)
         CHATID_LOG_DEBUG("  Can't send, we are offline");
     return result;
@@ -462,10 +558,10 @@ bool Chat::sendCommand(Command&& cmd)
 
 bool Chat::sendCommand(const Command& cmd)
 {
-    Buffer buf(cmd.buf(), cmd.dataSize());
     if (krLoggerWouldLog(krLogChannel_chatd, krLogLevelDebug))
         logSend(cmd);
-    auto result = mConnection.sendBuf(std::move(buf));
+    // the command is copied to the send batch, so it is preserved
+    auto result = mConnection.queueCommand(cmd);
     if (!result)
         CHATD_LOG_DEBUG("  Can't send, we are offline");
     return result;
@@ -528,7 +624,9 @@ promise::Promise<void> Connection::rejoinExistingChats()
         }
     }
     if (mClient.mKeepaliveType == OP_KEEPALIVEAWAY)
-        sendKeepalive(mClient.mKeepaliveType);
+        sendKeepalive(mClient.mKeepaliveType); //also flushes the queued JOINs
+    else
+        flushSendBatch();
     return mLoginPromise;
 }
 
@@ -699,6 +797,14 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     mLastReceivedId = info.lastRecvId;
     mLastSeenIdx = mDbInterface->getIdxOfMsgid(mLastSeenId);
     mLastReceivedIdx = mDbInterface->getIdxOfMsgid(mLastReceivedId);
+    mHaveUnreadCount = info.haveUnreadCount;
+    mUnreadCount = info.unreadCount;
+    uint32_t lastTs = 0;
+    mDbInterface->loadSummary(mLastTextMsg, lastTs);
+    if (mLastTextMsg.isValid())
+        mLastTextMsg.mIsNotified = true; //the app gets it from the chat list
+    if (lastTs > mLastMsgTs)
+        mLastMsgTs = lastTs;
 
     if ((mHaveAllHistory = mDbInterface->haveAllHistory()))
     {
@@ -727,10 +833,17 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
 Chat::~Chat()
 {
     CALL_LISTENER(onDestroy); //we don't delete because it may have its own idea of its lifetime (i.e. it could be a GUI class)
+    if (mClient.mDecryptPool) //jobs may reference the crypto module
+        mClient.mDecryptPool->waitIdle();
     try { delete mCrypto; }
     catch(std::exception& e)
     { CHATID_LOG_ERROR("EXCEPTION from ICrypto destructor: %s", e.what()); }
     mCrypto = nullptr;
+    clearEncryptedPending();
+    for (auto& item: mSending)
+    {
+        unindexSendingItem(item);
+    }
     clear();
     try { delete mDbInterface; }
     catch(std::exception& e)
@@ -782,13 +895,29 @@ void Connection::wsHandleMsgCb(char *data, size_t len)
     mInactivityBeats = 0;
     execCommand(StaticBuffer(data, len));
 }
-    
+
+void Connection::wsHandleFrameCb(const WebsocketsFrame& frame)
+{
+    mInactivityBeats = 0;
+    execCommand(*frame, frame);
+}
+
 // inbound command processing
 // multiple commands can appear as one WebSocket frame, but commands never cross frame boundaries
 // CHECK: is this assumption correct on all browsers and under all circumstances?
-void Connection::execCommand(const StaticBuffer& buf)
+void Connection::execCommand(const StaticBuffer& buf, const WebsocketsFrame& frame)
 {
     size_t pos = 0;
+    // consecutive OLDMSGs of the same chat are ingested as one batch, which is
+    // closed by any other command, or at the end of the frame
+    Chat* histBatchChat = nullptr;
+    auto endHistBatch = [&histBatchChat]()
+    {
+        if (!histBatchChat)
+            return;
+        histBatchChat->endHistBatch();
+        histBatchChat = nullptr;
+    };
 //IMPORTANT: Increment pos before calling the command handler, because the handler may throw, in which
 //case the next iteration will not advance and will execute the same command again, resulting in
 //infinite loop
@@ -796,6 +925,10 @@ void Connection::execCommand(const StaticBuffer& buf)
     {
       char opcode = buf.buf()[pos];
       Id chatid;
+      if (opcode != OP_OLDMSG)
+      {
+          endHistBatch();
+      }
       try
       {
         pos++;
@@ -852,9 +985,19 @@ void Connection::execCommand(const StaticBuffer& buf)
                     ID_CSTR(chatid), Command::opcodeToStr(opcode), ID_CSTR(msgid),
                     ID_CSTR(userid), keyid);
 
-                std::unique_ptr<Message> msg(new Message(msgid, userid, ts, updated, msgdata, msglen, false, keyid));
+                // reference the ciphertext in the frame, it is copied only when decrypted
+                std::unique_ptr<Message> msg(frame
+                    ? new Message(msgid, userid, ts, updated, frame, msgdata, msglen, keyid)
+                    : new Message(msgid, userid, ts, updated, msgdata, msglen, false, keyid));
                 msg->setEncrypted(1);
+                msg->setReceivedAsNew(opcode != OP_OLDMSG);
                 Chat& chat = mClient.chats(chatid);
+                if ((opcode == OP_OLDMSG) && (histBatchChat != &chat))
+                {
+                    endHistBatch();
+                    chat.beginHistBatch();
+                    histBatchChat = &chat;
+                }
                 if (opcode == OP_MSGUPD)
                 {
                     chat.onMsgUpdated(msg.release());
@@ -984,13 +1127,14 @@ void Connection::execCommand(const StaticBuffer& buf)
             default:
             {
                 CHATD_LOG_ERROR("Unknown opcode %d, ignoring all subsequent commands", opcode);
-                return;
+                return; //the batch was already closed
             }
         }
       }
       catch(BufferRangeError& e)
       {
             CHATD_LOG_ERROR("%s: Buffer bound check error while parsing %s:\n\t%s\n\tAborting command processing", ID_CSTR(chatid), Command::opcodeToStr(opcode), e.what());
+            endHistBatch();
             return;
       }
       catch(std::exception& e)
@@ -998,6 +1142,7 @@ void Connection::execCommand(const StaticBuffer& buf)
             CHATD_LOG_ERROR("%s: Exception while processing incoming %s: %s", ID_CSTR(chatid), Command::opcodeToStr(opcode), e.what());
       }
     }
+    endHistBatch();
 }
 
 void Chat::onNewKeys(StaticBuffer&& keybuf)
@@ -1059,6 +1204,7 @@ void Chat::onFetchHistDone()
             if (mLastTextMsg.isFetching())
             {
                 mLastTextMsg.clear();
+                mHaveNoTextMsg = true;
                 notifyLastTextMsg();
             }
         }
@@ -1096,6 +1242,10 @@ void Chat::loadAndProcessUnsent()
     CALL_DB(loadSendQueue, mSending);
     if (mSending.empty())
         return;
+    for (auto& item: mSending)
+    {
+        indexSendingItem(item);
+    }
     mNextUnsent = mSending.begin();
     replayUnsentNotifications();
 
@@ -1290,6 +1440,7 @@ void Chat::createMsgBackRefs(Message& msg)
 Chat::SendingItem* Chat::postMsgToSending(uint8_t opcode, Message* msg)
 {
     mSending.emplace_back(opcode, msg, mUsers);
+    indexSendingItem(mSending.back());
     CALL_DB(saveMsgToSending, mSending.back());
     if (mNextUnsent == mSending.end())
     {
@@ -1324,16 +1475,48 @@ bool Chat::msgEncryptAndSend(OutputQueue::iterator it)
     if (it->opcode() == OP_NEWMSG && msg->backRefs.empty())
         createMsgBackRefs(*msg);
 
-    if (mEncryptionHalted || (mOnlineState != kChatStateOnline))
+    if (mOnlineState != kChatStateOnline)
         return false;
 
+    if (mEncryptionHalted)
+    {
+        // In pipelined mode, messages behind the one being encrypted are still
+        // encrypted as long as that doesn't need another key rotation, and
+        // are sent right after it
+        if (!(mClient.options & Client::kOptPipelinedEncrypt)
+         || !mCrypto->canEncryptImmediately(*msg))
+            return false;
+    }
+
     auto msgCmd = new MsgCommand(it->opcode(), mChatId, client().userId(),
          msg->id(), msg->ts, msg->updated, msg->keyid);
 
     CHATD_LOG_CRYPTO_CALL("Calling ICrypto::encrypt()");
     auto pms = mCrypto->msgEncrypt(it->msg, msgCmd);
     if (pms.succeeded())
-        return sendKeyAndMessage(pms.value());
+    {
+        if (!mEncryptionHalted)
+            return sendKeyAndMessage(pms.value());
+
+        mEncryptedPending.push_back(pms.value());
+        return true;
+    }
+    if (mEncryptionHalted) //the crypto module was wrong
+    {
+        CHATID_LOG_ERROR("msgEncryptAndSend: ICrypto::canEncryptImmediately() returned true, but encryption is async");
+        assert(false);
+        // discard the result, the message is encrypted again after the halted one
+        pms.then([](std::pair<MsgCommand*, KeyCommand*> result)
+        {
+            delete result.first;
+        });
+        pms.fail([msgCmd](const promise::Error& err)
+        {
+            delete msgCmd;
+            return err;
+        });
+        return false;
+    }
 
     mEncryptionHalted = true;
     CHATID_LOG_DEBUG("Can't encrypt message immediately, halting output");
@@ -1345,6 +1528,8 @@ bool Chat::msgEncryptAndSend(OutputQueue::iterator it)
         assert(mSending.front().rowid == rowid);
 
         sendKeyAndMessage(result);
+        // send what was encrypted meanwhile, in order
+        sendEncryptedPending();
         mEncryptionHalted = false;
         flushOutputQueue();
     });
@@ -1361,6 +1546,26 @@ bool Chat::msgEncryptAndSend(OutputQueue::iterator it)
     //The GUI should by default show it as sending
 }
 
+void Chat::sendEncryptedPending()
+{
+    auto cmds = std::move(mEncryptedPending);
+    mEncryptedPending.clear();
+    for (auto& cmd: cmds)
+    {
+        sendKeyAndMessage(cmd);
+        delete cmd.first;
+    }
+}
+
+void Chat::clearEncryptedPending()
+{
+    for (auto& cmd: mEncryptedPending)
+    {
+        delete cmd.first;
+    }
+    mEncryptedPending.clear();
+}
+
 // Can be called for a message in history or a NEWMSG,MSGUPD,MSGUPDX message in sending queue
 Message* Chat::msgModify(Message& msg, const char* newdata, size_t newlen, void* userp)
 {
@@ -1400,6 +1605,17 @@ Message* Chat::msgModify(Message& msg, const char* newdata, size_t newlen, void*
             return;
         
         postMsgToSending(upd->isSending() ? OP_MSGUPDX : OP_MSGUPD, upd);
+
+        //last text msg stuff: edits of confirmed messages are handled when the
+        //server echoes them, but edits of a pending message are not
+        if (upd->isSending() && mLastTextMsg.isValid()
+            && (mLastTextMsg.idx() == CHATD_IDX_INVALID) && (mLastTextMsg.xid() == upd->id()))
+        {
+            if (upd->isText())
+                onLastTextMsgUpdated(*upd);
+            else
+                findAndNotifyLastTextMsg();
+        }
         onMsgTimestamp(newage);
     }, mClient.karereClient->appCtx);
     
@@ -1461,14 +1677,7 @@ void Chat::onLastReceived(Id msgid)
         mLastReceivedIdx = idx;
         notifyOldest = lownum();
     }
-    for (Idx i=notifyOldest; i<=mLastReceivedIdx; i++)
-    {
-        auto& msg = at(i);
-        if (msg.userid == mClient.mUserId)
-        {
-            CALL_LISTENER(onMessageStatusChange, i, Message::kDelivered, msg);
-        }
-    }
+    notifyStatusRange(notifyOldest, mLastReceivedIdx, Message::kDelivered);
 }
 
 void Chat::onLastSeen(Id msgid)
@@ -1486,7 +1695,9 @@ void Chat::onLastSeen(Id msgid)
             {
                 CHATD_LOG_WARNING("onLastSeen: Setting last seen index to an older message");
             }
+            Idx oldIdx = mLastSeenIdx;
             mLastSeenIdx = idx;
+            onLastSeenIdxChanged(oldIdx);
         }
     }
     else
@@ -1500,6 +1711,7 @@ void Chat::onLastSeen(Id msgid)
         }
         //notify about messages that have become 'seen'
         Idx notifyOldest;
+        Idx oldIdx = mLastSeenIdx;
         if (mLastSeenIdx != CHATD_IDX_INVALID)
         {
             if (idx < mLastSeenIdx)
@@ -1520,14 +1732,8 @@ void Chat::onLastSeen(Id msgid)
             mLastSeenIdx = idx;
             notifyOldest = lownum();
         }
-        for (Idx i=notifyOldest; i<=mLastSeenIdx; i++)
-        {
-            auto& msg = at(i);
-            if (msg.userid != mClient.mUserId)
-            {
-                CALL_LISTENER(onMessageStatusChange, i, Message::kSeen, msg);
-            }
-        }
+        onLastSeenIdxChanged(oldIdx);
+        notifyStatusRange(notifyOldest, mLastSeenIdx, Message::kSeen);
     }
     CALL_LISTENER(onUnreadChanged);
 }
@@ -1565,18 +1771,13 @@ bool Chat::setMessageSeen(Idx idx)
             Idx lowest = lownum()-1;
             notifyStart = (mLastSeenIdx < lowest) ? lowest : mLastSeenIdx;
         }
+        Idx oldIdx = mLastSeenIdx;
         mLastSeenIdx = idx;
+        onLastSeenIdxChanged(oldIdx);
         Idx highest = highnum();
         Idx notifyEnd = (mLastSeenIdx > highest) ? highest : mLastSeenIdx;
 
-        for (Idx i=notifyStart+1; i<=notifyEnd; i++)
-        {
-            auto& m = at(i);
-            if (m.userid != mClient.mUserId)
-            {
-                CALL_LISTENER(onMessageStatusChange, i, Message::kSeen, m);
-            }
-        }
+        notifyStatusRange(notifyStart+1, notifyEnd, Message::kSeen);
         CALL_LISTENER(onUnreadChanged);
     }, mClient.karereClient->appCtx);
     
@@ -1596,6 +1797,9 @@ bool Chat::setMessageSeen(Id msgid)
 
 int Chat::unreadMsgCount() const
 {
+    if (mHaveUnreadCount)
+        return mUnreadCount;
+
     if (mLastSeenIdx == CHATD_IDX_INVALID)
     {
         Message* msg;
@@ -1606,12 +1810,14 @@ int Chat::unreadMsgCount() const
         }
         else
         {
-            return -mDbInterface->getPeerMsgCountAfterIdx(CHATD_IDX_INVALID);
+            setUnreadCount(-mDbInterface->getPeerMsgCountAfterIdx(CHATD_IDX_INVALID));
+            return mUnreadCount;
         }
     }
     else if (mLastSeenIdx < lownum())
     {
-        return mDbInterface->getPeerMsgCountAfterIdx(mLastSeenIdx);
+        setUnreadCount(mDbInterface->getPeerMsgCountAfterIdx(mLastSeenIdx));
+        return mUnreadCount;
     }
 
     Idx first = mLastSeenIdx+1;
@@ -1619,17 +1825,111 @@ int Chat::unreadMsgCount() const
     auto last = highnum();
     for (Idx i=first; i<=last; i++)
     {
+        //messages still waiting for decryption are not in the db yet, and are
+        //counted by msgIncomingAfterDecrypt() when decrypted
         auto& msg = at(i);
-        if (msg.userid != mClient.userId()               // skip own messages
-                && !(msg.updated && !msg.size())         // skip deleted messages
-                && (msg.type != Message::kMsgRevokeAttachment))  // skip revoke messages
+        if ((msg.isEncrypted() != 1) && countsAsUnread(msg))
         {
             count++;
         }
     }
+    setUnreadCount(count);
     return count;
 }
 
+bool Chat::countsAsUnread(const Message& msg) const
+{
+    return (msg.userid != mClient.userId())              // skip own messages
+        && !(msg.updated && !msg.size())                 // skip deleted messages
+        && (msg.type != Message::kMsgRevokeAttachment);  // skip revoke messages
+}
+
+void Chat::setUnreadCount(int count) const
+{
+    mUnreadCount = count;
+    mHaveUnreadCount = true;
+    CALL_DB(setUnreadCount, count);
+}
+
+void Chat::invalidateUnreadCount()
+{
+    if (!mHaveUnreadCount)
+        return;
+    mHaveUnreadCount = false;
+    CALL_DB(setUnreadCount, kUnreadCountInvalid);
+}
+
+void Chat::updateUnreadCount(Idx idx, int delta)
+{
+    if (!mHaveUnreadCount)
+        return;
+    if (mLastSeenIdx == CHATD_IDX_INVALID)
+    {
+        //no last-seen, the count is negative, as a 'more than'
+        setUnreadCount(mUnreadCount - delta);
+    }
+    else if (idx > mLastSeenIdx)
+    {
+        setUnreadCount(mUnreadCount + delta);
+    }
+}
+
+void Chat::onLastSeenIdxChanged(Idx oldIdx)
+{
+    if (!mHaveUnreadCount || (oldIdx == mLastSeenIdx))
+        return;
+    //we can only subtract the newly seen messages if they are all in RAM
+    if ((oldIdx == CHATD_IDX_INVALID) || (mLastSeenIdx == CHATD_IDX_INVALID)
+        || (mLastSeenIdx < oldIdx) || empty()
+        || (oldIdx + 1 < lownum()) || (mLastSeenIdx > highnum()))
+    {
+        invalidateUnreadCount();
+        return;
+    }
+    int count = mUnreadCount;
+    for (Idx i = oldIdx + 1; i <= mLastSeenIdx; i++)
+    {
+        auto& msg = at(i);
+        if ((msg.isEncrypted() != 1) && countsAsUnread(msg)) //see unreadMsgCount()
+            count--;
+    }
+    if (count < 0)
+    {
+        CHATID_LOG_WARNING("Unread count became negative (%d), recalculating", count);
+        invalidateUnreadCount();
+        return;
+    }
+    setUnreadCount(count);
+}
+
+// Notifies that our messages (kDelivered) or others' messages (kSeen) in the
+// range have changed their status. The range is clipped to the RAM history
+void Chat::notifyStatusRange(Idx fromIdx, Idx toIdx, Message::Status newStatus)
+{
+    if (empty())
+        return;
+    if (fromIdx < lownum())
+        fromIdx = lownum();
+    if (toIdx > highnum())
+        toIdx = highnum();
+    if (fromIdx > toIdx)
+        return;
+
+    CALL_LISTENER(onMessageStatusRangeChange, fromIdx, toIdx, newStatus);
+    if (!(mClient.options & Client::kOptPerMessageStatusNotify))
+        return;
+
+    bool ours = (newStatus == Message::kDelivered);
+    for (Idx i = fromIdx; i <= toIdx; i++)
+    {
+        auto& msg = at(i);
+        if ((msg.userid == mClient.mUserId) == ours)
+        {
+            CALL_LISTENER(onMessageStatusChange, i, newStatus, msg);
+        }
+    }
+}
+
 void Chat::flushOutputQueue(bool fromStart)
 {
 //We assume that if fromStart is set, then we have to set mIgnoreKeyAcks
@@ -1637,7 +1937,10 @@ void Chat::flushOutputQueue(bool fromStart)
 //the crypto module would get out of sync with the I/O sequence, which means
 //that it must have been reset/freshly initialized, and we have to skip
 //the KEYID responses for the keys we flush from the output queue
-    if(mEncryptionHalted || !mConnection.isLoggedIn())
+    if(!mConnection.isLoggedIn())
+        return;
+    // in pipelined mode, msgEncryptAndSend() decides if it can continue
+    if (mEncryptionHalted && !(mClient.options & Client::kOptPipelinedEncrypt))
         return;
 
     if (fromStart)
@@ -1680,6 +1983,7 @@ void Chat::flushOutputQueue(bool fromStart)
 
 void Chat::moveItemToManualSending(OutputQueue::iterator it, ManualSendReason reason)
 {
+    unindexSendingItem(*it);
     CALL_DB(deleteItemFromSending, it->rowid);
     CALL_DB(saveItemToManualSending, *it, reason);
     CALL_LISTENER(onManualSendRequired, it->msg, it->rowid, reason); //GUI should put this message at end of that list of messages requiring 'manual' resend
@@ -1709,24 +2013,33 @@ void Chat::joinRangeHist(const ChatDbInfo& dbInfo)
 
 void Client::msgConfirm(Id msgxid, Id msgid)
 {
-    // CHECK: is it more efficient to keep a separate mapping of msgxid to messages?
-    for (auto& chat: mChatForChatId)
+    // NEWMSGID doesn't carry a chatid, so we look it up by msgxid
+    Chat* chat = chatForMsgxid(msgxid);
+    if (!chat || (chat->msgConfirm(msgxid, msgid) == CHATD_IDX_INVALID))
     {
-        if (chat.second->msgConfirm(msgxid, msgid) != CHATD_IDX_INVALID)
-            return;
+        CHATD_LOG_DEBUG("msgConfirm: No chat knows about message transaction id %s", ID_CSTR(msgxid));
     }
-    CHATD_LOG_DEBUG("msgConfirm: No chat knows about message transaction id %s", ID_CSTR(msgxid));
 }
 
 //called when MSGID is received
 bool Client::onMsgAlreadySent(Id msgxid, Id msgid)
 {
-    for (auto& chat: mChatForChatId)
-    {
-        if (chat.second->msgAlreadySent(msgxid, msgid))
-            return true;
-    }
-    return false;
+    Chat* chat = chatForMsgxid(msgxid);
+    return chat && chat->msgAlreadySent(msgxid, msgid);
+}
+
+void Chat::indexSendingItem(const SendingItem& item)
+{
+    // only NEWMSG-s are confirmed by msgxid. MSGUPDX-s reuse the msgxid of
+    // the NEWMSG they edit, so they must not overwrite its entry
+    if (item.opcode() == OP_NEWMSG)
+        mClient.addMsgxid(item.msg->id(), *this);
+}
+
+void Chat::unindexSendingItem(const SendingItem& item)
+{
+    if ((item.opcode() == OP_NEWMSG) && item.msg)
+        mClient.removeMsgxid(item.msg->id());
 }
 bool Chat::msgAlreadySent(Id msgxid, Id msgid)
 {
@@ -1742,8 +2055,8 @@ bool Chat::msgAlreadySent(Id msgxid, Id msgid)
 
 Message* Chat::msgRemoveFromSending(Id msgxid, Id msgid)
 {
-    // as msgConirm() is tried on all chatids, it's normal that we don't have
-    // the message, so no error logging of error, just return invalid index
+    // the msgxid index routes the confirmation to us, but the message is
+    // expected to be at the front of the send queue
     if (mSending.empty())
         return nullptr;
 
@@ -1774,6 +2087,7 @@ Message* Chat::msgRemoveFromSending(Id msgxid, Id msgid)
     assert(msg);
     assert(msg->isSending());
 
+    mClient.removeMsgxid(msgxid);
     CALL_DB(deleteItemFromSending, item.rowid);
     mSending.pop_front(); //deletes item
     return msg;
@@ -1789,7 +2103,7 @@ Idx Chat::msgConfirm(Id msgxid, Id msgid)
     CHATID_LOG_DEBUG("recv NEWMSGID: '%s' -> '%s'", ID_CSTR(msgxid), ID_CSTR(msgid));
     //put into history
     msg->setId(msgid, false);
-    push_forward(msg);
+    msg = push_forward(msg);
     auto idx = mIdToIndexMap[msgid] = highnum();
     CALL_DB(addMsgToHistory, *msg, idx);
     //update any following MSGUPDX-s referring to this msgxid
@@ -1819,6 +2133,8 @@ Idx Chat::msgConfirm(Id msgxid, Id msgid)
                 mLastTextMsg.confirm(idx, msgid);
                 if (!mLastTextMsg.mIsNotified)
                     notifyLastTextMsg();
+                else
+                    CALL_DB(saveLastTextMsg, mLastTextMsg);
             }
         }
         else if (idx > mLastTextMsg.idx())
@@ -1892,6 +2208,7 @@ void Chat::rejectGeneric(uint8_t opcode)
     {
         throw std::runtime_error("rejectGeneric(mustBeInSending): Rejected command is not at the front of the send queue");
     }
+    unindexSendingItem(mSending.front());
     CALL_DB(deleteItemFromSending, mSending.front().rowid);
     mSending.pop_front();
 }
@@ -1935,10 +2252,16 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             idx = msgit->second;
             auto& histmsg = at(idx);
             prevType = histmsg.type;
+            bool wasUnread = countsAsUnread(histmsg);
             histmsg.takeFrom(std::move(*msg));
             histmsg.updated = msg->updated;
             histmsg.type = msg->type;
             histmsg.userid = msg->userid;
+            bool isUnread = countsAsUnread(histmsg);
+            if (wasUnread != isUnread)
+            {
+                updateUnreadCount(idx, isUnread ? 1 : -1);
+            }
 
             if (idx >= mNextHistFetchIdx)
             {
@@ -1961,8 +2284,8 @@ void Chat::onMsgUpdated(Message* cipherMsg)
                     onLastTextMsgUpdated(histmsg, idx);
                 }
                 else //our last text msg was deleted or changed to management
-                {    //message, find another one
-                    findAndNotifyLastTextMsg();
+                {    //message, find an older one
+                    findAndNotifyLastTextMsg(idx);
                 }
             }
         }
@@ -1970,6 +2293,21 @@ void Chat::onMsgUpdated(Message* cipherMsg)
         {
             idx = CHATD_IDX_INVALID;
             prevType = Message::kMsgInvalid;
+            invalidateUnreadCount();
+
+            //last text msg stuff: it may have been evicted from RAM
+            if (mLastTextMsg.isValid() && (mLastTextMsg.idx() != CHATD_IDX_INVALID)
+                && (mLastTextMsg.id() == msg->id()) && (msg->type != Message::kMsgTruncate))
+            {
+                if (msg->isText())
+                {
+                    onLastTextMsgUpdated(*msg, mLastTextMsg.idx());
+                }
+                else
+                {
+                    findAndNotifyLastTextMsg(mLastTextMsg.idx());
+                }
+            }
         }
 
         if (msg->type == Message::kMsgTruncate)
@@ -2006,6 +2344,7 @@ void Chat::handleTruncate(const Message& msg, Idx idx)
 
     CHATID_LOG_DEBUG("Truncating chat history before msgid %s, idx %d, fwdStart %d", ID_CSTR(msg.id()), idx, mForwardStart);
     CALL_DB(truncateHistory, msg);
+    invalidateUnreadCount();
     if (idx != CHATD_IDX_INVALID)
     {
         //GUI must detach and free any resources associated with
@@ -2053,7 +2392,20 @@ void Chat::handleTruncate(const Message& msg, Idx idx)
         mHasMoreHistoryInDb = false;
     }
     CALL_LISTENER(onUnreadChanged);
-    findAndNotifyLastTextMsg();
+
+    //last text msg stuff: messages after the truncate point are kept. If the
+    //last text message was before it, none of them is a text message
+    if ((idx == CHATD_IDX_INVALID) || (!mLastTextMsg.isValid() && !mHaveNoTextMsg))
+    {
+        findAndNotifyLastTextMsg();
+    }
+    else if (mLastTextMsg.isValid() && (mLastTextMsg.idx() != CHATD_IDX_INVALID)
+        && (mLastTextMsg.idx() <= idx))
+    {
+        mLastTextMsg.clear();
+        mHaveNoTextMsg = true;
+        notifyLastTextMsg();
+    }
 }
 
 Id Chat::makeRandomId()
@@ -2070,13 +2422,55 @@ void Chat::deleteMessagesBefore(Idx idx)
     {
         mBackwardList.clear();
         auto delCount = idx-mForwardStart;
-        mForwardList.erase(mForwardList.begin(), mForwardList.begin()+delCount);
+        mForwardList.erase_front(delCount);
         mForwardStart += delCount;
     }
     else
     {
-        mBackwardList.erase(mBackwardList.begin()+mForwardStart-idx, mBackwardList.end());
+        mBackwardList.truncate(mForwardStart-idx);
+    }
+}
+
+Idx Chat::msgIndexFromId(Id msgid) const
+{
+    auto it = mIdToIndexMap.find(msgid);
+    return (it == mIdToIndexMap.end()) ? mDbInterface->getIdxOfMsgid(msgid) : it->second;
+}
+
+Message* Chat::fetchFromDb(Idx num) const
+{
+    return mDbInterface->fetchDbMessage(num);
+}
+
+size_t Chat::trimHistory(size_t maxCount)
+{
+    if (maxCount < kMinHistInRam)
+        maxCount = kMinHistInRam;
+    // messages are written to the db only once decrypted
+    if (((size_t)size() <= maxCount) || !mOldestKnownMsgId
+        || (mServerFetchState != kHistNotFetching)
+        || (mDecryptOldHaltedAt != CHATD_IDX_INVALID) || (mDecryptNewHaltedAt != CHATD_IDX_INVALID)
+        || !mParallelDecryptOld.empty() || !mParallelDecryptNew.empty())
+        return 0;
+
+    Idx end = highnum() - (Idx)maxCount + 1; //oldest message to keep
+    if ((mNextHistFetchIdx != CHATD_IDX_INVALID) && (mNextHistFetchIdx + 1 < end))
+        end = mNextHistFetchIdx + 1; //the app has the messages after mNextHistFetchIdx
+    Idx low = lownum();
+    if (end <= low)
+        return 0;
+
+    for (Idx i = low; i < end; i++)
+    {
+        auto& msg = at(i);
+        mIdToIndexMap.erase(msg.id());
+        if (msg.backRefId)
+            mRefidToIdxMap.erase(msg.backRefId);
     }
+    deleteMessagesBefore(end);
+    mHasMoreHistoryInDb = true;
+    CHATID_LOG_DEBUG("trimHistory: evicted %d messages from RAM", end - low);
+    return end - low;
 }
 
 Message::Status Chat::getMsgStatus(const Message& msg, Idx idx) const
@@ -2129,7 +2523,7 @@ Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
 
     if (isNew)
     {
-        push_forward(message);
+        message = push_forward(message);
         idx = highnum();
         if (!mOldestKnownMsgId)
             mOldestKnownMsgId = msgid;
@@ -2150,7 +2544,7 @@ Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
             else
             {
                 //all history is in RAM, determine the index from RAM
-                push_back(message);
+                message = push_back(message);
                 idx = lownum();
             }
             //shouldn't we update this only after we save the msg to db?
@@ -2158,7 +2552,7 @@ Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
         }
         else //local history message - load from DB to RAM
         {
-            push_back(message);
+            message = push_back(message);
             idx = lownum();
             if (msgid == mOldestKnownMsgId)
             //we have just processed the oldest message from the db
@@ -2201,6 +2595,11 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         return true;
     }
 
+    if (isInParallelDecrypt(isNew, idx) || submitParallelDecrypt(isNew, msg, idx)
+        || decryptAhead(isNew, msg, idx))
+    {
+        return false;
+    }
     if (isNew)
     {
         if (mDecryptNewHaltedAt != CHATD_IDX_INVALID)
@@ -2226,6 +2625,19 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         return true;
     }
 
+    if (!pms.done() && (mClient.options & Client::kOptDecryptAhead) && mClient.maxDecryptAhead)
+    {
+        CHATID_LOG_DEBUG("Decryption could not be done immediately, decrypting next messages meanwhile");
+        auto entry = std::make_shared<ParallelDecrypt>(idx, nullptr);
+        (isNew ? mParallelDecryptNew : mParallelDecryptOld).push_back(entry);
+        if (isNew)
+            mDecryptNewHaltedAt = idx;
+        else
+            mDecryptOldHaltedAt = idx;
+        waitParallelDecrypt(isNew, entry, msg, pms);
+        return false;
+    }
+
     CHATID_LOG_DEBUG("Decryption could not be done immediately, halting for next messages");
     if (isNew)
         mDecryptNewHaltedAt = idx;
@@ -2235,83 +2647,376 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
     auto message = &msg;
     pms.fail([this, message, idx](const promise::Error& err) -> promise::Promise<Message*>
     {
-        assert(message->isEncrypted() == 1);
-        message->setEncrypted(2);
-        if ((err.type() != SVCRYPTO_ERRTYPE) ||
-            (err.code() != SVCRYPTO_ENOKEY))
-        {
-            CHATID_LOG_ERROR(
-                "Unrecoverable decrypt error at message %s(idx %d):'%s'\n"
-                "Message will not be decrypted", ID_CSTR(message->id()), idx, err.toString().c_str());
-        }
-        else
-        {
-            //we have a normal situation where a message was sent just before a user joined, so it will be undecryptable
-            //TODO: assert chatroom is not 1on1
-            CHATID_LOG_WARNING("No key to decrypt message %s, possibly message was sent just before user joined", ID_CSTR(message->id()));
-        }
-        return message;
+        return onDecryptError(message, idx, err);
     })
     .then([this, isNew, isLocal, idx](Message* message)
     {
+        onDelayedDecryptDone(isNew, isLocal, *message, idx);
+    });
+
+    return false; //decrypt was not done immediately
+}
+
+Message* Chat::onDecryptError(Message* message, Idx idx, const promise::Error& err)
+{
+    assert(message->isEncrypted() == 1);
+    message->setEncrypted(2);
+    message->detachFrame(); //it will stay encrypted, don't pin the frame
+    if ((err.type() != SVCRYPTO_ERRTYPE) ||
+        (err.code() != SVCRYPTO_ENOKEY))
+    {
+        CHATID_LOG_ERROR(
+            "Unrecoverable decrypt error at message %s(idx %d):'%s'\n"
+            "Message will not be decrypted", ID_CSTR(message->id()), idx, err.toString().c_str());
+    }
+    else
+    {
+        //we have a normal situation where a message was sent just before a user joined, so it will be undecryptable
+        //TODO: assert chatroom is not 1on1
+        CHATID_LOG_WARNING("No key to decrypt message %s, possibly message was sent just before user joined", ID_CSTR(message->id()));
+    }
+    return message;
+}
+
+void Chat::onDelayedDecryptDone(bool isNew, bool isLocal, Message& message, Idx idx)
+{
 #ifndef NDEBUG
-        if (isNew)
-            assert(mDecryptNewHaltedAt == idx);
-        else
-            assert(mDecryptOldHaltedAt == idx);
+    if (isNew)
+        assert(mDecryptNewHaltedAt == idx);
+    else
+        assert(mDecryptOldHaltedAt == idx);
 #endif
-        msgIncomingAfterDecrypt(isNew, false, *message, idx);
-        if (isNew)
+    msgIncomingAfterDecrypt(isNew, false, message, idx);
+    resumeDecrypt(isNew, isLocal);
+}
+
+// Process the messages queued after the halted one
+void Chat::resumeDecrypt(bool isNew, bool isLocal)
+{
+    if (isNew)
+    {
+        // Decrypt the rest - try to decrypt immediately (synchromously),
+        // so that order is guaranteed. Bail out of the loop at the first
+        // message that can't be decrypted immediately(msgIncomingAfterAdd()
+        // returns false). Will continue when the delayed decrypt finishes.
+        // Messages handed to the decrypt pool don't stop the loop, as
+        // their results are delivered in order
+
+        auto first = mDecryptNewHaltedAt + 1;
+        mDecryptNewHaltedAt = CHATD_IDX_INVALID;
+        auto last = highnum();
+        for (Idx i = first; i <= last; i++)
+        {
+            if (!msgIncomingAfterAdd(isNew, false, at(i), i) && !isInParallelDecrypt(isNew, i))
+                break;
+        }
+        if ((mServerFetchState == kHistDecryptingNew) &&
+            (mDecryptNewHaltedAt == CHATD_IDX_INVALID)) //all messages decrypted
         {
-            // Decrypt the rest - try to decrypt immediately (synchromously),
-            // so that order is guaranteed. Bail out of the loop at the first
-            // message that can't be decrypted immediately(msgIncomingAfterAdd()
-            // returns false). Will continue when the delayed decrypt finishes
+            mServerFetchState = kHistNotFetching;
+        }
+    }
+    else
+    {
+        // Old history
+        // Decrypt the rest synchronously, bail out on first that can't
+        // decrypt synchonously.
+        // Local messages are always decrypted, this is handled
+        // at the start of msgIncomingAfterAdd()
 
-            auto first = mDecryptNewHaltedAt + 1;
-            mDecryptNewHaltedAt = CHATD_IDX_INVALID;
-            auto last = highnum();
-            for (Idx i = first; i <= last; i++)
-            {
-                if (!msgIncomingAfterAdd(isNew, false, at(i), i))
-                    break;
-            }
-            if ((mServerFetchState == kHistDecryptingNew) &&
-                (mDecryptNewHaltedAt == CHATD_IDX_INVALID)) //all messages decrypted
+        assert(!isLocal);
+        auto first = mDecryptOldHaltedAt - 1;
+        mDecryptOldHaltedAt = CHATD_IDX_INVALID;
+        auto last = lownum();
+        beginHistBatch();
+        for (Idx i = first; i >= last; i--)
+        {
+            if (!msgIncomingAfterAdd(isNew, false, at(i), i) && !isInParallelDecrypt(isNew, i))
+                break;
+        }
+        endHistBatch();
+        if ((mServerFetchState == kHistDecryptingOld) &&
+            (mDecryptOldHaltedAt == CHATD_IDX_INVALID))
+        {
+            mServerFetchState = kHistNotFetching;
+            if (mServerOldHistCbEnabled)
             {
-                mServerFetchState = kHistNotFetching;
+                flushHistBatch();
+                CALL_LISTENER(onHistoryDone, kHistSourceServer);
             }
         }
+    }
+}
+
+struct Chat::ParallelDecrypt
+{
+    Idx idx;
+    std::unique_ptr<ICrypto::DecryptJob> job; //null if decrypted by msgDecrypt()
+    bool done = false;
+    bool cancelled = false;
+    ParallelDecrypt(Idx aIdx, ICrypto::DecryptJob* aJob): idx(aIdx), job(aJob){}
+};
+
+bool Chat::isInParallelDecrypt(bool isNew, Idx idx) const
+{
+    auto& queue = isNew ? mParallelDecryptNew : mParallelDecryptOld;
+    if (queue.empty())
+        return false;
+    return isNew
+        ? (idx >= queue.front()->idx && idx <= queue.back()->idx)
+        : (idx <= queue.front()->idx && idx >= queue.back()->idx);
+}
+
+// Hands the message to the decrypt pool if the crypto module can decrypt it
+// without async operations, and it is the next one to process - i.e. nothing
+// is halted, or it directly follows the messages already in the pool
+bool Chat::submitParallelDecrypt(bool isNew, Message& msg, Idx idx)
+{
+    auto pool = mClient.decryptPool();
+    if (!pool)
+        return false;
+
+    auto& queue = isNew ? mParallelDecryptNew : mParallelDecryptOld;
+    if (queue.empty())
+    {
+        if ((isNew ? mDecryptNewHaltedAt : mDecryptOldHaltedAt) != CHATD_IDX_INVALID)
+            return false;
+    }
+    else if (idx != (isNew ? queue.back()->idx + 1 : queue.back()->idx - 1))
+    {
+        return false;
+    }
+
+    auto job = mCrypto->msgDecryptJob(&msg);
+    if (!job)
+        return false;
+
+    auto entry = std::make_shared<ParallelDecrypt>(idx, job);
+    if (queue.empty())
+    {
+        if (isNew)
+            mDecryptNewHaltedAt = idx;
         else
+            mDecryptOldHaltedAt = idx;
+    }
+    queue.push_back(entry);
+
+    auto wptr = weakHandle();
+    auto appCtx = mClient.karereClient->appCtx;
+    pool->post([wptr, this, entry, isNew, appCtx]()
+    {
+        entry->job->run();
+        marshallCall([wptr, this, entry, isNew]()
         {
-            // Old history
-            // Decrypt the rest synchronously, bail out on first that can't
-            // decrypt synchonously.
-            // Local messages are always decrypted, this is handled
-            // at the start of this func
-
-            assert(!isLocal);
-            auto first = mDecryptOldHaltedAt - 1;
-            mDecryptOldHaltedAt = CHATD_IDX_INVALID;
-            auto last = lownum();
-            for (Idx i = first; i >= last; i--)
+            if (wptr.deleted() || entry->cancelled)
+                return;
+            entry->done = true;
+            deliverParallelDecrypts(isNew);
+        }, appCtx);
+    });
+    return true;
+}
+
+// In kOptDecryptAhead mode, decrypts the message that directly follows the ones
+// in the decrypt queue, while they are waiting. It is delivered after them
+bool Chat::decryptAhead(bool isNew, Message& msg, Idx idx)
+{
+    auto& queue = isNew ? mParallelDecryptNew : mParallelDecryptOld;
+    if (!(mClient.options & Client::kOptDecryptAhead) || queue.empty()
+        || (queue.size() >= mClient.maxDecryptAhead)
+        || (idx != (isNew ? queue.back()->idx + 1 : queue.back()->idx - 1)))
+    {
+        return false;
+    }
+
+    auto entry = std::make_shared<ParallelDecrypt>(idx, nullptr);
+    queue.push_back(entry);
+    CHATD_LOG_CRYPTO_CALL("Calling ICrypto::decrypt()");
+    auto pms = mCrypto->msgDecrypt(&msg);
+    if (pms.succeeded())
+    {
+        assert(!msg.isEncrypted());
+        entry->done = true;
+    }
+    else if (pms.failed())
+    {
+        onDecryptError(&msg, idx, pms.error());
+        entry->done = true;
+    }
+    else
+    {
+        waitParallelDecrypt(isNew, entry, msg, pms);
+    }
+    return true;
+}
+
+// In kOptDecryptAhead mode, adds the messages waiting after the decrypt queue
+// to it, when there is room again
+void Chat::decryptAheadQueued(bool isNew)
+{
+    auto& queue = isNew ? mParallelDecryptNew : mParallelDecryptOld;
+    while (!queue.empty() && (queue.size() < mClient.maxDecryptAhead))
+    {
+        Idx next = isNew ? queue.back()->idx + 1 : queue.back()->idx - 1;
+        if (isNew ? (next > highnum()) : (next < lownum()))
+            break;
+        if (msgIncomingAfterAdd(isNew, false, at(next), next) || !isInParallelDecrypt(isNew, next))
+            break;
+    }
+}
+
+// Marks the queue entry as done when the async decryption completes, and
+// delivers it if it's the first in the queue
+void Chat::waitParallelDecrypt(bool isNew, const std::shared_ptr<ParallelDecrypt>& entry,
+    Message& msg, promise::Promise<Message*>& pms)
+{
+    auto wptr = weakHandle();
+    auto message = &msg;
+    auto idx = entry->idx;
+    pms.fail([wptr, this, entry, message, idx](const promise::Error& err) -> promise::Promise<Message*>
+    {
+        if (wptr.deleted() || entry->cancelled)
+            return err;
+        return onDecryptError(message, idx, err);
+    })
+    .then([wptr, this, entry, isNew](Message*)
+    {
+        if (wptr.deleted() || entry->cancelled)
+            return;
+        entry->done = true;
+        deliverParallelDecrypts(isNew);
+    });
+}
+
+// Processes the decrypted messages at the front of the pool queue, in order
+void Chat::deliverParallelDecrypts(bool isNew)
+{
+    auto& queue = isNew ? mParallelDecryptNew : mParallelDecryptOld;
+    if (queue.empty() || !queue.front()->done)
+        return;
+
+    if (!isNew)
+        beginHistBatch();
+    Idx lastIdx = CHATD_IDX_INVALID;
+    while (!queue.empty() && queue.front()->done)
+    {
+        auto entry = queue.front();
+        queue.pop_front();
+        auto idx = entry->idx;
+        if ((idx < lownum()) || (idx > highnum())) //history was truncated meanwhile
+        {
+            for (auto& item: queue)
+                item->cancelled = true;
+            queue.clear();
+            break;
+        }
+        auto& msg = at(idx);
+        if (!entry->job) //already processed by msgDecrypt()
+        {
+            msgIncomingAfterDecrypt(isNew, false, msg, idx);
+            lastIdx = idx;
+            continue;
+        }
+        auto pms = entry->job->finish();
+        if (pms.succeeded())
+        {
+            assert(!msg.isEncrypted());
+        }
+        else if (pms.failed())
+        {
+            onDecryptError(&msg, idx, pms.error());
+        }
+        else if (mClient.options & Client::kOptDecryptAhead)
+        {
+            // the crypto module needs an async operation after all - wait for
+            // it at the front of the queue, the rest is decrypted meanwhile
+            CHATID_LOG_DEBUG("Decryption could not be done immediately, decrypting next messages meanwhile");
+            entry->job.reset();
+            entry->done = false;
+            queue.push_front(entry);
+            waitParallelDecrypt(isNew, entry, msg, pms);
+            break;
+        }
+        else
+        {
+            // the crypto module needs an async operation after all - continue
+            // as a normal halted decrypt, the rest is retried after it
+            CHATID_LOG_DEBUG("Decryption could not be done immediately, halting for next messages");
+            for (auto& item: queue)
+                item->cancelled = true;
+            queue.clear();
+            if (isNew)
+                mDecryptNewHaltedAt = idx;
+            else
+                mDecryptOldHaltedAt = idx;
+
+            auto message = &msg;
+            pms.fail([this, message, idx](const promise::Error& err) -> promise::Promise<Message*>
             {
-                if (!msgIncomingAfterAdd(isNew, false, at(i), i))
-                    break;
-            }
-            if ((mServerFetchState == kHistDecryptingOld) &&
-                (mDecryptOldHaltedAt == CHATD_IDX_INVALID))
+                return onDecryptError(message, idx, err);
+            })
+            .then([this, isNew, idx](Message* message)
             {
-                mServerFetchState = kHistNotFetching;
-                if (mServerOldHistCbEnabled)
-                {
-                    CALL_LISTENER(onHistoryDone, kHistSourceServer);
-                }
-            }
+                onDelayedDecryptDone(isNew, false, *message, idx);
+            });
+            if (!isNew)
+                endHistBatch();
+            return;
         }
-    });
+        msgIncomingAfterDecrypt(isNew, false, msg, idx);
+        lastIdx = idx;
+    }
 
-    return false; //decrypt was not done immediately
+    if (queue.empty())
+    {
+        // continue with the messages that were queued after the pool ones
+        if (isNew)
+            mDecryptNewHaltedAt = lastIdx;
+        else
+            mDecryptOldHaltedAt = lastIdx;
+        if (lastIdx != CHATD_IDX_INVALID)
+            resumeDecrypt(isNew, false);
+    }
+    else
+    {
+        if (isNew)
+            mDecryptNewHaltedAt = queue.front()->idx;
+        else
+            mDecryptOldHaltedAt = queue.front()->idx;
+        if (mClient.options & Client::kOptDecryptAhead)
+            decryptAheadQueued(isNew);
+    }
+    if (!isNew)
+        endHistBatch();
+}
+
+void Chat::beginHistBatch()
+{
+    if (mHistBatchLevel++ == 0)
+    {
+        CALL_DB(beginBatch);
+    }
+}
+
+void Chat::endHistBatch()
+{
+    assert(mHistBatchLevel > 0);
+    if (--mHistBatchLevel)
+        return;
+
+    CALL_DB(endBatch);
+    flushHistBatch();
+}
+
+void Chat::flushHistBatch()
+{
+    if (mHistBatch.empty())
+        return;
+
+    std::vector<HistoryMsg> msgs;
+    msgs.swap(mHistBatch);
+    CHATID_LOG_DEBUG("Notifying a batch of %zu history messages", msgs.size());
+    CALL_LISTENER(onRecvHistoryMessages, msgs);
 }
 
 // Save to history db, handle received and seen pointers, call new/old message user callbacks
@@ -2336,6 +3041,10 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
 
         verifyMsgOrder(msg, idx);
         CALL_DB(addMsgToHistory, msg, idx);
+        if (countsAsUnread(msg))
+        {
+            updateUnreadCount(idx, 1);
+        }
 
 
         if (mClient.isMessageReceivedConfirmationActive() && !isGroup() &&
@@ -2365,13 +3074,18 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
         // old message
         // local messages are obtained on-demand, so if isLocal,
         // then always send to app
-        if (isLocal || mServerOldHistCbEnabled)
+        if (!isLocal && mHistBatchLevel && mServerOldHistCbEnabled)
+        {
+            mHistBatch.emplace_back(idx, &msg, status);
+        }
+        else if (isLocal || mServerOldHistCbEnabled)
         {
             CALL_LISTENER(onRecvHistoryMessage, idx, msg, status, isLocal);
         }
     }
     if (msg.type == Message::kMsgTruncate)
     {
+        flushHistBatch(); //the truncate may delete messages from RAM
         handleTruncate(msg, idx);
         onMsgTimestamp(msg.ts);
         return;
@@ -2384,8 +3098,8 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
     if (msg.isText())
     {
         if ((mLastTextMsg.state() != LastTextMsgState::kHave) //we don't have any last-text-msg yet, just use any
-        || (mLastTextMsg.idx() == CHATD_IDX_INVALID) //current last-text-msg is a pending send, always override it
-        || (idx > mLastTextMsg.idx())) //we have a newer message
+        || ((mLastTextMsg.idx() == CHATD_IDX_INVALID) && isNew) //current last-text-msg is a pending send, override it by new messages
+        || ((mLastTextMsg.idx() != CHATD_IDX_INVALID) && (idx > mLastTextMsg.idx()))) //we have a newer message
         {
             onLastTextMsgUpdated(msg, idx);
         }
@@ -2404,6 +3118,7 @@ void Chat::onMsgTimestamp(uint32_t ts)
     if (ts <= mLastMsgTs)
         return;
     mLastMsgTs = ts;
+    CALL_DB(setLastMsgTs, ts);
     CALL_LISTENER(onLastMessageTsUpdated, ts);
 }
 
@@ -2492,6 +3207,7 @@ void Chat::onJoinComplete()
     }
     mUserDump.clear();
     mEncryptionHalted = false;
+    clearEncryptedPending(); //all unsent items are re-encrypted below
     auto unconfirmedKeyCmd = mCrypto->unconfirmedKeyCmd();
     if (unconfirmedKeyCmd)
     {
@@ -2505,7 +3221,7 @@ void Chat::onJoinComplete()
     if (mIsFirstJoin)
     {
         mIsFirstJoin = false;
-        if (!mLastTextMsg.isValid())
+        if (!mLastTextMsg.isValid() && !mHaveNoTextMsg)
         {
             CHATID_LOG_DEBUG("onJoinComplete: Haven't received a text message during join, getting last text message on-demand");
             findAndNotifyLastTextMsg();
@@ -2517,6 +3233,8 @@ void Chat::resetGetHistory()
 {
     mNextHistFetchIdx = CHATD_IDX_INVALID;
     mServerOldHistCbEnabled = false;
+    if (mClient.maxHistInRamPerChat)
+        trimHistory(mClient.maxHistInRamPerChat);
 }
 
 void Chat::setOnlineState(ChatState state)
@@ -2537,11 +3255,13 @@ void Chat::onLastTextMsgUpdated(const Message& msg, Idx idx)
     assert(!msg.empty());
     assert(msg.type != Message::kMsgRevokeAttachment);
     mLastTextMsg.assign(msg, idx);
+    mHaveNoTextMsg = false;
     notifyLastTextMsg();
 }
 
 void Chat::notifyLastTextMsg()
 {
+    CALL_DB(saveLastTextMsg, mLastTextMsg);
     CALL_LISTENER(onLastTextMessageUpdated, mLastTextMsg);
     mLastTextMsg.mIsNotified = true;
 }
@@ -2555,6 +3275,11 @@ uint8_t Chat::lastTextMessage(LastTextMsg*& msg)
     }
     if (mLastTextMsg.isFetching())
         return LastTextMsgState::kFetching;
+    if (mHaveNoTextMsg)
+    {
+        msg = nullptr;
+        return LastTextMsgState::kNone;
+    }
 
     findLastTextMsg();
     if (mLastTextMsg.isValid())
@@ -2575,9 +3300,11 @@ uint8_t Chat::lastTextMessage(LastTextMsg*& msg)
     }
 }
 
-void Chat::findLastTextMsg()
+void Chat::findLastTextMsg(Idx before)
 {
-    if (!mSending.empty())
+    //if the last text message is in history, there are no text messages in the
+    //send queue, as it would be one of them
+    if ((before == CHATD_IDX_INVALID) && !mSending.empty())
     {
         for (auto it = mSending.rbegin(); it!= mSending.rend(); it++)
         {
@@ -2591,11 +3318,15 @@ void Chat::findLastTextMsg()
             }
         }
     }
+    mHaveNoTextMsg = false;
+    auto low = lownum();
     if (!empty())
     {
         //check in ram
-        auto low = lownum();
-        for (Idx i=highnum(); i >= low; i--)
+        Idx high = highnum();
+        if ((before != CHATD_IDX_INVALID) && (before <= high))
+            high = before - 1;
+        for (Idx i=high; i >= low; i--)
         {
             auto& msg = at(i);
             if (msg.isText())
@@ -2605,18 +3336,20 @@ void Chat::findLastTextMsg()
                 return;
             }
         }
-        //check in db
-        CALL_DB(getLastTextMessage, lownum()-1, mLastTextMsg);
-        if (mLastTextMsg.isValid())
-        {
-            CHATID_LOG_DEBUG("lastTextMessage: Text message found in DB");
-            return;
-        }
+    }
+    //check in db. The RAM history is always the newest part of it
+    Idx from = ((before != CHATD_IDX_INVALID) && (before <= low)) ? before - 1 : low - 1;
+    CALL_DB(getLastTextMessage, from, mLastTextMsg);
+    if (mLastTextMsg.isValid())
+    {
+        CHATID_LOG_DEBUG("lastTextMessage: Text message found in DB");
+        return;
     }
     if (mHaveAllHistory)
     {
         CHATID_LOG_DEBUG("lastTextMessage: No text message in whole history");
         assert(!mLastTextMsg.isValid());
+        mHaveNoTextMsg = true;
         return;
     }
 
@@ -2632,14 +3365,14 @@ void Chat::findLastTextMsg()
     mLastTextMsg.setState(LastTextMsgState::kFetching);
 }
 
-void Chat::findAndNotifyLastTextMsg()
+void Chat::findAndNotifyLastTextMsg(Idx before)
 {
     auto wptr = weakHandle();
-    marshallCall([wptr, this]() //prevent re-entrancy
+    marshallCall([wptr, this, before]() //prevent re-entrancy
     {
         if (wptr.deleted())
             return;
-        findLastTextMsg();
+        findLastTextMsg(before);
         if (mLastTextMsg.state() == LastTextMsgState::kFetching)
             return;
         notifyLastTextMsg();
@@ -11,7 +11,10 @@
 #include <base/promise.h>
 #include <base/timers.hpp>
 #include <base/trackDelete.h>
+#include <base/workerPool.h>
 #include "chatdMsg.h"
+#include "chatdHistoryList.h"
+#include "flatHashMap.h"
 #include "url.h"
 #include "net/websocketsIO.h"
 
@@ -68,6 +71,16 @@ enum HistSource
 class DbInterface;
 struct LastTextMsg;
 
+/** @brief A history message, as passed to \c Listener::onRecvHistoryMessages() */
+struct HistoryMsg
+{
+    Idx idx;
+    Message* msg;
+    Message::Status status;
+    HistoryMsg(Idx aIdx, Message* aMsg, Message::Status aStatus)
+        :idx(aIdx), msg(aMsg), status(aStatus){}
+};
+
 class Listener
 {
 public:
@@ -104,6 +117,17 @@ public:
      */
     virtual void onRecvHistoryMessage(Idx idx, Message& msg, Message::Status status, bool isLocal){}
 
+    /** @brief A batch of consecutive history messages has been received from the
+     * server, as a result of getHistory(). The messages are ordered from the newest
+     * to the oldest, as they were received, and are already saved in the db.
+     * The default implementation calls \c onRecvHistoryMessage() for each of them.
+     */
+    virtual void onRecvHistoryMessages(const std::vector<HistoryMsg>& msgs)
+    {
+        for (auto& item: msgs)
+            onRecvHistoryMessage(item.idx, *item.msg, item.status, false);
+    }
+
     /**
      * @brief The retrieval of the requested history batch, via \c getHistory(), was completed
      * @param source The source from where the last message of the history
@@ -138,7 +162,9 @@ public:
       * buffer when this callback is called.
       * @param msgxid - The request-response match id that we generated for the sent message.
       * Normally the application doesn't need to care about it
-      * @param msg - The message object - \c id() returns a real msgid, and \c isSending() is \c false
+      * @param msg - The message object in the history buffer - \c id() returns a real msgid,
+      * and \c isSending() is \c false. It replaces the one that was in the send queue,
+      * which is deleted: the pointer returned by \c Chat::msgSubmit() is invalid from now on
       * @param idx - The history buffer index at which the message was put
       */
     virtual void onMessageConfirmed(karere::Id msgxid, const Message& msg, Idx idx){}
@@ -169,12 +195,20 @@ public:
       */
     virtual void onMessageRejected(const Message& msg, uint8_t reason){}
 
-    /** @brief A message was delivered, seen, etc. When the seen/received pointers are advanced,
-     * this will be called for each message of the pointer-advanced range, so the application
-     * doesn't need to iterate over ranges by itself
+    /** @brief A message was delivered, seen, etc. When the seen/received pointers are
+     * advanced, this is called for each message of the pointer-advanced range only in
+     * Client::kOptPerMessageStatusNotify mode. Otherwise, only
+     * \c onMessageStatusRangeChange() is called for the whole range
      */
     virtual void onMessageStatusChange(Idx idx, Message::Status newStatus, const Message& msg){}
 
+    /** @brief The seen/received pointer was advanced. The messages in RAM in the range
+     * [\c fromIdx, \c toIdx] that are by us (for \c kDelivered) or by others (for
+     * \c kSeen) have changed their status to \c newStatus. Messages with the other
+     * sender in the range keep their status
+     */
+    virtual void onMessageStatusRangeChange(Idx fromIdx, Idx toIdx, Message::Status newStatus){}
+
     /**
      * @brief Called when a message edit is received, i.e. MSGUPD is received.
      * The message is already updated in the history buffer and in the db,
@@ -298,7 +332,12 @@ protected:
     int mInactivityBeats = 0;
     promise::Promise<void> mConnectPromise;
     promise::Promise<void> mLoginPromise;
-    Connection(Client& client, int shardNo): mClient(client), mShardNo(shardNo){}
+    /** Commands queued during the current event loop iteration. They are sent as
+     * a single websocket frame, as chatd can parse several commands per frame */
+    Buffer mSendBatch;
+    bool mSendBatchFlushPending = false;
+    enum { kMaxSendBatchSize = 16384 };
+    Connection(Client& client, int shardNo): mClient(client), mShardNo(shardNo), mSendBatch(0){}
     State state() { return mState; }
     bool isConnected() const
     {
@@ -312,6 +351,7 @@ protected:
     virtual void wsConnectCb();
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
     virtual void wsHandleMsgCb(char *data, size_t len);
+    virtual void wsHandleFrameCb(const WebsocketsFrame& frame);
 
     void onSocketClose(int ercode, int errtype, const std::string& reason);
     promise::Promise<void> reconnect();
@@ -319,13 +359,20 @@ protected:
     void notifyLoggedIn();
     void enableInactivityTimer();
     void disableInactivityTimer();
-// Destroys the buffer content
+// Destroys the buffer content. Sends immediately, together with any queued commands
     bool sendBuf(Buffer&& buf);
+    /** Queues a command to be sent at the end of the current event loop iteration,
+     * or earlier if the batch reaches kMaxSendBatchSize */
+    bool queueCommand(const StaticBuffer& cmd);
+    /** Sends the queued commands now. Used when latency matters, i.e. on rejoin */
+    bool flushSendBatch();
     promise::Promise<void> rejoinExistingChats();
     void resendPending();
     void join(karere::Id chatid);
     void hist(karere::Id chatid, long count);
-    void execCommand(const StaticBuffer& buf);
+    /** @param frame - If not NULL, the frame that \c buf is in. Received messages
+     * reference their data in it instead of copying it */
+    void execCommand(const StaticBuffer& buf, const WebsocketsFrame& frame=nullptr);
     bool sendKeepalive(uint8_t opcode);
     friend class Client;
     friend class Chat;
@@ -490,16 +537,21 @@ protected:
     Client& mClient;
     karere::Id mChatId;
     Idx mForwardStart;
-    std::vector<std::unique_ptr<Message>> mForwardList;
-    std::vector<std::unique_ptr<Message>> mBackwardList;
+    HistoryList mForwardList;
+    HistoryList mBackwardList;
     OutputQueue mSending;
     OutputQueue::iterator mNextUnsent;
     bool mIsFirstJoin = true;
-    std::map<karere::Id, Idx> mIdToIndexMap;
+    karere::IdMap<Idx> mIdToIndexMap;
     karere::Id mLastReceivedId;
     Idx mLastReceivedIdx = CHATD_IDX_INVALID;
     karere::Id mLastSeenId;
     Idx mLastSeenIdx = CHATD_IDX_INVALID;
+    /** Cached result of \c unreadMsgCount(), persisted in the db. It is updated
+     * incrementally when messages arrive, are deleted or become seen, and is
+     * recalculated only when that's not possible (truncate, last-seen out of RAM, etc) */
+    mutable int mUnreadCount = 0;
+    mutable bool mHaveUnreadCount = false;
     Idx mLastIdxReceivedFromServer = CHATD_IDX_INVALID;
     karere::Id mLastIdReceivedFromServer;
     Listener* mListener;
@@ -522,12 +574,21 @@ protected:
     /** @brief Whether we have more not-loaded history in db */
     bool mHasMoreHistoryInDb = false;
     bool mServerOldHistCbEnabled = false;
+    /** @brief Old history messages from the server, received while a history batch
+     * is open. They are delivered to the listener at once by \c flushHistBatch() */
+    std::vector<HistoryMsg> mHistBatch;
+    int mHistBatchLevel = 0;
     bool mHaveAllHistory = false;
     bool mIsDisabled = false;
     Idx mNextHistFetchIdx = CHATD_IDX_INVALID;
     DbInterface* mDbInterface = nullptr;
     // last text message stuff
+    /** Kept up to date by every new, confirmed, edited and deleted message, so that
+     * it's searched for only when it's not known, or when it's deleted */
     LastTextMsgState mLastTextMsg;
+    /** There is no text message in the whole history nor in the send queue, so
+     * \c lastTextMessage() doesn't need to search */
+    bool mHaveNoTextMsg = false;
     // crypto stuff
     ICrypto* mCrypto;
     /** If crypto can't decrypt immediately, we set this flag and only the plaintext
@@ -537,6 +598,10 @@ protected:
      * db table. This, until another (or the same) encrypt call can't encrypt immediately,
      * in which case the flag is set again and the queue is blocked again */
     bool mEncryptionHalted = false;
+    /** In pipelined mode (Client::kOptPipelinedEncrypt), commands of messages
+     * that were encrypted while mEncryptionHalted was set. They are sent, in
+     * order, right after the message that halted the encryption */
+    std::vector<std::pair<MsgCommand*, KeyCommand*>> mEncryptedPending;
     /** If an incoming new message can't be decrypted immediately, this is set to its
      * index in the hitory buffer, as it is already added there (in memory only!).
      * Further received new messages are only added to memory history buffer, and
@@ -560,17 +625,29 @@ protected:
      * of new messages may work synchronously and not be delayed.
      */
     Idx mDecryptOldHaltedAt = CHATD_IDX_INVALID;
+    /** Messages handed to the decrypt worker pool, in the order in which they
+     * have to be processed. While not empty, mDecryptNewHaltedAt (resp.
+     * mDecryptOldHaltedAt) is the index of the first one, so further messages are
+     * queued exactly as with a halted decrypt. Contiguous messages whose keys are
+     * known are still submitted to the pool, and results are delivered in order.
+     * In Client::kOptDecryptAhead mode, messages whose decryption can't complete
+     * immediately are queued here as well, instead of halting, so that the
+     * following ones are decrypted meanwhile, up to Client::maxDecryptAhead */
+    struct ParallelDecrypt;
+    std::deque<std::shared_ptr<ParallelDecrypt>> mParallelDecryptNew;
+    std::deque<std::shared_ptr<ParallelDecrypt>> mParallelDecryptOld;
     uint32_t mLastMsgTs;
     bool mIsGroup;
     // ====
-    std::map<karere::Id, Message*> mPendingEdits;
-    std::map<BackRefId, Idx> mRefidToIdxMap;
+    karere::IdMap<Message*> mPendingEdits;
+    karere::FlatHashMap<BackRefId, Idx> mRefidToIdxMap;
     Chat(Connection& conn, karere::Id chatid, Listener* listener,
     const karere::SetOfIds& users, uint32_t chatCreationTs, ICrypto* crypto, bool isGroup);
-    void push_forward(Message* msg) { mForwardList.emplace_back(msg); }
-    void push_back(Message* msg) { mBackwardList.emplace_back(msg); }
-    Message* oldest() const { return (!mBackwardList.empty()) ? mBackwardList.back().get() : mForwardList.front().get(); }
-    Message* newest() const { return (!mForwardList.empty())? mForwardList.back().get() : mBackwardList.front().get(); }
+    // These take ownership of msg and return the message in the history buffer
+    Message* push_forward(Message* msg) { return mForwardList.push_back(msg); }
+    Message* push_back(Message* msg) { return mBackwardList.push_back(msg); }
+    Message* oldest() const { return (!mBackwardList.empty()) ? mBackwardList.back() : mForwardList.front(); }
+    Message* newest() const { return (!mForwardList.empty())? mForwardList.back() : mBackwardList.front(); }
     void clear()
     {
         mBackwardList.clear();
@@ -580,9 +657,27 @@ protected:
     Idx msgConfirm(karere::Id msgxid, karere::Id msgid);
     bool msgAlreadySent(karere::Id msgxid, karere::Id msgid);
     Message* msgRemoveFromSending(karere::Id msgxid, karere::Id msgid);
+    /** Updates the client-wide msgxid index when a NEWMSG enters/leaves mSending */
+    void indexSendingItem(const SendingItem& item);
+    void unindexSendingItem(const SendingItem& item);
     Idx msgIncoming(bool isNew, Message* msg, bool isLocal=false);
     bool msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx);
     void msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx idx);
+    Message* onDecryptError(Message* msg, Idx idx, const promise::Error& err);
+    void onDelayedDecryptDone(bool isNew, bool isLocal, Message& msg, Idx idx);
+    void resumeDecrypt(bool isNew, bool isLocal);
+    bool submitParallelDecrypt(bool isNew, Message& msg, Idx idx);
+    bool decryptAhead(bool isNew, Message& msg, Idx idx);
+    void decryptAheadQueued(bool isNew);
+    void waitParallelDecrypt(bool isNew, const std::shared_ptr<ParallelDecrypt>& entry,
+        Message& msg, promise::Promise<Message*>& pms);
+    bool isInParallelDecrypt(bool isNew, Idx idx) const;
+    void deliverParallelDecrypts(bool isNew);
+    /** Consecutive OLDMSGs are saved in one db transaction and notified in one
+     * \c onRecvHistoryMessages() call. Batches can be nested */
+    void beginHistBatch();
+    void endHistBatch();
+    void flushHistBatch();
     void onUserJoin(karere::Id userid, Priv priv);
     void onUserLeave(karere::Id userid);
     void onJoinComplete();
@@ -594,10 +689,9 @@ protected:
     void onLastReceived(karere::Id msgid);
     void onLastSeen(karere::Id msgid);
     void handleLastReceivedSeen(karere::Id msgid);
-    // As sending data over libws is destructive to the buffer, we have two versions
-    // of sendCommand - the one with the rvalue reference is picked by the compiler
-    // whenever the command object is a temporary, avoiding copying the buffer,
-    // and the const reference one is picked when the Command object has to be preserved
+    // Commands are copied to the connection's send batch, so both versions preserve the
+    // data. The one with the rvalue reference is picked by the compiler whenever the
+    // command object is a temporary, and releases its buffer right away
     bool sendCommand(Command&& cmd);
     bool sendCommand(const Command& cmd);
     bool msgSend(const Message& message);
@@ -615,7 +709,7 @@ protected:
     void onNewKeys(StaticBuffer&& keybuf);
     void logSend(const Command& cmd);
     void handleBroadcast(karere::Id userid, uint8_t type);
-    void findAndNotifyLastTextMsg();
+    void findAndNotifyLastTextMsg(Idx before=CHATD_IDX_INVALID);
     void notifyLastTextMsg();
     void onMsgTimestamp(uint32_t ts); //support for newest-message-timestamp
     bool manualResendWhenUserJoins() const;
@@ -683,7 +777,7 @@ public:
       *  This can be used by the app to replace the text of messages who have
       * been edited before they have been sent/confirmed. Normally the app needs
       * to display the edited text in the unsent message.*/
-    const std::map<karere::Id, Message*>& pendingEdits() const { return mPendingEdits; }
+    const karere::IdMap<Message*>& pendingEdits() const { return mPendingEdits; }
 
     /** @brief The chatd::Listener currently attached to this chat */
     Listener* listener() const { return mListener; }
@@ -729,6 +823,15 @@ public:
      * returned to the app via * \c getHitory() */
     unsigned lastHistDecryptCount() const { return mLastHistDecryptCount; }
 
+    /** @brief Constructs a message loaded from the db in place in the history buffer,
+     * copying \c len bytes of data at \c data. For use by \c DbInterface::fetchDbHistory()
+     */
+    Message* stageDbHistoryMsg(karere::Id msgid, karere::Id userid, uint32_t ts,
+        uint16_t updated, const char* data, size_t len, KeyId keyid, unsigned char type)
+    {
+        return mBackwardList.stage(msgid, userid, ts, updated, data, len, keyid, type);
+    }
+
     /** @brief
      * Get the message with the specified index, or \c NULL if that
      * index is out of range
@@ -740,14 +843,14 @@ public:
             Idx idx = mForwardStart - num - 1; //always >= 0
             if (static_cast<size_t>(idx) >= mBackwardList.size())
                 return nullptr;
-            return mBackwardList[idx].get();
+            return mBackwardList[idx];
         }
         else
         {
             Idx idx = num - mForwardStart;
             if (static_cast<size_t>(idx) >= mForwardList.size())
                 return nullptr;
-            return mForwardList[idx].get();
+            return mForwardList[idx];
         }
     }
 
@@ -787,15 +890,24 @@ public:
     /**
      * @brief Returns the index of the message with the specified msgid.
      * @param msgid The message id whose index to find
-     * @returns The index of the message inside the RAM history buffer.
-     *  If no such message exists in the RAM history buffer, CHATD_IDX_INVALID
-     * is returned
+     * @returns The index of the message inside the history buffer. Messages that
+     * are not in RAM (i.e. evicted by \c trimHistory()) are looked up in the db.
+     * If no such message exists, CHATD_IDX_INVALID is returned
      */
-    Idx msgIndexFromId(karere::Id msgid) const
-    {
-        auto it = mIdToIndexMap.find(msgid);
-        return (it == mIdToIndexMap.end()) ? CHATD_IDX_INVALID : it->second;
-    }
+    Idx msgIndexFromId(karere::Id msgid) const;
+
+    /** @brief Loads the message with index \c num from the db, for messages that
+     * are not in RAM. The caller takes ownership. Returns NULL if there is no such message
+     */
+    Message* fetchFromDb(Idx num) const;
+
+    /** @brief Evicts the oldest messages from RAM, keeping the newest \c maxCount
+     * ones, but not less than \c kMinHistInRam. Messages sent to the app since the
+     * last \c resetGetHistory() are kept, as well as everything while history is
+     * fetched or decrypted. Evicted messages are reloaded from the db by \c getHistory().
+     * @returns The number of evicted messages
+     */
+    size_t trimHistory(size_t maxCount);
 
     /**
      * @brief Initiates fetching more history - from local RAM history buffer,
@@ -857,6 +969,10 @@ public:
      * @param type - The type of the message - normal message, type of management message,
      * application-specific type like link, share, picture etc.
      * @param userp - An optional user pointer to associate with the message object
+     * @returns The message in the send queue. It is valid only while the message is
+     * being sent: on confirmation it is moved to the history buffer and deleted, and
+     * \c Listener::onMessageConfirmed() receives the message in the history buffer
+     * instead, so pointers to the returned object must be replaced there
      */
     Message* msgSubmit(const char* msg, size_t msglen, unsigned char type, void* userp);
 
@@ -894,6 +1010,10 @@ public:
       * as the last-seen-msgid. The count will be returned as 0.
       */
     int unreadMsgCount() const;
+    enum: int { kUnreadCountInvalid = 0x7fffffff };
+    /** Messages that trimHistory() always keeps in RAM. New messages reference
+     * up to 64 previous ones (see createMsgBackRefs()) */
+    enum { kMinHistInRam = 64 };
 
     /** @brief Returns the text of the most-recent message in the chat that can
      * be displayed as text in the chat list. If it is not found in RAM,
@@ -972,6 +1092,8 @@ public:
 protected:
     void msgSubmit(Message* msg);
     bool msgEncryptAndSend(OutputQueue::iterator it);
+    void sendEncryptedPending();
+    void clearEncryptedPending();
     void continueEncryptNextPending();
     void onMsgUpdated(Message* msg);
     void onJoinRejected();
@@ -982,6 +1104,12 @@ protected:
     void moveItemToManualSending(OutputQueue::iterator it, ManualSendReason reason);
     void handleTruncate(const Message& msg, Idx idx);
     void deleteMessagesBefore(Idx idx);
+    bool countsAsUnread(const Message& msg) const;
+    void setUnreadCount(int count) const;
+    void invalidateUnreadCount();
+    void updateUnreadCount(Idx idx, int delta);
+    void onLastSeenIdxChanged(Idx oldIdx);
+    void notifyStatusRange(Idx fromIdx, Idx toIdx, Message::Status newStatus);
     void createMsgBackRefs(Message& msg);
     void verifyMsgOrder(const Message& msg, Idx idx);
     /**
@@ -991,7 +1119,10 @@ protected:
      * listener state */
     void replayUnsentNotifications();
     void onLastTextMsgUpdated(const Message& msg, Idx idx=CHATD_IDX_INVALID);
-    void findLastTextMsg();
+    /** Searches the send queue, RAM history, db and then server history for the
+     * last text message. If \c before is valid, only messages older than it are
+     * searched, as when the last text message, at \c before, was deleted */
+    void findLastTextMsg(Idx before=CHATD_IDX_INVALID);
     /**
      * @brief Initiates loading of the queue with messages that require user
      * approval for re-sending */
@@ -1006,9 +1137,16 @@ protected:
 /// maps the chatd shard number to its corresponding Shard connection
     std::map<int, std::shared_ptr<Connection>> mConnections;
 /// maps a chatid to the handling Shard connection
-    std::map<karere::Id, Connection*> mConnectionForChatId;
+    karere::IdMap<Connection*> mConnectionForChatId;
+/// maps the msgxid of every NEWMSG in a send queue to the Chat that owns it, as
+/// NEWMSGID and MSGID don't carry a chatid. Declared before mChatForChatId, so that
+/// it outlives the Chat objects that unregister from it in their destructor
+    karere::IdMap<Chat*> mChatForMsgxid;
+/// runs the CPU-bound part of decrypting received messages, if enabled. Declared
+/// before mChatForChatId, as Chat objects wait for their jobs in their destructor
+    std::unique_ptr<karere::WorkerPool> mDecryptPool;
 /// maps chatids to the Message object
-    std::map<karere::Id, std::shared_ptr<Chat>> mChatForChatId;
+    karere::IdMap<std::shared_ptr<Chat>> mChatForChatId;
     karere::Id mUserId;
     bool mMessageReceivedConfirmation = false;
     Connection& chatidConn(karere::Id chatid)
@@ -1020,9 +1158,37 @@ protected:
     }
     bool onMsgAlreadySent(karere::Id msgxid, karere::Id msgid);
     void msgConfirm(karere::Id msgxid, karere::Id msgid);
+    Chat* chatForMsgxid(karere::Id msgxid) const
+    {
+        auto it = mChatForMsgxid.find(msgxid);
+        return (it == mChatForMsgxid.end()) ? nullptr : it->second;
+    }
+    void addMsgxid(karere::Id msgxid, Chat& chat) { mChatForMsgxid[msgxid] = &chat; }
+    void removeMsgxid(karere::Id msgxid) { mChatForMsgxid.erase(msgxid); }
 public:
-    enum: uint32_t { kOptManualResendWhenUserJoins = 1 };
+    enum: uint32_t
+    {
+        kOptManualResendWhenUserJoins = 1,
+        /** While a message waits for an async encryption (i.e. a new send key),
+         * encrypt the following ones that use the same key, instead of waiting */
+        kOptPipelinedEncrypt = 2,
+        /** While a received message waits for an async decryption (i.e. a key
+         * or the sender's public key being fetched), decrypt the following ones
+         * instead of waiting. Messages are still processed in order */
+        kOptDecryptAhead = 4,
+        /** When the seen/received pointers are advanced, also call
+         * Listener::onMessageStatusChange() for every message of the range */
+        kOptPerMessageStatusNotify = 8
+    };
     unsigned inactivityCheckIntervalSec = 20;
+    /** In kOptDecryptAhead mode, the max number of messages decrypted ahead of
+     * the oldest one whose decryption is not complete. Decryption halts there */
+    unsigned maxDecryptAhead = 256;
+    /** Max number of messages to keep in RAM per chat, and in all chats. Older
+     * messages are evicted by trimHistory(), and reloaded from the db when needed.
+     * 0 means no limit */
+    size_t maxHistInRamPerChat = 0;
+    size_t maxHistInRam = 0;
     uint32_t options = 0;
     MyMegaApi *mApi;
     karere::Client *karereClient;
@@ -1052,6 +1218,17 @@ public:
     void notifyUserIdle();
     void notifyUserActive();
     bool isMessageReceivedConfirmationActive() const;
+    /** @brief Decrypt received messages whose keys are known on \c numThreads
+     * worker threads. Messages are still processed in order. 0 (the default)
+     * decrypts on the app thread */
+    void setDecryptThreads(unsigned numThreads);
+    karere::WorkerPool* decryptPool() const { return mDecryptPool.get(); }
+    /** @brief Evicts history from RAM down to \c maxHistInRamPerChat and
+     * \c maxHistInRam or, if \c aggressive, down to the minimum of every chat.
+     * Called periodically, and by apps under memory pressure.
+     * @returns The number of evicted messages
+     */
+    size_t trimHistory(bool aggressive=false);
     friend class Connection;
     friend class Chat;
 };
@@ -1077,6 +1254,8 @@ struct ChatDbInfo
     Idx newestDbIdx;
     karere::Id lastSeenId;
     karere::Id lastRecvId;
+    int unreadCount;
+    bool haveUnreadCount; ///< false if the persisted unread count is not valid
 };
 
 class DbInterface
@@ -1093,6 +1272,8 @@ public:
     /// if the application-specified \c oldestDbId in the call to \n init() has not been retrieved yet,
     /// an assertion will be triggered. Therefore, the application must always try to read not less than
     /// \c count messages, in case they are avaialble in the db.
+    /// The messages can be constructed directly in the history buffer via
+    /// \c Chat::stageDbHistoryMsg(), instead of with \c new.
     virtual void fetchDbHistory(Idx startIdx, unsigned count, std::vector<Message*>& messages) = 0;
     virtual void saveMsgToSending(Chat::SendingItem& msg) = 0;
     virtual void updateMsgInSending(const chatd::Chat::SendingItem& item) = 0;
@@ -1105,6 +1286,8 @@ public:
     virtual void confirmKeyOfSendingItem(uint64_t rowid, KeyId keyid) = 0;
     virtual void updateMsgInHistory(karere::Id msgid, const Message& msg) = 0;
     virtual Idx getIdxOfMsgid(karere::Id msgid) = 0;
+    /// Returns a new message with the content of the one at \c idx, or NULL
+    virtual Message* fetchDbMessage(Idx idx) = 0;
     virtual Idx getPeerMsgCountAfterIdx(Idx idx) = 0;
     virtual void saveItemToManualSending(const Chat::SendingItem& item, int reason) = 0;
     virtual void loadManualSendItems(std::vector<Chat::ManualSendItem>& items) = 0;
@@ -1113,11 +1296,23 @@ public:
     virtual void truncateHistory(const chatd::Message& msg) = 0;
     virtual void setLastSeen(karere::Id msgid) = 0;
     virtual void setLastReceived(karere::Id msgid) = 0;
+    /// Persists the unread count, \c Chat::kUnreadCountInvalid means it must be recalculated
+    virtual void setUnreadCount(int count) = 0;
     virtual chatd::Idx getOldestIdx() = 0;
     virtual void sendingItemMsgupdxToMsgupd(const chatd::Chat::SendingItem& item, karere::Id msgid) = 0;
     virtual void setHaveAllHistory() = 0;
     virtual bool haveAllHistory() = 0;
+    /// Gets the newest text message with index up to \c from
     virtual void getLastTextMessage(Idx from, chatd::LastTextMsgState& msg) = 0;
+    /// Loads the persisted last text message and newest message timestamp, so that
+    /// they are known without looking at the history
+    virtual void loadSummary(chatd::LastTextMsgState& msg, uint32_t& lastTs) = 0;
+    /// Persists the last text message. Not valid or not yet confirmed messages clear it
+    virtual void saveLastTextMsg(const chatd::LastTextMsgState& msg) = 0;
+    virtual void setLastMsgTs(uint32_t ts) = 0;
+    /// Writes done between \c beginBatch() and \c endBatch() should go in a single transaction
+    virtual void beginBatch() = 0;
+    virtual void endBatch() = 0;
     virtual ~DbInterface(){}
 };
 
@@ -12,16 +12,42 @@ protected:
     chatd::Chat& mMessages;
     std::string mSendingTblName;
     std::string mHistTblName;
+    /** Bounds of this chat's history in the db. All writes to the history table go
+     * through this class, so they are loaded once and then kept up to date, instead
+     * of running aggregate queries on every insert. With async writes, they are
+     * updated assuming that the write succeeds, and reloaded after any write failed */
+    struct HistBounds
+    {
+        chatd::Idx low = 0;
+        chatd::Idx high = 0;
+        int count = 0;
+    };
+    HistBounds mBounds;
+    bool mHaveBounds = false;
+    unsigned mBoundsWriteErrors = 0; //SqliteDb::writeErrorCount() when the bounds were loaded
+    const HistBounds& histBounds()
+    {
+        if (mHaveBounds && (mBoundsWriteErrors == mDb.writeErrorCount()))
+            return mBounds;
+        SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from history where chatid = ?");
+        stmt << mMessages.chatId();
+        stmt.step(); //will always return a row, even if table empty
+        mBoundsWriteErrors = mDb.writeErrorCount(); //the select waited for the queued writes
+        mBounds.low = stmt.intCol(0); //WARNING: the chatd implementation uses uint32_t values for idx.
+        mBounds.high = stmt.intCol(1);
+        mBounds.count = stmt.intCol(2);
+        mHaveBounds = true;
+        return mBounds;
+    }
 public:
     ChatdSqliteDb(chatd::Chat& msgs, SqliteDb& db, const std::string& sendingTblName="sending", const std::string& histTblName="history")
         :mDb(db), mMessages(msgs), mSendingTblName(sendingTblName), mHistTblName(histTblName){}
     virtual void getHistoryInfo(chatd::ChatDbInfo& info)
     {
-        SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid=?1");
-        stmt.bind(mMessages.chatId()).step(); //will always return a row, even if table empty
-        auto minIdx = stmt.intCol(0); //WARNING: the chatd implementation uses uint32_t values for idx.
-        info.newestDbIdx = stmt.intCol(1);
-        if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) //no db history
+        auto& bounds = histBounds();
+        auto minIdx = bounds.low;
+        info.newestDbIdx = bounds.high;
+        if (!bounds.count) //no db history
         {
             memset(&info, 0, sizeof(info)); //actually need to zero only oldestDbId
             return;
@@ -38,24 +64,13 @@ public:
             CHATD_LOG_WARNING("Db: Newest msgid in db is null, telling chatd we don't have local history");
             info.oldestDbId = 0;
         }
-        SqliteStmt stmt3(mDb, "select last_seen, last_recv from chats where chatid=?");
+        SqliteStmt stmt3(mDb, "select last_seen, last_recv, unread_count from chats where chatid=?");
         stmt3 << mMessages.chatId();
         stmt3.stepMustHaveData();
         info.lastSeenId = stmt3.uint64Col(0);
         info.lastRecvId = stmt3.uint64Col(1);
-    }
-    void assertAffectedRowCount(int count, const char* opname=nullptr)
-    {
-        auto actual = sqlite3_changes(mDb);
-        if (actual == count)
-            return;
-        std::string msg;
-        if (opname)
-            msg.append(opname).append(": ");
-        msg.append(": unexpected number of rows affected: expected ")
-           .append(std::to_string(count)).append(", actual ")
-           .append(std::to_string(actual));
-        throw std::runtime_error(msg);
+        info.haveUnreadCount = (sqlite3_column_type(stmt3, 2) != SQLITE_NULL);
+        info.unreadCount = stmt3.intCol(2);
     }
     void saveMsgToSending(chatd::Chat::SendingItem& item)
     {
@@ -64,24 +79,24 @@ public:
         auto msg = item.msg;
         Buffer rcpts;
         item.recipients.save(rcpts);
-        mDb.query("insert into sending (chatid, opcode, ts, msgid, msg, type, updated, "
-                         "recipients, backrefid, backrefs) values(?,?,?,?,?,?,?,?,?,?)",
-            (uint64_t)mMessages.chatId(), item.opcode(), (int)time(NULL), msg->id(),
+        //the rowid is allocated here, as the insert may be queued for the db writer
+        item.rowid = mDb.newRowid("sending");
+        mDb.query("insert into sending (rowid, chatid, opcode, ts, msgid, msg, type, updated, "
+                         "recipients, backrefid, backrefs) values(?,?,?,?,?,?,?,?,?,?,?)",
+            (int64_t)item.rowid, (uint64_t)mMessages.chatId(), item.opcode(), (int)time(NULL), msg->id(),
             *msg, msg->type, msg->updated, rcpts, msg->backRefId, msg->backrefBuf());
-        item.rowid = sqlite3_last_insert_rowid(mDb);
     }
     virtual void updateMsgInSending(const chatd::Chat::SendingItem& item)
     {
         assert(item.msg);
-        mDb.query("update sending set msg = ?, updated = ? where rowid = ?",
+        mDb.queryChanges(1, "updateMsgInSending",
+            "update sending set msg = ?, updated = ? where rowid = ?",
             *item.msg, item.msg->updated, item.rowid);
-        assertAffectedRowCount(1, "updateMsgInSending");
     }
     virtual void confirmKeyOfSendingItem(uint64_t rowid, chatd::KeyId keyid)
     {
-        mDb.query("update sending set keyid = ? where rowid = ?",
-                    keyid, rowid);
-        assertAffectedRowCount(1, "confirmKeyOfSendingItem");
+        mDb.queryChanges(1, "confirmKeyOfSendingItem",
+            "update sending set keyid = ? where rowid = ?", keyid, rowid);
     }
     virtual void addBlobsToSendingItem(uint64_t rowid,
                     const chatd::MsgCommand* msgCmd, const chatd::Command* keyCmd)
@@ -90,43 +105,39 @@ public:
         //compiler (at least clang on MacOS) seems not able to properly determine
         //the argument type for the template parameter to sqlQuery(), which
         //compiles without any warning, but results is corrupt data written to the db!
-        mDb.query("update sending set msg_cmd=?, key_cmd=? where rowid=?",
+        mDb.queryChanges(1, "addCommandBlobToSendingItem",
+            "update sending set msg_cmd=?, key_cmd=? where rowid=?",
             msgCmd?static_cast<StaticBuffer>(*msgCmd):StaticBuffer(nullptr, 0),
             keyCmd?static_cast<StaticBuffer>(*keyCmd):StaticBuffer(nullptr, 0), rowid);
-        assertAffectedRowCount(1,"addCommandBlobToSendingItem");
     }
     virtual void sendingItemMsgupdxToMsgupd(const chatd::Chat::SendingItem& item, karere::Id msgid)
     {
         assert(item.opcode() == chatd::OP_MSGUPDX);
-        mDb.query(
+        mDb.queryChanges(1, "updateSendingItemMsgidAndOpcode",
             "update sending set opcode=?, msgid=? where chatid=? and rowid=? and opcode=? and msgid=?",
             chatd::OP_MSGUPD, msgid, mMessages.chatId(), item.rowid, chatd::OP_MSGUPDX, item.msg->id());
-        assertAffectedRowCount(1, "updateSendingItemMsgidAndOpcode");
     }
     virtual void deleteItemFromSending(uint64_t rowid)
     {
-        mDb.query("delete from sending where rowid = ?1", rowid);
-        assertAffectedRowCount(1, "deleteItemFromSending");
+        mDb.queryChanges(1, "deleteItemFromSending", "delete from sending where rowid = ?1", rowid);
     }
     virtual void updateMsgPlaintextInSending(uint64_t rowid, const StaticBuffer& data)
     {
-        mDb.query("update sending set msg = ? where rowid = ?", data, rowid);
-        assertAffectedRowCount(1, "updateMsgPlaintextInSending");
+        mDb.queryChanges(1, "updateMsgPlaintextInSending",
+            "update sending set msg = ? where rowid = ?", data, rowid);
     }
     virtual void updateMsgKeyIdInSending(uint64_t rowid, chatd::KeyId keyid)
     {
-        mDb.query("update sending set keyid = ? where rowid = ?", keyid, rowid);
-        assertAffectedRowCount(1, "updateMsgKeyIdInSending");
+        mDb.queryChanges(1, "updateMsgKeyIdInSending",
+            "update sending set keyid = ? where rowid = ?", keyid, rowid);
     }
     virtual void addMsgToHistory(const chatd::Message& msg, chatd::Idx idx)
     {
+        auto& bounds = histBounds();
+        int low = bounds.low;
+        int high = bounds.high;
+        int count = bounds.count;
 #if 1
-        SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from history where chatid = ?");
-        stmt << mMessages.chatId();
-        stmt.step();
-        int low = stmt.intCol(0);
-        int high = stmt.intCol(1);
-        int count = stmt.intCol(2);
         if ((count > 0) && (idx != low-1) && (idx != high+1))
         {
             CHATD_LOG_ERROR("chatid %s: addMsgToHistory: history discontinuity detected: "
@@ -138,15 +149,29 @@ public:
         }
 #endif
         mDb.query("insert into history"
-            "(idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid) "
-            "values(?,?,?,?,?,?,?,?,?,?)", idx, mMessages.chatId(), msg.id(), msg.keyid,
-            msg.type, msg.userid, msg.ts, msg.updated, msg, msg.backRefId);
+            "(idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_text) "
+            "values(?,?,?,?,?,?,?,?,?,?,?)", idx, mMessages.chatId(), msg.id(), msg.keyid,
+            msg.type, msg.userid, msg.ts, msg.updated, msg, msg.backRefId, (int)msg.isText());
+        if (!mBounds.count++)
+        {
+            mBounds.low = mBounds.high = idx;
+        }
+        else if (idx < mBounds.low)
+        {
+            mBounds.low = idx;
+        }
+        else if (idx > mBounds.high)
+        {
+            mBounds.high = idx;
+        }
     }
+    virtual void beginBatch() { mDb.beginBatch(); }
+    virtual void endBatch() { mDb.endBatch(); }
     virtual void updateMsgInHistory(karere::Id msgid, const chatd::Message& msg)
     {
-        mDb.query("update history set type = ?, data = ?, updated = ?, userid=? where chatid = ? and msgid = ?",
-            msg.type, msg, msg.updated, msg.userid, mMessages.chatId(), msgid);
-        assertAffectedRowCount(1, "updateMsgInHistory");
+        mDb.queryChanges(1, "updateMsgInHistory", "update history set type = ?, data = ?, "
+            "updated = ?, userid=?, is_text=? where chatid = ? and msgid = ?", msg.type, msg, msg.updated, msg.userid,
+            (int)msg.isText(), mMessages.chatId(), msgid);
     }
     virtual void loadSendQueue(chatd::Chat::OutputQueue& queue)
     {
@@ -190,8 +215,6 @@ public:
             karere::Id userid(stmt.uint64Col(1));
             unsigned ts = stmt.uintCol(2);
             chatd::KeyId keyid = stmt.uintCol(6);
-            Buffer buf;
-            stmt.blobCol(4, buf);
 #ifndef NDEBUG
             auto idx = stmt.intCol(5);
             if(idx != mMessages.lownum()-1-(int)messages.size()) //we go backward in history, hence the -messages.size()
@@ -202,12 +225,27 @@ public:
                 assert(false);
             }
 #endif
-            auto msg = new chatd::Message(msgid, userid, ts, stmt.intCol(8), std::move(buf),
-                false, keyid, (unsigned char)stmt.intCol(3));
+            auto data = (const char*)sqlite3_column_blob(stmt, 4);
+            auto msg = mMessages.stageDbHistoryMsg(msgid, userid, ts, stmt.intCol(8),
+                data, sqlite3_column_bytes(stmt, 4), keyid, (unsigned char)stmt.intCol(3));
             msg->backRefId = stmt.uint64Col(7);
             messages.push_back(msg);
         }
     }
+    virtual chatd::Message* fetchDbMessage(chatd::Idx idx)
+    {
+        SqliteStmt stmt(mDb, "select msgid, userid, ts, type, data, keyid, backrefid, updated from history "
+            "where chatid = ? and idx = ?");
+        stmt << mMessages.chatId() << idx;
+        if (!stmt.step())
+            return nullptr;
+        Buffer buf;
+        stmt.blobCol(4, buf);
+        auto msg = new chatd::Message(stmt.uint64Col(0), stmt.uint64Col(1), stmt.uintCol(2),
+            stmt.intCol(7), std::move(buf), false, stmt.uintCol(5), (unsigned char)stmt.intCol(3));
+        msg->backRefId = stmt.uint64Col(6);
+        return msg;
+    }
     virtual chatd::Idx getIdxOfMsgid(karere::Id msgid)
     {
         SqliteStmt stmt(mDb, "select idx from history where chatid = ? and msgid = ?");
@@ -216,13 +254,20 @@ public:
     }
     virtual chatd::Idx getPeerMsgCountAfterIdx(chatd::Idx idx)
     {
+        auto& bounds = histBounds();
+        if (!bounds.count || ((idx != CHATD_IDX_INVALID) && (idx >= bounds.high)))
+            return 0;
+
+        // same criteria as Chat::countsAsUnread()
         std::string sql = "select count(*) from history where (chatid = ?)"
-                "and (userid != ?)";
+                "and (userid != ?) and (type != ?) "
+                "and not (updated != 0 and ifnull(length(data), 0) = 0)";
         if (idx != CHATD_IDX_INVALID)
             sql+=" and (idx > ?)";
 
         SqliteStmt stmt(mDb, sql);
-        stmt << mMessages.chatId() << mMessages.client().userId();
+        stmt << mMessages.chatId() << mMessages.client().userId()
+             << (int)chatd::Message::kMsgRevokeAttachment;
         if (idx != CHATD_IDX_INVALID)
             stmt << idx;
         stmt.stepMustHaveData("get peer msg count");
@@ -279,6 +324,12 @@ public:
         if (idx == CHATD_IDX_INVALID)
             throw std::runtime_error("dbInterface::truncateHistory: msgid "+msg.id().toString()+" does not exist in db");
         mDb.query("delete from history where chatid = ? and idx < ?", mMessages.chatId(), idx);
+        if (mHaveBounds)
+        {
+            mBounds.count -= sqlite3_changes(mDb);
+            if (mBounds.low < idx)
+                mBounds.low = idx;
+        }
 #if 1
         SqliteStmt stmt(mDb, "select type from history where chatid=? and msgid=?");
         stmt << mMessages.chatId() << msg.id();
@@ -291,20 +342,23 @@ public:
     }
     virtual chatd::Idx getOldestIdx()
     {
-        SqliteStmt stmt(mDb, "select min(idx) from history where chatid = ?");
-        stmt << mMessages.chatId();
-        stmt.stepMustHaveData(__FUNCTION__);
-        return stmt.uint64Col(0);
+        auto& bounds = histBounds();
+        return bounds.count ? bounds.low : 0; //min() of an empty table is NULL, read as 0
     }
     virtual void setLastSeen(karere::Id msgid)
     {
-        mDb.query("update chats set last_seen=? where chatid=?", msgid, mMessages.chatId());
-        assertAffectedRowCount(1);
+        mDb.queryChanges(1, "setLastSeen", "update chats set last_seen=? where chatid=?", msgid, mMessages.chatId());
     }
     virtual void setLastReceived(karere::Id msgid)
     {
-        mDb.query("update chats set last_recv=? where chatid=?", msgid, mMessages.chatId());
-        assertAffectedRowCount(1);
+        mDb.queryChanges(1, "setLastReceived", "update chats set last_recv=? where chatid=?", msgid, mMessages.chatId());
+    }
+    virtual void setUnreadCount(int count)
+    {
+        if (count == chatd::Chat::kUnreadCountInvalid)
+            mDb.query("update chats set unread_count=NULL where chatid=?", mMessages.chatId());
+        else
+            mDb.query("update chats set unread_count=? where chatid=?", count, mMessages.chatId());
     }
     virtual void setHaveAllHistory()
     {
@@ -322,10 +376,10 @@ public:
     }
     virtual void getLastTextMessage(chatd::Idx from, chatd::LastTextMsgState& msg)
     {
+        //is_text is indexed, so this is a seek instead of a scan of the history
         SqliteStmt stmt(mDb,
             "select type, idx, data, msgid, userid from history where chatid=? and "
-            "(type=1 or type >= 16) and (idx <= ?) and length(data) > 0 "
-            "order by idx desc limit 1");
+            "is_text=1 and idx <= ? order by idx desc limit 1");
         stmt << mMessages.chatId() << from;
         if (!stmt.step())
         {
@@ -336,6 +390,39 @@ public:
         stmt.blobCol(2, buf);
         msg.assign(buf, stmt.intCol(0), stmt.uint64Col(3), stmt.intCol(1), stmt.uint64Col(4));
     }
+    virtual void loadSummary(chatd::LastTextMsgState& msg, uint32_t& lastTs)
+    {
+        SqliteStmt stmt(mDb,
+            "select last_ts, last_msg_type, last_msg_idx, last_msgid, last_msg_sender, "
+            "last_msg from chats where chatid=?");
+        stmt << mMessages.chatId();
+        if (!stmt.step())
+            return;
+        lastTs = stmt.uintCol(0);
+        if (sqlite3_column_type(stmt, 1) == SQLITE_NULL)
+            return;
+        Buffer buf(128);
+        stmt.blobCol(5, buf);
+        msg.assign(buf, stmt.intCol(1), stmt.uint64Col(3), stmt.uintCol(2), stmt.uint64Col(4));
+    }
+    virtual void saveLastTextMsg(const chatd::LastTextMsgState& msg)
+    {
+        //pending messages are restored from the send queue
+        if (!msg.isValid() || msg.idx() == CHATD_IDX_INVALID)
+        {
+            mDb.query("update chats set last_msg_type=NULL, last_msg=NULL where chatid=?",
+                mMessages.chatId());
+            return;
+        }
+        mDb.query("update chats set last_msg_type=?, last_msg_idx=?, last_msgid=?, "
+            "last_msg_sender=?, last_msg=? where chatid=?",
+            msg.type(), msg.idx(), msg.id(), msg.sender(),
+            StaticBuffer(msg.contents(), false), mMessages.chatId());
+    }
+    virtual void setLastMsgTs(uint32_t ts)
+    {
+        mDb.query("update chats set last_ts=? where chatid=?", ts, mMessages.chatId());
+    }
 };
 
 #endif
@@ -0,0 +1,210 @@
+#ifndef __CHATD_HISTORYLIST_H__
+#define __CHATD_HISTORYLIST_H__
+
+#include <assert.h>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "chatdMsg.h"
+
+namespace chatd
+{
+/** @brief One direction of the RAM history buffer of a chat (see Chat::mForwardList
+ * and Chat::mBackwardList): a sequence of messages that grows at its end, and is
+ * truncated at either end.
+ * Messages are constructed in place in fixed-size chunks, instead of being allocated
+ * one by one, and never move, so pointers to them stay valid until they are removed.
+ * Small payloads are copied to blocks that are bump-allocated per chunk and that the
+ * messages borrow, in the same way as received frames (see Message::mFrame). A block
+ * is freed when no message references it anymore. A payload that is modified later
+ * is copied to its own heap block, as usual.
+ */
+class HistoryList
+{
+public:
+    enum
+    {
+        kChunkSize = 128, //messages per chunk
+        kBlockSize = 16384, //payload blocks
+        kMaxBlockPayload = 2048 //bigger payloads stay in their own heap blocks
+    };
+protected:
+    struct Chunk
+    {
+        typename std::aligned_storage<sizeof(Message), alignof(Message)>::type slots[kChunkSize];
+    };
+    std::vector<std::unique_ptr<Chunk>> mChunks;
+    size_t mStart = 0; //position of the first message in mChunks[0]
+    size_t mSize = 0;
+    size_t mStaged = 0; //messages constructed after the last one, see stage()
+    std::shared_ptr<Buffer> mBlock; //the block where payloads are currently copied
+    Chunk* mBlockChunk = nullptr; //the chunk that mBlock is used for
+    size_t mBlockUsed = 0;
+    Message* slot(size_t pos) const
+    {
+        return reinterpret_cast<Message*>(&mChunks[pos / kChunkSize]->slots[pos % kChunkSize]);
+    }
+    Chunk* chunkFor(size_t pos)
+    {
+        while (mChunks.size() <= pos / kChunkSize)
+            mChunks.emplace_back(new Chunk);
+        return mChunks[pos / kChunkSize].get();
+    }
+    /** Returns space for \c len bytes of payload of a message in \c chunk, or NULL
+     * if the payload should not be copied to a block */
+    char* blockAlloc(Chunk* chunk, size_t len)
+    {
+        if (!len || len > kMaxBlockPayload)
+            return nullptr;
+        if (!mBlock || mBlockChunk != chunk || mBlockUsed + len > kBlockSize)
+        {
+            mBlock = std::make_shared<Buffer>((size_t)kBlockSize);
+            mBlockChunk = chunk;
+            mBlockUsed = 0;
+        }
+        char* ptr = mBlock->buf() + mBlockUsed;
+        mBlockUsed = (mBlockUsed + len + 7) & ~(size_t)7; //keep payloads 8-byte aligned
+        return ptr;
+    }
+    void destroy(size_t start, size_t end)
+    {
+        for (size_t pos = start; pos < end; pos++)
+            slot(pos)->~Message();
+    }
+    void discardStaged()
+    {
+        destroy(mStart + mSize, mStart + mSize + mStaged);
+        mStaged = 0;
+    }
+    /** Frees the chunks after the last message */
+    void freeTail()
+    {
+        size_t used = mSize ? (mStart + mSize + kChunkSize - 1) / kChunkSize : 0;
+        if (used >= mChunks.size())
+            return;
+        if (!mSize)
+            mStart = 0;
+        for (size_t i = used; i < mChunks.size(); i++)
+        {
+            if (mChunks[i].get() == mBlockChunk)
+                releaseBlock();
+        }
+        mChunks.resize(used);
+    }
+    void releaseBlock()
+    {
+        mBlock.reset();
+        mBlockChunk = nullptr;
+    }
+public:
+    HistoryList() {}
+    HistoryList(const HistoryList&) = delete;
+    HistoryList& operator=(const HistoryList&) = delete;
+    ~HistoryList() { clear(); }
+    size_t size() const { return mSize; }
+    bool empty() const { return !mSize; }
+    Message* operator[](size_t idx) const { assert(idx < mSize); return slot(mStart + idx); }
+    Message* front() const { return (*this)[0]; }
+    Message* back() const { return (*this)[mSize-1]; }
+    /** @brief Appends \c msg and takes its ownership. If \c msg was created via
+     * stage(), it is just committed, otherwise it is moved into the list and deleted.
+     * @returns The message in the list
+     */
+    Message* push_back(Message* msg)
+    {
+        if (mStaged)
+        {
+            if (msg == slot(mStart + mSize))
+            {
+                mStaged--;
+                mSize++;
+                return msg;
+            }
+            //left over by an aborted load
+            discardStaged();
+        }
+        size_t pos = mStart + mSize;
+        Chunk* chunk = chunkFor(pos);
+        Message* dest = slot(pos);
+        new (dest) Message(std::move(*msg));
+        delete msg;
+        mSize++;
+        if (!dest->isBorrowed())
+        {
+            char* data = blockAlloc(chunk, dest->dataSize());
+            if (data)
+            {
+                memcpy(data, dest->buf(), dest->dataSize());
+                dest->borrowFrom(mBlock, data);
+            }
+        }
+        return dest;
+    }
+    /** @brief Constructs a message after the last one (and after any previously
+     * staged ones), copying \c len bytes of payload at \c data, without adding it
+     * to the list yet. This avoids a temporary copy of messages loaded from the db.
+     * The staged messages must be added in the same order via push_back()
+     */
+    Message* stage(karere::Id msgid, karere::Id userid, uint32_t ts, uint16_t updated,
+        const char* data, size_t len, KeyId keyid, unsigned char type)
+    {
+        size_t pos = mStart + mSize + mStaged;
+        Chunk* chunk = chunkFor(pos);
+        Message* msg = slot(pos);
+        char* payload = blockAlloc(chunk, len);
+        if (payload)
+        {
+            memcpy(payload, data, len);
+            new (msg) Message(msgid, userid, ts, updated, mBlock, payload, len, keyid);
+            msg->type = type;
+        }
+        else
+        {
+            new (msg) Message(msgid, userid, ts, updated, data, len, false, keyid, type);
+        }
+        mStaged++;
+        return msg;
+    }
+    /** @brief Removes the first \c count messages */
+    void erase_front(size_t count)
+    {
+        assert(count <= mSize);
+        destroy(mStart, mStart + count);
+        mStart += count;
+        mSize -= count;
+        if (!mSize && !mStaged)
+        {
+            clear();
+            return;
+        }
+        size_t freeCount = mStart / kChunkSize;
+        for (size_t i = 0; i < freeCount; i++)
+        {
+            if (mChunks[i].get() == mBlockChunk)
+                releaseBlock();
+        }
+        mChunks.erase(mChunks.begin(), mChunks.begin() + freeCount);
+        mStart -= freeCount * kChunkSize;
+    }
+    /** @brief Removes the messages after the first \c count ones */
+    void truncate(size_t count)
+    {
+        if (count >= mSize)
+            return;
+        discardStaged();
+        destroy(mStart + count, mStart + mSize);
+        mSize = count;
+        freeTail();
+    }
+    void clear()
+    {
+        discardStaged();
+        destroy(mStart, mStart + mSize);
+        mSize = 0;
+        mStart = 0;
+        mChunks.clear();
+        releaseBlock();
+    }
+};
+}
+#endif
@@ -73,6 +73,12 @@ public:
         }, 2000, appCtx);
         return pms;
     }
+/**
+ * @brief Whether \c msgEncrypt() would encrypt \c msg synchronously, i.e. with the
+ * current send key or an already known one, without generating a new key.
+ * Used to encrypt messages ahead while an earlier one is still being encrypted.
+ */
+    virtual bool canEncryptImmediately(const Message& msg) const { return false; }
 /**
  * @brief Called by the client for received messages to decrypt them.
  * The crypto module \b must also set the type of the message, so that the client
@@ -89,6 +95,26 @@ public:
         }, delay, appCtx);
         return pms;
     }
+/**
+ * @brief A decryption whose CPU-bound part can run on a worker thread.
+ * \c run() is called on a worker thread and must not access any shared state.
+ * \c finish() is called on the app thread after \c run() has returned, and
+ * returns the same as \c msgDecrypt() would for that message.
+ */
+    class DecryptJob
+    {
+    public:
+        virtual void run() = 0;
+        virtual promise::Promise<Message*> finish() = 0;
+        virtual ~DecryptJob(){}
+    };
+/**
+ * @brief Returns a job that decrypts \c msg off the app thread, or \c nullptr
+ * if the keys needed are not available right now, in which case the client
+ * calls \c msgDecrypt(). The job copies what it needs, \c msg is only touched
+ * by \c DecryptJob::finish().
+ */
+    virtual DecryptJob* msgDecryptJob(Message* msg) { return nullptr; }
 /**
  * @brief The chatroom connection (to the chatd server shard) state state has changed.
  */
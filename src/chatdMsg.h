@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <memory>
 #include <buffer.h>
 #include "karereId.h"
 
@@ -266,7 +267,12 @@ public:
         kNotSeen, //< User hasn't read this message yet
         kSeen //< User has read this message
     };
-    enum { kFlagForceNonText = 0x01 };
+    enum
+    {
+        kFlagForceNonText = 0x01,
+        /** Received as NEWMSG or MSGUPD, as opposed to fetched from the history */
+        kFlagReceivedAsNew = 0x02
+    };
     /** @brief Info recorder in a management message.
      * When a message is a management message, _and_ it needs to carry additional
      * info besides the standard fields (such as sender), the additional data
@@ -304,6 +310,9 @@ private:
 protected:
     uint8_t mIsEncrypted = 0; //0 = not encrypted, 1 = encrypted, 2 = encrypted, there was a decrypt error
     uint8_t mFlags = 0;
+    /** The received frame or history block (see HistoryList) that the message data
+     * is borrowed from, if any */
+    std::shared_ptr<Buffer> mFrame;
 public:
     karere::Id userid;
     uint32_t ts;
@@ -317,6 +326,14 @@ public:
     karere::Id id() const { return mId; }
     bool isSending() const { return mIdIsXid; }
     uint8_t isEncrypted() const { return mIsEncrypted; }
+    bool receivedAsNew() const { return mFlags & kFlagReceivedAsNew; }
+    void setReceivedAsNew(bool isNew)
+    {
+        if (isNew)
+            mFlags |= kFlagReceivedAsNew;
+        else
+            mFlags &= ~kFlagReceivedAsNew;
+    }
     void setEncrypted(uint8_t encrypted) { mIsEncrypted = encrypted; }
     void setId(karere::Id aId, bool isXid) { mId = aId; mIdIsXid = isXid; }
     explicit Message(karere::Id aMsgid, karere::Id aUserid, uint32_t aTs, uint16_t aUpdated,
@@ -329,6 +346,74 @@ public:
             KeyId aKeyid=CHATD_KEYID_INVALID, unsigned char aType=kMsgInvalid, void* aUserp=nullptr)
         :Buffer(msg, msglen), mId(aMsgid), mIdIsXid(aIsSending), userid(aUserid), ts(aTs),
             updated(aUpdated), keyid(aKeyid), type(aType), userp(aUserp){}
+    /** @brief Creates a received message that references \c msglen bytes at \c msg,
+     * inside \c frame, instead of copying them. The frame is retained until the
+     * message content is replaced, normally by the decrypted one.
+     */
+    explicit Message(karere::Id aMsgid, karere::Id aUserid, uint32_t aTs, uint16_t aUpdated,
+            const std::shared_ptr<Buffer>& frame, const char* msg, size_t msglen,
+            KeyId aKeyid=CHATD_KEYID_INVALID)
+        :Buffer(0), mId(aMsgid), userid(aUserid), ts(aTs), updated(aUpdated), keyid(aKeyid),
+            type(kMsgInvalid), userp(nullptr)
+    {
+        borrow(msg, msglen);
+        if (isBorrowed())
+            mFrame = frame;
+    }
+    /** @brief Makes the message reference \c data, inside \c frame, instead of
+     * owning its content. \c data must hold a copy of the current content */
+    void borrowFrom(const std::shared_ptr<Buffer>& frame, const char* data)
+    {
+        borrow(data, mDataSize);
+        mFrame = isBorrowed() ? frame : nullptr;
+    }
+    /** @brief Whether the message data is still a reference into a received frame */
+    bool referencesFrame() const { return mFrame.get() != nullptr; }
+    /** @brief Copies the data out of the frame it references, so the frame can be
+     * recycled. Used for messages that will stay encrypted (i.e. decrypt failed) */
+    void detachFrame()
+    {
+        if (!mFrame)
+            return;
+        unshare();
+        mFrame.reset();
+    }
+    // The methods below replace the content, so they also release the frame
+    using Buffer::assign;
+    void assign(const void* data, size_t datalen)
+    {
+        auto frame = std::move(mFrame); //data may point inside the frame
+        Buffer::assign(data, datalen);
+    }
+    /** @brief Returns a writable block of \c size bytes at the start of the message,
+     * for building new content (i.e. the decrypted one) in it. Unlike with clear(),
+     * the frame stays retained until the content is replaced via assign() or clear(),
+     * as the new content may be produced from data in the frame
+     */
+    char* writableBlock(size_t size)
+    {
+        Buffer::clear();
+        return writePtr(0, size);
+    }
+    void takeFrom(Message&& other)
+    {
+        Buffer::takeFrom(std::move(other));
+        mFrame = std::move(other.mFrame);
+    }
+    void clear()
+    {
+        //the data may have been unshared from the frame already, i.e. via writableBlock()
+        if (isBorrowed())
+            zero();
+        else
+            Buffer::clear();
+        mFrame.reset();
+    }
+    void free()
+    {
+        Buffer::free();
+        mFrame.reset();
+    }
 
     /** @brief Returns the ManagementInfo structure contained within the message
      * content. Throws if the message is not a management message, or if the
@@ -2,6 +2,18 @@
 #define _KARERE_DB_H
 
 #include <sqlite3.h>
+#include <string>
+#include <list>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <map>
+#include <functional>
 
 struct SqliteString
 {
@@ -16,6 +28,288 @@ struct SqliteString
 };
 class SqliteStmt;
 
+/** Prepared statements of a connection that are not in use, keyed by their sql.
+ * The number of kept statements is bounded, the least recently used is finalized first */
+class SqliteStmtCache
+{
+protected:
+    typedef std::list<std::pair<std::string, sqlite3_stmt*>> StmtLru;
+    StmtLru mLru; //most recently used first
+    std::unordered_map<std::string, StmtLru::iterator> mIndex;
+    size_t mMaxSize = 64;
+    void evict()
+    {
+        assert(!mLru.empty());
+        auto& oldest = mLru.back();
+        sqlite3_finalize(oldest.second);
+        mIndex.erase(oldest.first);
+        mLru.pop_back();
+    }
+public:
+    std::atomic<size_t> mHits{0};
+    std::atomic<size_t> mMisses{0};
+    sqlite3_stmt* acquire(sqlite3* db, const char* sql)
+    {
+        auto it = mIndex.find(sql);
+        if (it != mIndex.end())
+        {
+            mHits++;
+            auto stmt = it->second->second;
+            mLru.erase(it->second);
+            mIndex.erase(it);
+            return stmt;
+        }
+        mMisses++;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            sqlite3_finalize(stmt);
+            return nullptr;
+        }
+        return stmt;
+    }
+    void release(sqlite3_stmt* stmt)
+    {
+        sqlite3_reset(stmt);
+        if (!mMaxSize)
+        {
+            sqlite3_finalize(stmt);
+            return;
+        }
+        sqlite3_clear_bindings(stmt);
+        std::string sql(sqlite3_sql(stmt));
+        if (mIndex.find(sql) != mIndex.end())
+        {
+            //another instance with the same sql is already cached
+            sqlite3_finalize(stmt);
+            return;
+        }
+        mLru.emplace_front(sql, stmt);
+        mIndex.emplace(std::move(sql), mLru.begin());
+        if (mLru.size() > mMaxSize)
+        {
+            evict();
+        }
+    }
+    void setMaxSize(size_t size)
+    {
+        mMaxSize = size;
+        while (mLru.size() > size)
+            evict();
+    }
+    void clear()
+    {
+        while (!mLru.empty())
+            evict();
+    }
+};
+
+/** A copy of a value bound to a statement that is executed asynchronously.
+ * The constructors mirror the \c SqliteStmt::bind() overloads */
+class SqliteValue
+{
+protected:
+    enum: uint8_t { kNull, kInt, kInt64, kText, kBlob } mType;
+    int64_t mInt = 0;
+    std::string mData;
+public:
+    SqliteValue(int val): mType(kInt), mInt(val){}
+    SqliteValue(int64_t val): mType(kInt64), mInt(val){}
+    SqliteValue(uint64_t val): mType(kInt64), mInt((int64_t)val){}
+    SqliteValue(unsigned int val): mType(kInt), mInt((int)val){}
+    SqliteValue(const std::string& val): mType(kText), mData(val){}
+    SqliteValue(const char* val): mType(val ? kText : kNull), mData(val ? val : ""){}
+    SqliteValue(const StaticBuffer& val): mType(val.buf() ? kBlob : kNull)
+    {
+        if (val.buf())
+            mData.assign(val.buf(), val.dataSize());
+    }
+    int bind(sqlite3_stmt* stmt, int col) const
+    {
+        switch (mType)
+        {
+            case kInt: return sqlite3_bind_int(stmt, col, (int)mInt);
+            case kInt64: return sqlite3_bind_int64(stmt, col, mInt);
+            case kText: return sqlite3_bind_text(stmt, col, mData.c_str(), (int)mData.size(), SQLITE_STATIC);
+            case kBlob: return sqlite3_bind_blob(stmt, col, mData.data(), (int)mData.size(), SQLITE_STATIC);
+            default: return sqlite3_bind_null(stmt, col);
+        }
+    }
+};
+
+/** Executes the writes of a connection in a background thread, in the order in which
+ * they were posted. A commit restarts the open transaction, and only the last one of
+ * all commits that are pending when the thread wakes up is actually done (group commit).
+ * A failed write doesn't affect the following ones. As errors can't be reported to the
+ * caller of the write, each one is passed to the error handler, and the first one is
+ * kept and thrown by \c SqliteDb::flushWrites() */
+class SqliteWriter
+{
+public:
+    enum { kStatement, kExec, kCommit };
+    typedef std::function<void(const std::string&)> ErrorHandler;
+    struct Job
+    {
+        int type;
+        std::string sql;
+        std::vector<SqliteValue> args;
+        /** If not negative, the number of rows that the statement must modify */
+        int expectedChanges = -1;
+        const char* opname = nullptr;
+        Job(int aType, const char* aSql): type(aType), sql(aSql ? aSql : ""){}
+    };
+protected:
+    sqlite3* mDb;
+    SqliteStmtCache mStmtCache;
+    std::deque<Job> mQueue;
+    std::mutex mMutex;
+    std::condition_variable mWorkCv;
+    std::condition_variable mIdleCv;
+    bool mBusy = false;
+    bool mStop = false;
+    std::string mError;
+    ErrorHandler mErrorHandler;
+    std::atomic<unsigned> mErrorCount{0};
+    std::thread mThread; //must be the last member, it starts right away
+    void setError(const std::string& msg)
+    {
+        ErrorHandler handler;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mError.empty())
+                mError = msg;
+            handler = mErrorHandler;
+        }
+        mErrorCount++;
+        if (handler)
+            handler(msg);
+    }
+    void setSqliteError(const std::string& sql)
+    {
+        std::string msg("Error executing queued '");
+        msg.append(sql).append("': ");
+        const char* errMsg = sqlite3_errmsg(mDb);
+        msg.append(errMsg ? errMsg : "(no error message)");
+        setError(msg);
+    }
+    void exec(const Job& job)
+    {
+        if (job.type != kStatement)
+        {
+            const char* sql = (job.type == kCommit)
+                ? "COMMIT TRANSACTION; BEGIN TRANSACTION" : job.sql.c_str();
+            if (sqlite3_exec(mDb, sql, nullptr, nullptr, nullptr) != SQLITE_OK)
+                setSqliteError(sql);
+            return;
+        }
+        auto stmt = mStmtCache.acquire(mDb, job.sql.c_str());
+        if (!stmt)
+        {
+            setSqliteError(job.sql);
+            return;
+        }
+        int col = 0;
+        int ret = SQLITE_OK;
+        for (auto& arg: job.args)
+        {
+            if ((ret = arg.bind(stmt, ++col)) != SQLITE_OK)
+                break;
+        }
+        if (ret == SQLITE_OK)
+        {
+            while ((ret = sqlite3_step(stmt)) == SQLITE_ROW);
+        }
+        if (ret != SQLITE_DONE)
+        {
+            setSqliteError(job.sql);
+        }
+        else if ((job.expectedChanges >= 0) && (sqlite3_changes(mDb) != job.expectedChanges))
+        {
+            std::string msg(job.opname ? job.opname : job.sql);
+            msg.append(": unexpected number of rows affected: expected ")
+               .append(std::to_string(job.expectedChanges)).append(", actual ")
+               .append(std::to_string(sqlite3_changes(mDb)));
+            setError(msg);
+        }
+        mStmtCache.release(stmt);
+    }
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for (;;)
+        {
+            mWorkCv.wait(lock, [this]() { return mStop || !mQueue.empty(); });
+            if (mQueue.empty())
+                break; //stopped and everything is written
+            std::deque<Job> jobs;
+            jobs.swap(mQueue);
+            mBusy = true;
+            lock.unlock();
+
+            size_t lastCommit = jobs.size();
+            for (size_t i = 0; i < jobs.size(); i++)
+            {
+                if (jobs[i].type == kCommit)
+                    lastCommit = i;
+            }
+            for (size_t i = 0; i < jobs.size(); i++)
+            {
+                if ((jobs[i].type != kCommit) || (i == lastCommit))
+                    exec(jobs[i]);
+            }
+
+            lock.lock();
+            mBusy = false;
+            mIdleCv.notify_all();
+        }
+        mStmtCache.clear();
+    }
+public:
+    SqliteWriter(sqlite3* db): mDb(db), mThread(&SqliteWriter::run, this) {}
+    ~SqliteWriter() { stop(); }
+    void post(Job&& job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mQueue.push_back(std::move(job));
+        }
+        mWorkCv.notify_one();
+    }
+    /** @brief Waits until all posted jobs are executed */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mIdleCv.wait(lock, [this]() { return mQueue.empty() && !mBusy; });
+    }
+    void setErrorHandler(ErrorHandler handler)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mErrorHandler = std::move(handler);
+    }
+    /** @brief The number of writes that failed so far */
+    unsigned errorCount() const { return mErrorCount; }
+    std::string takeError()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::string error;
+        error.swap(mError);
+        return error;
+    }
+    /** @brief Executes the remaining jobs and stops the thread */
+    void stop()
+    {
+        if (!mThread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mWorkCv.notify_one();
+        mThread.join();
+    }
+    const SqliteStmtCache& stmtCache() const { return mStmtCache; }
+};
+
 class SqliteDb
 {
 protected:
@@ -25,18 +319,83 @@ protected:
     bool mHasOpenTransaction = false;
     uint16_t mCommitInterval = 20;
     time_t mLastCommitTs = 0;
+    int mBatchLevel = 0;
+    SqliteStmtCache mStmtCache;
+    /** If set, statements that don't return rows are executed by the writer thread */
+    std::unique_ptr<SqliteWriter> mWriter;
+    SqliteWriter::ErrorHandler mWriteErrorHandler;
+    /** The last rowid allocated by \c newRowid(), per table */
+    std::map<std::string, int64_t> mLastRowids;
     inline int step(SqliteStmt& stmt);
+    sqlite3_stmt* acquireStmt(const char* sql)
+    {
+        waitWrites();
+        return mStmtCache.acquire(mDb, sql);
+    }
+    void releaseStmt(sqlite3_stmt* stmt)
+    {
+        if (mDb)
+            mStmtCache.release(stmt);
+        else
+            sqlite3_finalize(stmt);
+    }
+    /** Reads and direct writes (i.e. via SqliteStmt) must see the queued writes, and
+     * must not interleave with them */
+    void waitWrites()
+    {
+        if (mWriter)
+            mWriter->wait();
+    }
+    void throwWriteError()
+    {
+        if (!mWriter)
+            return;
+        auto error = mWriter->takeError();
+        if (!error.empty())
+            throw std::runtime_error(error);
+    }
+    static bool returnsRows(const char* sql)
+    {
+        while (*sql == ' ' || *sql == '\t' || *sql == '\n')
+            sql++;
+        static const char* kReadOps[] = { "select", "pragma" };
+        for (auto op: kReadOps)
+        {
+            size_t i = 0;
+            for (; op[i]; i++)
+            {
+                if ((sql[i] | 0x20) != op[i])
+                    break;
+            }
+            if (!op[i])
+                return true;
+        }
+        return false;
+    }
+    template <class T, class... Args>
+    static void appendValues(std::vector<SqliteValue>& values, T&& val, Args&&... args)
+    {
+        values.emplace_back(val);
+        appendValues(values, args...);
+    }
+    static void appendValues(std::vector<SqliteValue>&) {}
     void beginTransaction()
     {
         assert(!mHasOpenTransaction);
-        simpleQuery("BEGIN TRANSACTION");
+        if (mWriter)
+            mWriter->post(SqliteWriter::Job(SqliteWriter::kExec, "BEGIN TRANSACTION"));
+        else
+            simpleQuery("BEGIN TRANSACTION");
         mHasOpenTransaction = true;
     }
     bool commitTransaction()
     {
         if (!mHasOpenTransaction)
             return false;
-        simpleQuery("COMMIT TRANSACTION");
+        if (mWriter)
+            mWriter->post(SqliteWriter::Job(SqliteWriter::kExec, "COMMIT TRANSACTION"));
+        else
+            simpleQuery("COMMIT TRANSACTION");
         mHasOpenTransaction = false;
         mLastCommitTs = time(NULL);
         return true;
@@ -45,10 +404,19 @@ public:
     SqliteDb(sqlite3* db=nullptr, uint16_t commitInterval=20)
     : mDb(db), mCommitInterval(commitInterval)
     {}
-    bool open(const char* fname, bool commitEach=true)
+    //the statement cache and the transaction state belong to the connection
+    SqliteDb(const SqliteDb&) = delete;
+    SqliteDb& operator=(const SqliteDb&) = delete;
+    /** @param asyncWrites - If true, the db is put in WAL mode and statements
+     * that don't return rows, as well as commits, are queued and executed by a
+     * background thread. See \c flushWrites() */
+    bool open(const char* fname, bool commitEach=true, bool asyncWrites=false)
     {
         assert(!mDb);
-        int ret = sqlite3_open(fname, &mDb);
+        int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+        if (asyncWrites)
+            flags |= SQLITE_OPEN_FULLMUTEX; //the writer thread shares the connection
+        int ret = sqlite3_open_v2(fname, &mDb, flags, nullptr);
         if (!mDb)
             return false;
         if (ret != SQLITE_OK)
@@ -57,6 +425,22 @@ public:
             mDb = nullptr;
             return false;
         }
+        if (asyncWrites)
+        {
+            try
+            {
+                simpleQuery("PRAGMA journal_mode=WAL");
+                simpleQuery("PRAGMA synchronous=NORMAL");
+            }
+            catch(std::exception&)
+            {
+                sqlite3_close(mDb);
+                mDb = nullptr;
+                return false;
+            }
+            mWriter.reset(new SqliteWriter(mDb));
+            mWriter->setErrorHandler(mWriteErrorHandler);
+        }
         mCommitEach = commitEach;
         if (!mCommitEach)
         {
@@ -71,9 +455,37 @@ public:
             return;
         if (!mCommitEach)
             commit();
+        if (mWriter)
+        {
+            mWriter->stop();
+            mWriter.reset();
+        }
+        mStmtCache.clear();
+        mLastRowids.clear();
         sqlite3_close(mDb);
         mDb = nullptr;
     }
+    /** @brief Waits until the queued writes are executed. If \c commit is true, the
+     * open transaction is committed as well, so that everything written so far is
+     * on disk when this returns. Throws if a queued write failed */
+    void flushWrites(bool commit=false)
+    {
+        if (commit && !mCommitEach)
+            this->commit();
+        waitWrites();
+        throwWriteError();
+    }
+    /** @brief Sets the function that is called, from the writer thread, for every
+     * queued write that fails */
+    void setWriteErrorHandler(SqliteWriter::ErrorHandler handler)
+    {
+        mWriteErrorHandler = handler;
+        if (mWriter)
+            mWriter->setErrorHandler(std::move(handler));
+    }
+    /** @brief The number of queued writes that failed so far. Caches of the db
+     * contents can compare it to detect that a write they assumed didn't happen */
+    unsigned writeErrorCount() const { return mWriter ? mWriter->errorCount() : 0; }
     bool isOpen() const { return mDb != nullptr; }
     void setCommitMode(bool commitEach)
     {
@@ -86,13 +498,34 @@ public:
         }
     }
     void setCommitInterval(uint16_t sec) { mCommitInterval = sec; }
+    /** @brief Sets the max number of idle prepared statements kept for reuse. Zero disables the cache */
+    void setStmtCacheSize(size_t size) { mStmtCache.setMaxSize(size); }
+    size_t stmtCacheHits() const
+    {
+        return mStmtCache.mHits + (mWriter ? mWriter->stmtCache().mHits.load() : 0);
+    }
+    size_t stmtCacheMisses() const
+    {
+        return mStmtCache.mMisses + (mWriter ? mWriter->stmtCache().mMisses.load() : 0);
+    }
     bool hasOpenTransaction() const { return !mHasOpenTransaction; }
-    operator sqlite3*() { return mDb; }
+    /** Direct access to the connection, e.g. sqlite3_changes(), sees all queued writes */
+    operator sqlite3*() { waitWrites(); return mDb; }
     operator const sqlite3*() const { return mDb; }
     template <class... Args>
     inline bool query(const char* sql, Args&&... args);
+    /** @brief Executes a statement that must modify exactly \c count rows. In async
+     * mode the check is done by the writer, and a mismatch is reported as a failed write.
+     * Otherwise, it throws */
+    template <class... Args>
+    inline void queryChanges(int count, const char* opname, const char* sql, Args&&... args);
+    /** @brief Allocates the rowid of a row to be inserted in \c table, so that it's
+     * known without waiting for the queued writes. All inserts in \c table must
+     * use rowids allocated by this function */
+    inline int64_t newRowid(const char* table);
     void simpleQuery(const char* sql)
     {
+        waitWrites();
         SqliteString err;
         auto ret = sqlite3_exec(mDb, sql, nullptr, nullptr, &err.mStr);
         if (ret == SQLITE_OK)
@@ -110,6 +543,12 @@ public:
     {
         if (mCommitEach)
             return;
+        if (mWriter && mHasOpenTransaction)
+        {
+            mWriter->post(SqliteWriter::Job(SqliteWriter::kCommit, nullptr));
+            mLastCommitTs = time(NULL);
+            return;
+        }
         commitTransaction();
         beginTransaction();
     }
@@ -120,13 +559,33 @@ public:
         // the rollback may fail - in case of some critical errors, sqlite automatically
         // does a rollback. In such cases, we should ignore the error returned by
         // rollback, it's harmless
+        waitWrites();
         sqlite3_exec(mDb, "ROLLBACK", nullptr, nullptr, nullptr);
+        mHasOpenTransaction = false;
         beginTransaction();
         return true;
     }
-    bool timedCommit()
+    /** @brief Groups all statements until the matching \c endBatch() in a single
+     * transaction, also in commit-each mode. Timed commits are deferred meanwhile.
+     * Batches can be nested */
+    void beginBatch()
+    {
+        if ((mBatchLevel++ == 0) && mCommitEach)
+            beginTransaction();
+    }
+    void endBatch()
     {
+        assert(mBatchLevel > 0);
+        if (--mBatchLevel)
+            return;
         if (mCommitEach)
+            commitTransaction();
+        else
+            timedCommit();
+    }
+    bool timedCommit()
+    {
+        if (mCommitEach || mBatchLevel)
             return false;
 
         auto now = time(NULL);
@@ -170,7 +629,8 @@ protected:
 public:
     SqliteStmt(SqliteDb& db, const char* sql):mDb(db)
     {
-        if (sqlite3_prepare_v2(db, sql, -1, &mStmt, nullptr) != SQLITE_OK)
+        mStmt = db.acquireStmt(sql);
+        if (!mStmt)
         {
             const char* errMsg = sqlite3_errmsg(mDb);
             if (!errMsg)
@@ -185,7 +645,7 @@ public:
     ~SqliteStmt()
     {
         if (mStmt)
-            sqlite3_finalize(mStmt);
+            mDb.releaseStmt(mStmt);
     }
     operator sqlite3_stmt*() { return mStmt; }
     operator const sqlite3_stmt*() const {return mStmt; }
@@ -285,11 +745,62 @@ public:
 template <class... Args>
 inline bool SqliteDb::query(const char* sql, Args&&... args)
 {
+    if (mWriter && !returnsRows(sql))
+    {
+        SqliteWriter::Job job(SqliteWriter::kStatement, sql);
+        job.args.reserve(sizeof...(args));
+        appendValues(job.args, args...);
+        mWriter->post(std::move(job));
+        timedCommit();
+        return false;
+    }
     SqliteStmt stmt(*this, sql);
     stmt.bindV(args...);
     return stmt.step();
 }
 
+template <class... Args>
+inline void SqliteDb::queryChanges(int count, const char* opname, const char* sql, Args&&... args)
+{
+    if (mWriter)
+    {
+        SqliteWriter::Job job(SqliteWriter::kStatement, sql);
+        job.args.reserve(sizeof...(args));
+        appendValues(job.args, args...);
+        job.expectedChanges = count;
+        job.opname = opname;
+        mWriter->post(std::move(job));
+        timedCommit();
+        return;
+    }
+    SqliteStmt stmt(*this, sql);
+    stmt.bindV(args...);
+    stmt.step();
+    auto actual = sqlite3_changes(mDb);
+    if (actual == count)
+        return;
+    std::string msg(opname ? opname : sql);
+    msg.append(": unexpected number of rows affected: expected ")
+       .append(std::to_string(count)).append(", actual ")
+       .append(std::to_string(actual));
+    throw std::runtime_error(msg);
+}
+
+inline int64_t SqliteDb::newRowid(const char* table)
+{
+    auto it = mLastRowids.find(table);
+    if (it == mLastRowids.end())
+    {
+        //with AUTOINCREMENT, rowids of deleted rows are not reused either
+        SqliteStmt stmt(*this, std::string("select max(ifnull((select seq from sqlite_sequence "
+            "where name=?), 0), ifnull((select max(rowid) from ")+table+"), 0))");
+        stmt << table;
+        stmt.stepMustHaveData("newRowid");
+        it = mLastRowids.emplace(table, stmt.int64Col(0)).first;
+    }
+    return ++it->second;
+}
+
 inline int SqliteDb::step(SqliteStmt& stmt)
 {
     auto ret = sqlite3_step(stmt);
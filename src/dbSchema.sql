@@ -12,7 +12,9 @@ CREATE TABLE vars(name text not null primary key, value blob);
 CREATE TABLE chats(chatid int64 unique primary key, shard tinyint,
     own_priv tinyint, peer int64 default -1, peer_priv tinyint default 0,
     title text, ts_created int64 not null default 0,
-    last_seen int64 default 0, last_recv int64 default 0);
+    last_seen int64 default 0, last_recv int64 default 0, unread_count int,
+    last_ts int default 0, last_msg_type tinyint, last_msg_idx int, last_msgid int64,
+    last_msg_sender int64, last_msg blob);
 CREATE TABLE contacts(userid int64 PRIMARY KEY, email text, visibility int,
     since int64 not null default 0);
 
@@ -28,7 +30,9 @@ CREATE TABLE chat_vars(chatid int64 not null, name text not null, value text,
 
 CREATE TABLE history(idx int not null, chatid int64 not null, msgid int64 not null,
     userid int64, keyid int not null, type tinyint, updated smallint, ts int,
-    is_encrypted tinyint, data blob, backrefid int64 not null, UNIQUE(chatid,msgid), UNIQUE(chatid,idx));
+    is_encrypted tinyint, data blob, backrefid int64 not null, is_text tinyint not null default 0,
+    UNIQUE(chatid,msgid), UNIQUE(chatid,idx));
+CREATE INDEX history_text ON history(chatid, is_text, idx);
 
 CREATE TABLE sendkeys(chatid int64 not null, userid int64 not null, keyid int64 not null, key blob not null,
     ts int not null, UNIQUE(chatid, userid, keyid));
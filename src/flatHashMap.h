@@ -0,0 +1,212 @@
+#ifndef _FLAT_HASHMAP_H_INCLUDED_
+#define _FLAT_HASHMAP_H_INCLUDED_
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "karereId.h"
+
+namespace karere
+{
+/** @brief Hash of 64-bit ids, for FlatHashMap. std::hash<karere::Id> is the
+ * identity, which is fine for node-based hash tables, but ids with patterns in
+ * their low bits (i.e. indexes, counters) would cluster in an open-addressing
+ * table. This is the splitmix64 finalizer, which mixes all bits.
+ */
+struct IdHash
+{
+    size_t operator()(uint64_t id) const
+    {
+        id ^= id >> 30;
+        id *= 0xbf58476d1ce4e5b9ULL;
+        id ^= id >> 27;
+        id *= 0x94d049bb133111ebULL;
+        id ^= id >> 31;
+        return (size_t)id;
+    }
+};
+
+/** @brief A hash map that keeps its entries in a single array, with linear
+ * probing, for the indexes keyed by ids. Compared to std::map, it doesn't
+ * allocate a node per entry, and lookups don't chase pointers.
+ * Provides the subset of the std::map interface that we use. Unlike with std::map:
+ * - Inserting may move the entries, invalidating iterators and references to them.
+ *   Erasing doesn't move any entry.
+ * - Iteration order is unspecified.
+ */
+template <class K, class V, class Hash=IdHash>
+class FlatHashMap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<K, V> value_type;
+protected:
+    enum: uint8_t { kEmpty = 0, kFull = 1, kErased = 2 };
+    typedef typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type Slot;
+    std::unique_ptr<uint8_t[]> mCtrl;
+    std::unique_ptr<Slot[]> mSlots;
+    size_t mCapacity = 0; //always a power of 2, or 0
+    size_t mSize = 0;
+    size_t mErased = 0; //slots that held an entry, which probing has to step over
+    Hash mHash;
+    value_type* slot(size_t pos) const { return reinterpret_cast<value_type*>(&mSlots[pos]); }
+    /** Returns the position of the entry with \c key, or mCapacity if there is none */
+    size_t findPos(const K& key) const
+    {
+        if (!mSize)
+            return mCapacity;
+        size_t mask = mCapacity - 1;
+        for (size_t pos = mHash(key) & mask;; pos = (pos + 1) & mask)
+        {
+            if (mCtrl[pos] == kEmpty)
+                return mCapacity;
+            if ((mCtrl[pos] == kFull) && (slot(pos)->first == key))
+                return pos;
+        }
+    }
+    /** Returns the position where \c key, which is not in the map, goes */
+    size_t insertPos(const K& key) const
+    {
+        size_t mask = mCapacity - 1;
+        size_t pos = mHash(key) & mask;
+        while (mCtrl[pos] == kFull)
+            pos = (pos + 1) & mask;
+        return pos;
+    }
+    /** Keeps used slots (including erased ones) at most 7/8 of the capacity,
+     * so that probing always ends at an empty slot */
+    void reserveOne()
+    {
+        if ((mSize + mErased + 1) * 8 <= mCapacity * 7)
+            return;
+        size_t capacity = 16;
+        while (capacity * 3 < (mSize + 1) * 4) //at most 3/4 full after growing
+            capacity *= 2;
+        rehash(capacity);
+    }
+    void rehash(size_t capacity)
+    {
+        std::unique_ptr<uint8_t[]> oldCtrl(std::move(mCtrl));
+        std::unique_ptr<Slot[]> oldSlots(std::move(mSlots));
+        size_t oldCapacity = mCapacity;
+        mCtrl.reset(new uint8_t[capacity]);
+        memset(mCtrl.get(), kEmpty, capacity);
+        mSlots.reset(new Slot[capacity]);
+        mCapacity = capacity;
+        mErased = 0;
+        for (size_t i = 0; i < oldCapacity; i++)
+        {
+            if (oldCtrl[i] != kFull)
+                continue;
+            auto& entry = *reinterpret_cast<value_type*>(&oldSlots[i]);
+            size_t pos = insertPos(entry.first);
+            new (slot(pos)) value_type(std::move(entry));
+            mCtrl[pos] = kFull;
+            entry.~value_type();
+        }
+    }
+    template <bool isConst>
+    class Iter
+    {
+    protected:
+        typedef typename std::conditional<isConst, const FlatHashMap, FlatHashMap>::type Map;
+        typedef typename std::conditional<isConst, const value_type, value_type>::type Value;
+        Map* mMap;
+        size_t mPos;
+        void skip()
+        {
+            while ((mPos < mMap->mCapacity) && (mMap->mCtrl[mPos] != kFull))
+                mPos++;
+        }
+        Iter(Map* map, size_t pos): mMap(map), mPos(pos) { skip(); }
+        friend class FlatHashMap;
+        template <bool> friend class Iter;
+    public:
+        Iter(const Iter<false>& other): mMap(other.mMap), mPos(other.mPos) {}
+        Value& operator*() const { return *mMap->slot(mPos); }
+        Value* operator->() const { return mMap->slot(mPos); }
+        Iter& operator++() { mPos++; skip(); return *this; }
+        bool operator==(const Iter& other) const { return mPos == other.mPos; }
+        bool operator!=(const Iter& other) const { return mPos != other.mPos; }
+    };
+public:
+    typedef Iter<false> iterator;
+    typedef Iter<true> const_iterator;
+    FlatHashMap() {}
+    FlatHashMap(const FlatHashMap&) = delete;
+    FlatHashMap& operator=(const FlatHashMap&) = delete;
+    ~FlatHashMap() { clear(); }
+    size_t size() const { return mSize; }
+    bool empty() const { return !mSize; }
+    /** @brief Bytes allocated for the table */
+    size_t memoryUsage() const { return mCapacity * (sizeof(Slot) + 1); }
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, mCapacity); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, mCapacity); }
+    iterator find(const K& key) { return iterator(this, findPos(key)); }
+    const_iterator find(const K& key) const { return const_iterator(this, findPos(key)); }
+    size_t count(const K& key) const { return findPos(key) != mCapacity; }
+    /** @brief Inserts an entry with \c key and a value constructed from \c args,
+     * unless \c key is already in the map */
+    template <class... Args>
+    std::pair<iterator, bool> emplace(const K& key, Args&&... args)
+    {
+        size_t pos = findPos(key);
+        if (pos != mCapacity)
+            return std::make_pair(iterator(this, pos), false);
+        reserveOne();
+        pos = insertPos(key);
+        new (slot(pos)) value_type(std::piecewise_construct, std::forward_as_tuple(key),
+            std::forward_as_tuple(std::forward<Args>(args)...));
+        if (mCtrl[pos] == kErased)
+            mErased--;
+        mCtrl[pos] = kFull;
+        mSize++;
+        return std::make_pair(iterator(this, pos), true);
+    }
+    V& operator[](const K& key) { return emplace(key).first->second; }
+    iterator erase(iterator it)
+    {
+        size_t pos = it.mPos;
+        assert(pos < mCapacity && mCtrl[pos] == kFull);
+        // the value is destroyed only after the table is consistent, as its
+        // destructor may access the map
+        value_type erased(std::move(*slot(pos)));
+        slot(pos)->~value_type();
+        mCtrl[pos] = kErased;
+        mErased++;
+        mSize--;
+        return ++it;
+    }
+    size_t erase(const K& key)
+    {
+        size_t pos = findPos(key);
+        if (pos == mCapacity)
+            return 0;
+        erase(iterator(this, pos));
+        return 1;
+    }
+    void clear()
+    {
+        for (size_t i = 0; i < mCapacity; i++)
+        {
+            if (mCtrl[i] == kFull)
+                slot(i)->~value_type();
+        }
+        mCtrl.reset();
+        mSlots.reset();
+        mCapacity = mSize = mErased = 0;
+    }
+};
+
+/** @brief A FlatHashMap keyed by karere::Id */
+template <class V>
+using IdMap = FlatHashMap<Id, V>;
+}
+#endif
@@ -443,6 +443,41 @@ bool MegaChatApi::isMessageReceptionConfirmationActive() const
     return pImpl->isMessageReceptionConfirmationActive();
 }
 
+void MegaChatApi::setHistoryRamLimits(unsigned maxPerChat, unsigned maxTotal)
+{
+    pImpl->setHistoryRamLimits(maxPerChat, maxTotal);
+}
+
+void MegaChatApi::setDecryptThreads(unsigned numThreads)
+{
+    pImpl->setDecryptThreads(numThreads);
+}
+
+void MegaChatApi::setDecryptAhead(unsigned maxMessages)
+{
+    pImpl->setDecryptAhead(maxMessages);
+}
+
+void MegaChatApi::setPipelinedEncryption(bool enable)
+{
+    pImpl->setPipelinedEncryption(enable);
+}
+
+void MegaChatApi::setSendKeyLimits(unsigned maxInRam, unsigned maxAge)
+{
+    pImpl->setSendKeyLimits(maxInRam, maxAge);
+}
+
+void MegaChatApi::trimHistoryMemory()
+{
+    pImpl->trimHistoryMemory();
+}
+
+void MegaChatApi::setPerMessageStatusUpdates(bool enable)
+{
+    pImpl->setPerMessageStatusUpdates(enable);
+}
+
 MegaStringList *MegaChatApi::getChatAudioInDevices()
 {
     return pImpl->getChatAudioInDevices();
@@ -958,6 +993,15 @@ void MegaChatRoomListener::onMessageLoaded(MegaChatApi *api, MegaChatMessage *ms
 
 }
 
+void MegaChatRoomListener::onMessagesLoaded(MegaChatApi *api, MegaChatMessageList *msgs)
+{
+    for (unsigned int i = 0; i < msgs->size(); i++)
+    {
+        // the list keeps the ownership, as onMessageLoaded() expects
+        onMessageLoaded(api, const_cast<MegaChatMessage *>(msgs->get(i)));
+    }
+}
+
 void MegaChatRoomListener::onMessageReceived(MegaChatApi *api, MegaChatMessage *msg)
 {
 
@@ -968,6 +1012,11 @@ void MegaChatRoomListener::onMessageUpdate(MegaChatApi *api, MegaChatMessage *ms
 
 }
 
+void MegaChatRoomListener::onMessageStatusRangeChange(MegaChatApi *api, MegaChatHandle chatid, int fromIndex, int toIndex, int status)
+{
+
+}
+
 MegaChatMessage *MegaChatMessage::copy() const
 {
     return NULL;
@@ -1099,6 +1148,21 @@ void MegaChatLogger::log(int , const char *)
 }
 
 
+MegaChatMessageList *MegaChatMessageList::copy() const
+{
+    return NULL;
+}
+
+const MegaChatMessage *MegaChatMessageList::get(unsigned int i) const
+{
+    return NULL;
+}
+
+unsigned int MegaChatMessageList::size() const
+{
+    return 0;
+}
+
 MegaChatListItemList *MegaChatListItemList::copy() const
 {
     return NULL;
@@ -49,6 +49,7 @@ class MegaChatRequest;
 class MegaChatRequestListener;
 class MegaChatError;
 class MegaChatMessage;
+class MegaChatMessageList;
 class MegaChatRoom;
 class MegaChatRoomListener;
 class MegaChatCall;
@@ -251,6 +252,43 @@ public:
 
 };
 
+/**
+ * @brief List of MegaChatMessage objects
+ *
+ * A MegaChatMessageList has the ownership of the MegaChatMessage objects that it contains, so they will be
+ * only valid until the MegaChatMessageList is deleted. If you want to retain a MegaChatMessage returned by
+ * a MegaChatMessageList, use MegaChatMessage::copy.
+ *
+ * Objects of this class are immutable.
+ */
+class MegaChatMessageList
+{
+public:
+    virtual ~MegaChatMessageList() {}
+
+    virtual MegaChatMessageList *copy() const;
+
+    /**
+     * @brief Returns the MegaChatMessage at the position i in the MegaChatMessageList
+     *
+     * The MegaChatMessageList retains the ownership of the returned MegaChatMessage. It will be only valid until
+     * the MegaChatMessageList is deleted.
+     *
+     * If the index is >= the size of the list, this function returns NULL.
+     *
+     * @param i Position of the MegaChatMessage that we want to get for the list
+     * @return MegaChatMessage at the position i in the list
+     */
+    virtual const MegaChatMessage *get(unsigned int i)  const;
+
+    /**
+     * @brief Returns the number of MegaChatMessages in the list
+     * @return Number of MegaChatMessages in the list
+     */
+    virtual unsigned int size() const;
+
+};
+
 class MegaChatMessage
 {
 public:
@@ -2059,7 +2097,8 @@ public:
      * This function allows to retrieve only those messages that are already loaded
      * and notified by MegaChatRoomListener::onMessageLoaded and/or messages that are
      * in sending-status (not yet confirmed). For any other message, this function
-     * will return NULL.
+     * will return NULL. Loaded messages that have been evicted from RAM (see
+     * MegaChatApi::setHistoryRamLimits) are read from the local cache.
      *
      * You take the ownership of the returned value.
      *
@@ -2100,7 +2139,9 @@ public:
      * If the message is rejected by the server, the message will keep its temporal id and will have its
      * a message id set to MEGACHAT_INVALID_HANDLE.
      *
-     * You take the ownership of the returned value.
+     * You take the ownership of the returned value. It is a copy of the message in the sending
+     * queue and is not updated later: the confirmed message is a different object, and is
+     * reported by MegaChatRoomListener::onMessageUpdate.
      *
      * @note Any tailing carriage return and/or line feed ('\r' and '\n') will be removed.
      *
@@ -2394,6 +2435,114 @@ public:
      */
     bool isMessageReceptionConfirmationActive() const;
 
+    /**
+     * @brief Sets the limits of messages kept in RAM, per chatroom and in total
+     *
+     * Older messages are evicted from RAM periodically, and reloaded from the local
+     * cache when requested again. The messages loaded by the app since the last
+     * MegaChatApi::openChatRoom are kept while the chatroom is open.
+     *
+     * The limits can be set at any time, also before MegaChatApi::init, and are kept
+     * across logouts.
+     *
+     * @param maxPerChat Max number of messages per chatroom. 0 means no limit (the default)
+     * @param maxTotal Max number of messages in all chatrooms. 0 means no limit (the default)
+     */
+    void setHistoryRamLimits(unsigned maxPerChat, unsigned maxTotal);
+
+    /**
+     * @brief Sets the number of threads that decrypt received messages
+     *
+     * The signature verification and decryption of received messages whose keys are
+     * already known run on that many worker threads. Messages are still notified to
+     * the app in order. This speeds up loading a long history or a big backlog of new
+     * messages on multi-core devices.
+     *
+     * The setting can be changed at any time, also before MegaChatApi::init, and is
+     * kept across logouts.
+     *
+     * @param numThreads Number of worker threads. 0 (the default) decrypts messages on
+     * the main thread of the SDK
+     */
+    void setDecryptThreads(unsigned numThreads);
+
+    /**
+     * @brief Enables decrypting received messages ahead of one that can't be decrypted yet
+     *
+     * When a received message can't be decrypted immediately, i.e. because its key or
+     * the public key of its sender are being fetched, the following messages normally
+     * wait for it. If this option is enabled, up to \c maxMessages of them are decrypted
+     * meanwhile. Messages are still notified to the app in order, so this only shortens
+     * the time to show them once the waiting message is decrypted.
+     *
+     * The setting can be changed at any time, also before MegaChatApi::init, and is
+     * kept across logouts.
+     *
+     * @param maxMessages Max number of messages decrypted ahead of the waiting one.
+     * 0 (the default) disables decrypting ahead
+     */
+    void setDecryptAhead(unsigned maxMessages);
+
+    /**
+     * @brief Enables encrypting sent messages while a previous one waits for its encryption
+     *
+     * When a sent message can't be encrypted immediately, i.e. because a new key has
+     * to be created for a new participant of the chatroom, the following messages normally
+     * wait for it. If this option is enabled, the ones that use the same key are encrypted
+     * meanwhile, and sent in order right after it.
+     *
+     * The setting can be changed at any time, also before MegaChatApi::init, and is
+     * kept across logouts.
+     *
+     * @param enable True to encrypt the following messages meanwhile. False by default
+     */
+    void setPipelinedEncryption(bool enable);
+
+    /**
+     * @brief Sets the limits of the encryption keys of chatrooms kept by the SDK
+     *
+     * The keys of a chatroom are loaded from the local cache when needed, and only the
+     * most recently used ones are kept in RAM. Optionally, the keys received long ago
+     * are deleted from the local cache when the chatroom is loaded. They are only needed
+     * to decrypt old messages that are not in the local cache yet, which are sent again
+     * with their keys, or edits of old messages.
+     *
+     * The limits can be set at any time, also before MegaChatApi::init, and are kept
+     * across logouts.
+     *
+     * @param maxInRam Max number of keys kept in RAM per chatroom. 0 means the default (128)
+     * @param maxAge Keys received more than \c maxAge seconds ago are deleted from the
+     * local cache. It should be much longer than the time messages can be edited. 0 (the
+     * default) keeps all keys
+     */
+    void setSendKeyLimits(unsigned maxInRam, unsigned maxAge);
+
+    /**
+     * @brief Evicts from RAM all messages that are not needed
+     *
+     * Apps should call this function when the system reports memory pressure.
+     * The evicted messages are reloaded from the local cache when requested again.
+     * The messages loaded by the app since the last MegaChatApi::openChatRoom are kept
+     * while the chatroom is open.
+     */
+    void trimHistoryMemory();
+
+    /**
+     * @brief Enables or disables per-message notifications of status changes
+     *
+     * When the messages up to some index are delivered or seen, the SDK calls
+     * MegaChatRoomListener::onMessageStatusRangeChange once for the whole range. If this
+     * option is enabled, MegaChatRoomListener::onMessageUpdate is also called for every
+     * message of the range, as in previous versions. This can be a lot of callbacks
+     * after a long offline period, so apps should rather handle the range notification.
+     *
+     * This setting can be changed at any time, also before MegaChatApi::init, and is
+     * kept across logouts.
+     *
+     * @param enable True to also receive per-message notifications. False by default
+     */
+    void setPerMessageStatusUpdates(bool enable);
+
     // Audio/Video device management
     mega::MegaStringList *getChatAudioInDevices();
     mega::MegaStringList *getChatVideoInDevices();
@@ -3006,6 +3155,25 @@ public:
      */
     virtual void onMessageLoaded(MegaChatApi* api, MegaChatMessage *msg);   // loaded by loadMessages()
 
+    /**
+     * @brief This function is called when a batch of messages is loaded from the server
+     *
+     * Messages fetched from the server by MegaChatApi::loadMessages are notified in batches, from
+     * the newest to the oldest, instead of one by one. The end of the history is still notified by
+     * MegaChatRoomListener::onMessageLoaded with a NULL message.
+     *
+     * The default implementation calls MegaChatRoomListener::onMessageLoaded for every message
+     * in the list, so apps that don't override this function don't need any change.
+     *
+     * The SDK retains the ownership of the MegaChatMessageList in the second parameter. The list
+     * and its messages will be valid until this function returns. If you want to save a message,
+     * use MegaChatMessage::copy.
+     *
+     * @param api MegaChatApi connected to the account
+     * @param msgs MegaChatMessageList with the loaded messages
+     */
+    virtual void onMessagesLoaded(MegaChatApi* api, MegaChatMessageList *msgs);
+
     /**
      * @brief This function is called when a new message is received
      *
@@ -3048,6 +3216,26 @@ public:
      * @param msg MegaChatMessage representing the updated message
      */
     virtual void onMessageUpdate(MegaChatApi* api, MegaChatMessage *msg);
+
+    /**
+     * @brief This function is called when a range of messages changes its status
+     *
+     * When the messages up to some index are delivered or seen, this function is called
+     * once for the range of loaded messages that changed, instead of calling
+     * MegaChatRoomListener::onMessageUpdate for each of them (see
+     * MegaChatApi::setPerMessageStatusUpdates).
+     *
+     * If \c status is MegaChatMessage::STATUS_DELIVERED, only the messages sent by us in
+     * the range are affected. If it is MegaChatMessage::STATUS_SEEN, only the messages
+     * sent by other users are affected.
+     *
+     * @param api MegaChatApi connected to the account
+     * @param chatid MegaChatHandle that identifies the chat room
+     * @param fromIndex Index of the first message of the range
+     * @param toIndex Index of the last message of the range
+     * @param status New status of the affected messages
+     */
+    virtual void onMessageStatusRangeChange(MegaChatApi* api, MegaChatHandle chatid, int fromIndex, int toIndex, int status);
 };
 
 }
@@ -960,6 +960,7 @@ int MegaChatApiImpl::init(const char *sid)
     if (!mClient)
     {
         mClient = new karere::Client(*this->megaApi, websocketsIO, *this, this->megaApi->getBasePath(), karere::kClientIsMobile, this);
+        mClient->setChatdSettings(mChatdSettings);
         terminating = false;
     }
 
@@ -1045,7 +1046,7 @@ karere::ChatRoom *MegaChatApiImpl::findChatRoomByUser(MegaChatHandle userhandle)
     return chatroom;
 }
 
-chatd::Message *MegaChatApiImpl::findMessage(MegaChatHandle chatid, MegaChatHandle msgid)
+chatd::Message *MegaChatApiImpl::findMessage(MegaChatHandle chatid, MegaChatHandle msgid, std::unique_ptr<chatd::Message>& dbMsg)
 {
     Message *msg = NULL;
 
@@ -1059,6 +1060,11 @@ chatd::Message *MegaChatApiImpl::findMessage(MegaChatHandle chatid, MegaChatHand
         if (index != CHATD_IDX_INVALID)
         {
             msg = chat.findOrNull(index);
+            if (!msg)   // evicted from RAM
+            {
+                dbMsg.reset(chat.fetchFromDb(index));
+                msg = dbMsg.get();
+            }
         }
     }
 
@@ -1263,6 +1269,16 @@ void MegaChatApiImpl::fireOnMessageLoaded(MegaChatMessage *msg)
     delete msg;
 }
 
+void MegaChatApiImpl::fireOnMessagesLoaded(MegaChatMessageList *msgs)
+{
+    for(set<MegaChatRoomListener *>::iterator it = roomListeners.begin(); it != roomListeners.end() ; it++)
+    {
+        (*it)->onMessagesLoaded(chatApi, msgs);
+    }
+
+    delete msgs;
+}
+
 void MegaChatApiImpl::fireOnMessageReceived(MegaChatMessage *msg)
 {
     for(set<MegaChatRoomListener *>::iterator it = roomListeners.begin(); it != roomListeners.end() ; it++)
@@ -1283,6 +1299,14 @@ void MegaChatApiImpl::fireOnMessageUpdate(MegaChatMessage *msg)
     delete msg;
 }
 
+void MegaChatApiImpl::fireOnMessageStatusRangeChange(MegaChatHandle chatid, int fromIndex, int toIndex, int status)
+{
+    for(set<MegaChatRoomListener *>::iterator it = roomListeners.begin(); it != roomListeners.end() ; it++)
+    {
+        (*it)->onMessageStatusRangeChange(chatApi, chatid, fromIndex, toIndex, status);
+    }
+}
+
 void MegaChatApiImpl::fireOnChatListItemUpdate(MegaChatListItem *item)
 {
     for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
@@ -1690,7 +1714,7 @@ int MegaChatApiImpl::getUnreadChats()
     for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
     {
         ChatRoom *room = it->second;
-        if (room->isActive() && room->chat().unreadMsgCount())
+        if (room->isActive() && room->unreadCount())
         {
             count++;
         }
@@ -1751,7 +1775,7 @@ MegaChatListItemList *MegaChatApiImpl::getUnreadChatListItems()
     for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
     {
         ChatRoom *room = it->second;
-        if (room->isActive() && room->chat().unreadMsgCount())
+        if (room->isActive() && room->unreadCount())
         {
             items->addChatListItem(new MegaChatListItemPrivate(*it->second));
         }
@@ -1926,6 +1950,12 @@ MegaChatMessage *MegaChatApiImpl::getMessage(MegaChatHandle chatid, MegaChatHand
         if (index != CHATD_IDX_INVALID)     // only confirmed messages have index
         {
             Message *msg = chat.findOrNull(index);
+            std::unique_ptr<Message> dbMsg;
+            if (!msg)   // evicted from RAM
+            {
+                dbMsg.reset(chat.fetchFromDb(index));
+                msg = dbMsg.get();
+            }
             if (msg)
             {
                 megaMsg = new MegaChatMessagePrivate(*msg, chat.getMsgStatus(*msg, index), index);
@@ -2154,7 +2184,8 @@ MegaChatMessage *MegaChatApiImpl::editMessage(MegaChatHandle chatid, MegaChatHan
     if (chatroom)
     {
         Chat &chat = chatroom->chat();
-        Message *originalMsg = findMessage(chatid, msgid);
+        std::unique_ptr<Message> dbMsg;
+        Message *originalMsg = findMessage(chatid, msgid, dbMsg);
         Idx index;
         if (originalMsg)
         {
@@ -2232,6 +2263,12 @@ MegaChatMessage *MegaChatApiImpl::getLastMessageSeen(MegaChatHandle chatid)
         if (index != CHATD_IDX_INVALID)
         {
             const Message *msg = chat.findOrNull(index);
+            std::unique_ptr<Message> dbMsg;
+            if (!msg)   // evicted from RAM
+            {
+                dbMsg.reset(chat.fetchFromDb(index));
+                msg = dbMsg.get();
+            }
             if (msg)
             {
                 Message::Status status = chat.getMsgStatus(*msg, index);
@@ -2272,6 +2309,108 @@ bool MegaChatApiImpl::isMessageReceptionConfirmationActive() const
     return mClient->chatd->isMessageReceivedConfirmationActive();
 }
 
+void MegaChatApiImpl::setHistoryRamLimits(unsigned maxPerChat, unsigned maxTotal)
+{
+    sdkMutex.lock();
+    mChatdSettings.maxHistInRamPerChat = maxPerChat;
+    mChatdSettings.maxHistInRam = maxTotal;
+    if (mClient)
+    {
+        mClient->setChatdSettings(mChatdSettings);
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setDecryptThreads(unsigned numThreads)
+{
+    sdkMutex.lock();
+    mChatdSettings.decryptThreads = numThreads;
+    if (mClient)
+    {
+        mClient->setChatdSettings(mChatdSettings);
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setDecryptAhead(unsigned maxMessages)
+{
+    sdkMutex.lock();
+    if (maxMessages)
+    {
+        mChatdSettings.options |= chatd::Client::kOptDecryptAhead;
+        mChatdSettings.maxDecryptAhead = maxMessages;
+    }
+    else
+    {
+        mChatdSettings.options &= ~chatd::Client::kOptDecryptAhead;
+    }
+    if (mClient)
+    {
+        mClient->setChatdSettings(mChatdSettings);
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setPipelinedEncryption(bool enable)
+{
+    sdkMutex.lock();
+    if (enable)
+    {
+        mChatdSettings.options |= chatd::Client::kOptPipelinedEncrypt;
+    }
+    else
+    {
+        mChatdSettings.options &= ~chatd::Client::kOptPipelinedEncrypt;
+    }
+    if (mClient)
+    {
+        mClient->setChatdSettings(mChatdSettings);
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setSendKeyLimits(unsigned maxInRam, unsigned maxAge)
+{
+    sdkMutex.lock();
+    mChatdSettings.maxKeysInRam = maxInRam;
+    mChatdSettings.sendKeyMaxAge = maxAge;
+    if (mClient)
+    {
+        mClient->setChatdSettings(mChatdSettings);
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::trimHistoryMemory()
+{
+    size_t count = 0;
+    sdkMutex.lock();
+    if (mClient && mClient->chatd)
+    {
+        count = mClient->chatd->trimHistory(true);
+    }
+    sdkMutex.unlock();
+    API_LOG_INFO("trimHistoryMemory: %zu messages evicted from RAM", count);
+}
+
+void MegaChatApiImpl::setPerMessageStatusUpdates(bool enable)
+{
+    sdkMutex.lock();
+    if (enable)
+    {
+        mChatdSettings.options |= chatd::Client::kOptPerMessageStatusNotify;
+    }
+    else
+    {
+        mChatdSettings.options &= ~chatd::Client::kOptPerMessageStatusNotify;
+    }
+    if (mClient)
+    {
+        mClient->setChatdSettings(mChatdSettings);
+    }
+    sdkMutex.unlock();
+}
+
 MegaStringList *MegaChatApiImpl::getChatAudioInDevices()
 {
     return NULL;
@@ -3378,6 +3517,19 @@ void MegaChatRoomHandler::onRecvHistoryMessage(Idx idx, Message &msg, Message::S
     chatApi->fireOnMessageLoaded(message);
 }
 
+void MegaChatRoomHandler::onRecvHistoryMessages(const std::vector<HistoryMsg>& msgs)
+{
+    MegaChatMessageListPrivate *list = new MegaChatMessageListPrivate();
+    for (auto& item: msgs)
+    {
+        MegaChatMessagePrivate *message = new MegaChatMessagePrivate(*item.msg, item.status, item.idx);
+        handleHistoryMessage(message);
+        list->addMessage(message);
+    }
+
+    chatApi->fireOnMessagesLoaded(list);
+}
+
 void MegaChatRoomHandler::onHistoryDone(chatd::HistSource /*source*/)
 {
     chatApi->fireOnMessageLoaded(NULL);
@@ -3442,6 +3594,11 @@ void MegaChatRoomHandler::onMessageStatusChange(Idx idx, Message::Status newStat
     chatApi->fireOnMessageUpdate(message);
 }
 
+void MegaChatRoomHandler::onMessageStatusRangeChange(Idx fromIdx, Idx toIdx, Message::Status newStatus)
+{
+    chatApi->fireOnMessageStatusRangeChange(chatid, fromIdx, toIdx, newStatus);
+}
+
 void MegaChatRoomHandler::onMessageEdited(const Message &msg, chatd::Idx idx)
 {
     Message::Status status = mChat->getMsgStatus(msg, idx);
@@ -3694,7 +3851,7 @@ MegaChatRoomPrivate::MegaChatRoomPrivate(const ChatRoom &chat)
     this->priv = chat.ownPriv();
     this->group = chat.isGroup();
     this->title = chat.titleString();
-    this->unreadCount = chat.chat().unreadMsgCount();
+    this->unreadCount = chat.unreadCount();
     this->active = chat.isActive();
     this->uh = MEGACHAT_INVALID_HANDLE;
 
@@ -4114,7 +4271,7 @@ MegaChatListItemPrivate::MegaChatListItemPrivate(ChatRoom &chatroom)
 {
     this->chatid = chatroom.chatid();
     this->title = chatroom.titleString();
-    this->unreadCount = chatroom.chat().unreadMsgCount();
+    this->unreadCount = chatroom.unreadCount();
     this->group = chatroom.isGroup();
     this->active = chatroom.isActive();
     this->ownPriv = chatroom.ownPriv();
@@ -4124,7 +4281,7 @@ MegaChatListItemPrivate::MegaChatListItemPrivate(ChatRoom &chatroom)
     LastTextMsg tmp;
     LastTextMsg *message = &tmp;
     LastTextMsg *&msg = message;
-    uint8_t lastMsgStatus = chatroom.chat().lastTextMessage(msg);
+    uint8_t lastMsgStatus = chatroom.lastTextMessage(msg);
     if (lastMsgStatus == LastTextMsgState::kHave)
     {
         this->lastMsg = JSonUtils::getLastMessageContent(msg->contents(), msg->type());
@@ -4147,7 +4304,7 @@ MegaChatListItemPrivate::MegaChatListItemPrivate(ChatRoom &chatroom)
         this->mLastMsgId = MEGACHAT_INVALID_HANDLE;
     }
 
-    this->lastTs = chatroom.chat().lastMessageTs();
+    this->lastTs = chatroom.lastMessageTs();
 }
 
 MegaChatListItemPrivate::MegaChatListItemPrivate(const MegaChatListItem *item)
@@ -4728,6 +4885,59 @@ void LoggerHandler::log(krLogLevel level, const char *msg, size_t len, unsigned
     mutex.unlock();
 }
 
+MegaChatMessageListPrivate::MegaChatMessageListPrivate()
+{
+}
+
+MegaChatMessageListPrivate::~MegaChatMessageListPrivate()
+{
+    for (unsigned int i = 0; i < list.size(); i++)
+    {
+        delete list[i];
+        list[i] = NULL;
+    }
+
+    list.clear();
+}
+
+MegaChatMessageListPrivate::MegaChatMessageListPrivate(const MegaChatMessageListPrivate *list)
+{
+    MegaChatMessagePrivate *msg;
+
+    for (unsigned int i = 0; i < list->size(); i++)
+    {
+        msg = new MegaChatMessagePrivate(list->get(i));
+        this->list.push_back(msg);
+    }
+}
+
+MegaChatMessageList *MegaChatMessageListPrivate::copy() const
+{
+    return new MegaChatMessageListPrivate(this);
+}
+
+const MegaChatMessage *MegaChatMessageListPrivate::get(unsigned int i) const
+{
+    if (i >= size())
+    {
+        return NULL;
+    }
+    else
+    {
+        return list.at(i);
+    }
+}
+
+unsigned int MegaChatMessageListPrivate::size() const
+{
+    return list.size();
+}
+
+void MegaChatMessageListPrivate::addMessage(MegaChatMessage *msg)
+{
+    list.push_back(msg);
+}
+
 MegaChatListItemListPrivate::MegaChatListItemListPrivate()
 {
 }
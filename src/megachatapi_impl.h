@@ -355,12 +355,14 @@ public:
     virtual void onDestroy();
     virtual void onRecvNewMessage(chatd::Idx idx, chatd::Message& msg, chatd::Message::Status status);
     virtual void onRecvHistoryMessage(chatd::Idx idx, chatd::Message& msg, chatd::Message::Status status, bool isLocal);
+    virtual void onRecvHistoryMessages(const std::vector<chatd::HistoryMsg>& msgs);
     virtual void onHistoryDone(chatd::HistSource source);
     virtual void onUnsentMsgLoaded(chatd::Message& msg);
     virtual void onUnsentEditLoaded(chatd::Message& msg, bool oriMsgIsSending);
     virtual void onMessageConfirmed(karere::Id msgxid, const chatd::Message& msg, chatd::Idx idx);
     virtual void onMessageRejected(const chatd::Message& msg, uint8_t reason);
     virtual void onMessageStatusChange(chatd::Idx idx, chatd::Message::Status newStatus, const chatd::Message& msg);
+    virtual void onMessageStatusRangeChange(chatd::Idx fromIdx, chatd::Idx toIdx, chatd::Message::Status newStatus);
     virtual void onMessageEdited(const chatd::Message& msg, chatd::Idx idx);
     virtual void onEditRejected(const chatd::Message& msg, chatd::ManualSendReason reason);
     virtual void onOnlineStateChange(chatd::ChatState state);
@@ -555,6 +557,23 @@ private:
     std::vector<MegaChatRoom*> list;
 };
 
+class MegaChatMessageListPrivate :  public MegaChatMessageList
+{
+public:
+    MegaChatMessageListPrivate();
+    virtual ~MegaChatMessageListPrivate();
+    virtual MegaChatMessageList *copy() const;
+
+    virtual const MegaChatMessage *get(unsigned int i) const;
+    virtual unsigned int size() const;
+
+    void addMessage(MegaChatMessage*);
+
+private:
+    MegaChatMessageListPrivate(const MegaChatMessageListPrivate *list);
+    std::vector<MegaChatMessage*> list;
+};
+
 class MegaChatAttachedUser;
 
 class MegaChatMessagePrivate : public MegaChatMessage
@@ -668,6 +687,8 @@ private:
     mega::MegaApi *megaApi;
     WebsocketsIO *websocketsIO;
     karere::Client *mClient;
+    // kept here, as they can be set before init() and mClient is recreated after a logout
+    karere::Client::ChatdSettings mChatdSettings;
     bool terminating;
 
     mega::MegaThread thread;
@@ -722,7 +743,8 @@ public:
 
     karere::ChatRoom *findChatRoom(MegaChatHandle chatid);
     karere::ChatRoom *findChatRoomByUser(MegaChatHandle userhandle);
-    chatd::Message *findMessage(MegaChatHandle chatid, MegaChatHandle msgid);
+    // messages evicted from RAM are loaded from the db into dbMsg
+    chatd::Message *findMessage(MegaChatHandle chatid, MegaChatHandle msgid, std::unique_ptr<chatd::Message>& dbMsg);
     chatd::Message *findMessageNotConfirmed(MegaChatHandle chatid, MegaChatHandle msgxid);
 
     static void setCatchException(bool enable);
@@ -762,8 +784,10 @@ public:
     // MegaChatRoomListener callbacks
     void fireOnChatRoomUpdate(MegaChatRoom *chat);
     void fireOnMessageLoaded(MegaChatMessage *msg);
+    void fireOnMessagesLoaded(MegaChatMessageList *msgs);
     void fireOnMessageReceived(MegaChatMessage *msg);
     void fireOnMessageUpdate(MegaChatMessage *msg);
+    void fireOnMessageStatusRangeChange(MegaChatHandle chatid, int fromIndex, int toIndex, int status);
 
     // MegaChatListener callbacks (specific ones)
     void fireOnChatListItemUpdate(MegaChatListItem *item);
@@ -846,6 +870,13 @@ public:
     void removeUnsentMessage(MegaChatHandle chatid, MegaChatHandle rowid);
     void sendTypingNotification(MegaChatHandle chatid, MegaChatRequestListener *listener = NULL);
     bool isMessageReceptionConfirmationActive() const;
+    void setHistoryRamLimits(unsigned maxPerChat, unsigned maxTotal);
+    void setDecryptThreads(unsigned numThreads);
+    void setDecryptAhead(unsigned maxMessages);
+    void setPipelinedEncryption(bool enable);
+    void setSendKeyLimits(unsigned maxInRam, unsigned maxAge);
+    void trimHistoryMemory();
+    void setPerMessageStatusUpdates(bool enable);
 
     // Audio/Video devices
     mega::MegaStringList *getChatAudioInDevices();
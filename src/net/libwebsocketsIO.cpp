@@ -326,7 +326,7 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                     len = client->getMessageLength();
                 }
                 
-                client->wsHandleMsgCb((char *)data, len);
+                client->wsHandleFrameCb(WebsocketsFramePool::instance().acquire((char *)data, len));
                 client->resetMessage();
             }
             else
@@ -155,16 +155,16 @@ void LibwsClient::websockMsgCb(ws_t ws, char *msg, uint64_t len, int binary, voi
     LibwsClient* self = static_cast<LibwsClient*>(arg);
     assert (ws == self->mWebSocket);
 
-    string data;
-    data.assign(msg, (size_t)len);
-    
+    // the only copy of the frame - consumers reference it via the shared pointer
+    WebsocketsFrame frame = WebsocketsFramePool::instance().acquire(msg, (size_t)len);
+
     auto wptr = self->getDelTracker();
-    karere::marshallCall([self, wptr, data]()
+    karere::marshallCall([self, wptr, frame]()
     {
         if (wptr.deleted())
             return;
         
-        self->wsHandleMsgCb((char *)data.data(), data.size());
+        self->wsHandleFrameCb(frame);
     }, self->appCtx);
 }
                          
@@ -57,11 +57,52 @@ void WebsocketsClientImpl::wsCloseCb(int errcode, int errtype, const char *preas
     client->wsCloseCb(errcode, errtype, preason, reason_len);
 }
 
-void WebsocketsClientImpl::wsHandleMsgCb(char *data, size_t len)
+void WebsocketsClientImpl::wsHandleFrameCb(const WebsocketsFrame& frame)
 {
     ScopedLock lock(this->mutex);
-    WEBSOCKETS_LOG_DEBUG("Received %d bytes", len);
-    client->wsHandleMsgCb(data, len);
+    WEBSOCKETS_LOG_DEBUG("Received %d bytes", frame->dataSize());
+    client->wsHandleFrameCb(frame);
+}
+
+WebsocketsFramePool& WebsocketsFramePool::instance()
+{
+    // never destroyed, as frames may still be released during static destruction
+    static WebsocketsFramePool* pool = new WebsocketsFramePool;
+    return *pool;
+}
+
+WebsocketsFrame WebsocketsFramePool::acquire(const char *data, size_t len)
+{
+    Buffer *buf = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mFree.empty())
+        {
+            buf = mFree.back();
+            mFree.pop_back();
+        }
+    }
+    if (!buf)
+    {
+        buf = new Buffer((len > kMinFrameSize) ? len : kMinFrameSize);
+    }
+    buf->assign(data, len);
+    return WebsocketsFrame(buf, [this](Buffer *frame) { release(frame); });
+}
+
+void WebsocketsFramePool::release(Buffer *buf)
+{
+    if (buf->bufSize() <= kMaxPooledFrameSize)
+    {
+        buf->clear();
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mFree.size() < kMaxPooledFrames)
+        {
+            mFree.push_back(buf);
+            return;
+        }
+    }
+    delete buf;
 }
 
 WebsocketsClient::WebsocketsClient()
@@ -90,6 +131,11 @@ bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, cons
     return ctx != NULL;
 }
 
+void WebsocketsClient::wsHandleFrameCb(const WebsocketsFrame& frame)
+{
+    wsHandleMsgCb(frame->buf(), frame->dataSize());
+}
+
 bool WebsocketsClient::wsSendMessage(char *msg, size_t len)
 {
     assert (ctx);
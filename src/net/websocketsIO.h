@@ -2,9 +2,13 @@
 #define websocketsIO_h
 
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <mega/waiter.h>
 #include <mega/thread.h>
 #include "base/logger.h"
+#include "buffer.h"
 
 #define WEBSOCKETS_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_websockets, fmtString, ##__VA_ARGS__)
 #define WEBSOCKETS_LOG_INFO(fmtString,...) KARERE_LOG_INFO(krLogChannel_websockets, fmtString, ##__VA_ARGS__)
@@ -14,6 +18,26 @@
 class WebsocketsClient;
 class WebsocketsClientImpl;
 
+/** A received websocket frame. It is refcounted, so that the consumer can keep
+ * references to parts of it (i.e. chatd::Message) instead of copying them */
+typedef std::shared_ptr<Buffer> WebsocketsFrame;
+
+/** Recycles the buffers of received frames. Frames are filled by the network
+ * thread and released by the app thread, hence the locking */
+class WebsocketsFramePool
+{
+public:
+    enum { kMaxPooledFrames = 32, kMaxPooledFrameSize = 256 * 1024, kMinFrameSize = 4096 };
+    static WebsocketsFramePool& instance();
+    /** Returns a frame with a copy of the specified data */
+    WebsocketsFrame acquire(const char *data, size_t len);
+
+protected:
+    std::mutex mMutex;
+    std::vector<Buffer*> mFree;
+    void release(Buffer *buf);
+};
+
 // Generic websockets network layer
 class WebsocketsIO : public mega::EventTrigger
 {
@@ -54,6 +78,9 @@ public:
     virtual void wsConnectCb() = 0;
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len) = 0;
     virtual void wsHandleMsgCb(char *data, size_t len) = 0;
+    /** Called instead of wsHandleMsgCb() by the network layer. Override it to
+     * retain references into the frame, the default forwards to wsHandleMsgCb() */
+    virtual void wsHandleFrameCb(const WebsocketsFrame& frame);
 };
 
 
@@ -68,7 +95,7 @@ public:
     virtual ~WebsocketsClientImpl();
     void wsConnectCb();
     void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
-    void wsHandleMsgCb(char *data, size_t len);
+    void wsHandleFrameCb(const WebsocketsFrame& frame);
     
     virtual bool wsSendMessage(char *msg, size_t len) = 0;
     virtual void wsDisconnect(bool immediate) = 0;
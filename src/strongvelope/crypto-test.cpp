@@ -0,0 +1,128 @@
+// Randomized equivalence tests of the cached-schedule AES kernels in
+// cryptofunctions.h against the plain Crypto++ modes they replace
+
+#include "cryptofunctions.h"
+#include <cryptopp/filters.h>
+#include <random>
+#include <asyncTest-framework.h>
+
+TESTS_INIT();
+using namespace strongvelope;
+
+static std::mt19937 gRng(12345);
+
+static void randomFill(void* buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        static_cast<byte*>(buf)[i] = (byte)gRng();
+}
+
+static SendKey randomKey()
+{
+    SendKey key;
+    randomFill(key.buf(), key.dataSize());
+    return key;
+}
+
+// As for messages: 12 random bytes and a 32-bit counter. Sometimes start the
+// counter near the end of its byte or of the whole block, to test the carry
+static Key<16> randomIv()
+{
+    Key<16> iv;
+    randomFill(iv.buf(), iv.dataSize());
+    switch (gRng() % 4)
+    {
+        case 0:
+            memset(iv.buf() + 12, 0, 4);
+            break;
+        case 1:
+            iv.buf()[15] = (char)(0xff - gRng() % 8);
+            break;
+        case 2:
+            memset(iv.buf(), 0xff, 16);
+            iv.buf()[15] = (char)(0xff - gRng() % 8);
+            break;
+        default:
+            break;
+    }
+    return iv;
+}
+
+int main()
+{
+
+TestGroup("AES kernels")
+{
+    syncTest("aesCTRProcess() encrypts as aesCTREncrypt()")
+    {
+        for (int i = 0; i < 5000; i++)
+        {
+            auto key = randomKey();
+            auto iv = randomIv();
+            std::string text(gRng() % ((i % 100) ? 300 : 10000), 0);
+            randomFill(&text[0], text.size());
+            auto expected = aesCTREncrypt(text, key, iv);
+            std::string actual(text.size(), 0);
+            aesCTRProcess(*aesSchedule(key), iv, (const byte*)text.data(),
+                (byte*)&actual[0], text.size());
+            check(actual == expected);
+        }
+    });
+    syncTest("aesCTRProcess() decrypts as aesCTRDecrypt(), in place")
+    {
+        for (int i = 0; i < 5000; i++)
+        {
+            auto key = randomKey();
+            auto iv = randomIv();
+            std::string cipher(1 + gRng() % 300, 0);
+            randomFill(&cipher[0], cipher.size());
+            auto expected = aesCTRDecrypt(cipher, key, iv);
+            aesCTRProcess(*aesSchedule(key), iv, (const byte*)cipher.data(),
+                (byte*)&cipher[0], cipher.size());
+            check(cipher == expected);
+        }
+    });
+    syncTest("aesECBEncrypt() and aesECBEncryptBatch() match ECB_Mode")
+    {
+        std::vector<SendKey> keys;
+        for (int i = 0; i < 500; i++)
+            keys.push_back(randomKey());
+        auto text = randomKey();
+        std::vector<const SendKey*> keyPtrs;
+        for (auto& key: keys)
+            keyPtrs.push_back(&key);
+        std::vector<byte> batch(keys.size() * CryptoPP::AES::BLOCKSIZE);
+        aesECBEncryptBatch(text, keyPtrs.data(), keyPtrs.size(), batch.data());
+
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            SendKey expected;
+            CryptoPP::ECB_Mode<CryptoPP::AES>::Encryption ecb(keys[i].ubuf(), keys[i].dataSize());
+            ecb.ProcessData(expected.ubuf(), text.ubuf(), text.dataSize());
+            SendKey actual;
+            aesECBEncrypt(text, keys[i], actual);
+            check(memcmp(actual.buf(), expected.buf(), CryptoPP::AES::BLOCKSIZE) == 0);
+            check(memcmp(batch.data() + i * CryptoPP::AES::BLOCKSIZE, expected.buf(), CryptoPP::AES::BLOCKSIZE) == 0);
+        }
+    });
+    syncTest("Cached schedule follows changes of the key data")
+    {
+        auto key = randomKey();
+        auto text = randomKey();
+        SendKey first;
+        aesECBEncrypt(text, key, first);
+        auto copy = key; //shares the schedule
+        randomFill(key.buf(), key.dataSize());
+        SendKey second, expected;
+        aesECBEncrypt(text, key, second);
+        CryptoPP::ECB_Mode<CryptoPP::AES>::Encryption ecb(key.ubuf(), key.dataSize());
+        ecb.ProcessData(expected.ubuf(), text.ubuf(), text.dataSize());
+        check(memcmp(second.buf(), expected.buf(), CryptoPP::AES::BLOCKSIZE) == 0);
+        SendKey fromCopy;
+        aesECBEncrypt(text, copy, fromCopy);
+        check(memcmp(fromCopy.buf(), first.buf(), CryptoPP::AES::BLOCKSIZE) == 0);
+    });
+});
+
+return test::gNumFailed;
+}
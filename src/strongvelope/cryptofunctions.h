@@ -12,6 +12,9 @@
 #include <cryptopp/osrng.h>
 #include <iostream>
 #include <ctime>
+#include <memory>
+#include <algorithm>
+#include "keys.h"
 
 namespace strongvelope
 {
@@ -49,14 +52,52 @@ static inline void hmac_sha256_bytes(const StaticBuffer& plain,
     hmac.CalculateDigest(output.ubuf(), plain.ubuf(), plain.dataSize());
 }
 
+/** The expanded encryption key schedule of a SendKey. Crypto++ detects at
+ * runtime if the CPU has AES-NI, and uses it for all block operations */
+class AesSchedule
+{
+public:
+    byte key[CryptoPP::AES::BLOCKSIZE]; //the key the schedule was expanded from
+    CryptoPP::AES::Encryption enc;
+    AesSchedule(const byte* aKey): enc(aKey, CryptoPP::AES::BLOCKSIZE)
+    {
+        memcpy(key, aKey, CryptoPP::AES::BLOCKSIZE);
+    }
+};
+
+/** Returns the key schedule cached in \c key, creating it on first use. The
+ * schedule is re-created if the key data has changed since */
+static inline std::shared_ptr<AesSchedule> aesSchedule(const SendKey& key)
+{
+    assert(key.dataSize() == CryptoPP::AES::BLOCKSIZE);
+    auto schedule = std::atomic_load(&key.mSchedule);
+    if (!schedule || memcmp(schedule->key, key.ubuf(), CryptoPP::AES::BLOCKSIZE))
+    {
+        schedule = std::make_shared<AesSchedule>(key.ubuf());
+        std::atomic_store(&key.mSchedule, schedule);
+    }
+    return schedule;
+}
+
 static inline void aesECBEncrypt(const SendKey& text, const SendKey& key,
     StaticBuffer& output)
 {    
-    assert(key.dataSize() == CryptoPP::AES::BLOCKSIZE);
     assert(text.dataSize() == CryptoPP::AES::BLOCKSIZE);
     assert(output.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    CryptoPP::ECB_Mode<CryptoPP::AES>::Encryption aesencryption(key.ubuf(), key.dataSize());
-    aesencryption.ProcessData(output.ubuf(), text.ubuf(), text.dataSize());
+    aesSchedule(key)->enc.ProcessBlock(text.ubuf(), output.ubuf());
+}
+
+/** Encrypts the single block \c text with each of the \c count \c keys, writing
+ * the results to consecutive blocks of \c output. Equivalent to calling
+ * aesECBEncrypt() for each key, using their cached key schedules */
+static inline void aesECBEncryptBatch(const SendKey& text, const SendKey* const* keys,
+    size_t count, byte* output)
+{
+    assert(text.dataSize() == CryptoPP::AES::BLOCKSIZE);
+    for (size_t i = 0; i < count; i++)
+    {
+        aesSchedule(*keys[i])->enc.ProcessBlock(text.ubuf(), output + i * CryptoPP::AES::BLOCKSIZE);
+    }
 }
 
 static inline void aesECBDecrypt(const StaticBuffer& cipherText,
@@ -84,6 +125,49 @@ static inline void aesCBCDecrypt(const StaticBuffer& cipherText,
 
 //CTR mode is used for message content
 
+/** AES-128-CTR encryption/decryption of \c len bytes with a cached key schedule,
+ * producing the same output as CryptoPP::CTR_Mode, i.e. the whole 16-byte
+ * counter block is incremented as a big-endian number. Full blocks are processed
+ * in one call per run of 256 counters, which lets Crypto++ pipeline several
+ * blocks in the AES-NI units. \c output may be the same as \c input */
+static inline void aesCTRProcess(const AesSchedule& schedule, const StaticBuffer& iv,
+    const byte* input, byte* output, size_t len)
+{
+    enum { kBlockSize = CryptoPP::AES::BLOCKSIZE };
+    assert(iv.dataSize() == kBlockSize);
+    byte counter[kBlockSize];
+    memcpy(counter, iv.ubuf(), kBlockSize);
+    size_t blocks = len / kBlockSize;
+    while (blocks)
+    {
+        // the transform increments only the last byte, so don't let it wrap
+        byte lsb = counter[kBlockSize-1];
+        size_t count = std::min(blocks, (size_t)(256 - lsb));
+        schedule.enc.AdvancedProcessBlocks(counter, input, output, count * kBlockSize,
+            CryptoPP::BlockTransformation::BT_InBlockIsCounter |
+            CryptoPP::BlockTransformation::BT_AllowParallel);
+        counter[kBlockSize-1] = (byte)(lsb + count);
+        if (counter[kBlockSize-1] == 0) //carry
+        {
+            for (int i = kBlockSize-2; (i >= 0) && (++counter[i] == 0); i--);
+        }
+        input += count * kBlockSize;
+        output += count * kBlockSize;
+        blocks -= count;
+    }
+    size_t tail = len % kBlockSize;
+    if (tail)
+    {
+        byte keystream[kBlockSize];
+        schedule.enc.ProcessBlock(counter, keystream);
+        for (size_t i = 0; i < tail; i++)
+            output[i] = input[i] ^ keystream[i];
+    }
+}
+
+// aesCTREncrypt() and aesCTRDecrypt() are the reference for aesCTRProcess(),
+// see crypto-test.cpp
+
 //can't use binary buffers here, libsodium doesn't support them for CTR mode
 static inline std::string aesCTREncrypt(const std::string& text,
                         const StaticBuffer& derivedkey, const StaticBuffer& iv)
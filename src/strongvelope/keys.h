@@ -0,0 +1,78 @@
+/*
+ * keys.h
+ *
+ * Fixed-size key buffers used by strongvelope and its crypto primitives in
+ * cryptofunctions.h. Kept free of karere/SDK dependencies, so the primitives
+ * can be built and tested on their own
+ */
+
+#ifndef STRONGVELOPE_KEYS_H_
+#define STRONGVELOPE_KEYS_H_
+
+#include <memory>
+#include <atomic>
+#include <stdexcept>
+#include <assert.h>
+#include <buffer.h>
+
+namespace strongvelope
+{
+template <size_t Size>
+class Key: public StaticBuffer
+{
+protected:
+    char mData[Size];
+public:
+    static size_t bufSize() { return Size; }
+    void setDataSize(size_t size)
+    {
+        if (size > Size)
+            throw std::runtime_error("Can't resize static buffer beyond its data block size");
+        mDataSize = size;
+    }
+    void assign(const char* src, size_t len)
+    {
+        if (len > Size)
+            throw std::runtime_error("Key::assign: source buffer is larger than our size");
+        memcpy(mData, src, len);
+        mDataSize = len;
+    }
+//    Key(const char* src, size_t len): StaticBuffer(mData, 0) { assign(src, len); }
+    Key(size_t len=Size)
+    {
+        //actual data is not initialized, but we need to tell StaticBuffer what is our
+        //max size
+        assert(len <= Size);
+        mBuf = mData;
+        mDataSize = len;
+    }
+    Key(const StaticBuffer& other)
+    {
+        mBuf = mData;
+        assign(other.buf(), other.dataSize());
+    }
+    Key(const char* data, size_t len)
+    {
+        assert(len == Size);
+        mBuf = mData;
+        assign(data, len);
+    }
+};
+class AesSchedule;
+/** A symmetric AES-128 key. The expanded key schedule is cached with the key on
+ * first use (see aesSchedule() in cryptofunctions.h), as the same key is used
+ * for many messages, and key schedules are costly to compute */
+class SendKey: public Key<16>
+{
+public:
+    using Key<16>::Key;
+    SendKey(const SendKey& other)
+    : Key<16>(static_cast<const StaticBuffer&>(other)),
+      mSchedule(std::atomic_load(&other.mSchedule)){}
+    /** Accessed only via std::atomic_load/atomic_store, as keys are used from
+     * decrypt worker threads as well */
+    mutable std::shared_ptr<AesSchedule> mSchedule;
+};
+typedef Key<32> EcKey;
+}
+#endif
@@ -25,6 +25,7 @@
 #include <ctime>
 #include "sodium.h"
 #include "tlvstore.h"
+#include "verifiedMsgCache.h"
 #include <userAttrCache.h>
 #include <mega.h>
 #include <db.h>
@@ -72,7 +73,7 @@ uint32_t getKeyIdLength(uint32_t protocolVersion)
     return (protocolVersion == 1) ? 8 : 4;
 }
 
-EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
+EncryptedMessage::EncryptedMessage(const Message& msg, const SendKey& aKey)
 : key(aKey), backRefId(msg.backRefId)
 {
     assert(!key.empty());
@@ -97,8 +98,9 @@ EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
     {
         buf.append(msg);
     }
-    ciphertext = aesCTREncrypt(std::string(buf.buf(), buf.dataSize()),
-        key, derivedNonce);
+    ciphertext.resize(buf.dataSize());
+    aesCTRProcess(*aesSchedule(aKey), derivedNonce, buf.ubuf(),
+        (byte*)&ciphertext[0], buf.dataSize());
 }
 
 /**
@@ -107,7 +109,7 @@ EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
  * @param key Symmetric encryption key.
  * @param outMsg The message object to write the decrypted data to.
  */
-void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
+void ParsedMessage::symmetricDecrypt(const SendKey& key, Message& outMsg)
 {
     if (payload.empty())
     {
@@ -123,9 +125,23 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     // For AES CRT mode, we take the first 12 bytes as the nonce,
     // and the remaining 4 bytes as the counter, which is initialized to zero
     *reinterpret_cast<uint32_t*>(derivedNonce.buf()+SVCRYPTO_NONCE_SIZE) = 0;
-    std::string cleartext = aesCTRDecrypt(std::string(payload.buf(), payload.dataSize()),
-        key, derivedNonce);
-    parsePayload(StaticBuffer(cleartext, false), outMsg);
+    // If the payload is a slice of outMsg, decrypt it in place, otherwise write
+    // the plaintext directly into outMsg. parsePayload() then moves the message
+    // text to the start of the buffer
+    size_t len = payload.dataSize();
+    char* cleartext;
+    if (!outMsg.isBorrowed() && (payload.buf() >= outMsg.buf())
+     && (payload.buf()+len <= outMsg.buf()+outMsg.bufSize()))
+    {
+        cleartext = payload.buf();
+    }
+    else
+    {
+        cleartext = outMsg.writableBlock(len);
+    }
+    aesCTRProcess(*aesSchedule(key), derivedNonce, payload.ubuf(), (byte*)cleartext, len);
+    payload.clear(); //if decrypted in place, it's not ciphertext anymore
+    parsePayload(StaticBuffer(cleartext, len), outMsg);
     outMsg.setEncrypted(0);
 }
 
@@ -183,31 +199,40 @@ void ProtocolHandler::signMessage(const StaticBuffer& signedData,
 bool ParsedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey)
 {
     assert(pubKey.dataSize() == 32);
-    if (protocolVersion < 2)
-    {
-        //legacy
-        Buffer messageStr(SVCRYPTO_SIG.size()+signedContent.dataSize());
-        messageStr.append(SVCRYPTO_SIG.c_str(), SVCRYPTO_SIG.size())
-        .append(signedContent);
-        return (crypto_sign_verify_detached(signature.ubuf(), messageStr.ubuf(),
-                messageStr.dataSize(), pubKey.ubuf()) == 0);
-    }
+    if (signature.dataSize() != crypto_sign_BYTES)
+        return false;
 
-    assert(sendKey.dataSize() == 16);
-    Buffer messageStr(SVCRYPTO_SIG.size()+sendKey.dataSize()+signedContent.dataSize()+2);
+    // The signed data is a prefix followed by signedContent, which is a slice of
+    // the message. They are concatenated in a stack buffer if it fits, which
+    // is the case for the vast majority of messages
+    unsigned char prefix[64];
+    size_t prefixLen = SVCRYPTO_SIG.size();
+    memcpy(prefix, SVCRYPTO_SIG.c_str(), prefixLen);
+    if (protocolVersion >= 2)
+    {
+        assert(sendKey.dataSize() == 16);
+        prefix[prefixLen++] = protocolVersion;
+        prefix[prefixLen++] = type;
+        memcpy(prefix+prefixLen, sendKey.buf(), sendKey.dataSize());
+        prefixLen += sendKey.dataSize();
+    }
+    assert(prefixLen <= sizeof(prefix));
 
-    messageStr.append(SVCRYPTO_SIG.c_str(), SVCRYPTO_SIG.size())
-    .append<uint8_t>(protocolVersion)
-    .append<uint8_t>(type)
-    .append(sendKey)
-    .append(signedContent);
+    size_t len = prefixLen+signedContent.dataSize();
+    unsigned char stackBuf[4096];
+    std::unique_ptr<unsigned char[]> heapBuf;
+    unsigned char* messageStr = stackBuf;
+    if (len > sizeof(stackBuf))
+    {
+        heapBuf.reset(new unsigned char[len]);
+        messageStr = heapBuf.get();
+    }
+    memcpy(messageStr, prefix, prefixLen);
+    memcpy(messageStr+prefixLen, signedContent.buf(), signedContent.dataSize());
 
-//    STRONGVELOPE_LOG_DEBUG("signature:\n%s", signature.toString().c_str());
-//    STRONGVELOPE_LOG_DEBUG("message:\n%s", messageStr.toString().c_str());
-//    STRONGVELOPE_LOG_DEBUG("pubKey:\n%s", pubKey.toString().c_str());
     // if crypto_sign_verify_detached does not return 0, it means Incorrect signature!
-    return (crypto_sign_verify_detached(signature.ubuf(), messageStr.ubuf(),
-            messageStr.dataSize(), pubKey.ubuf()) == 0);
+    return (crypto_sign_verify_detached(signature.ubuf(), messageStr,
+            len, pubKey.ubuf()) == 0);
 }
 
 /**
@@ -236,7 +261,7 @@ void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output)
 }
 
 ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& protoHandler)
-: mProtoHandler(protoHandler)
+: mProtoHandler(protoHandler), mSource(binaryMessage.buf(), binaryMessage.dataSize())
 {
     if(binaryMessage.empty())
     {
@@ -260,15 +285,17 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
     }
     TlvParser tlv(binaryMessage, offset, isLegacy);
     TlvRecord record(binaryMessage);
+    bool logRecords = (krLogLevelDebug <= krLoggerChannels[krLogChannel_strongvelope].logLevel);
     std::string recordNames;
     while (tlv.getRecord(record))
     {
-        recordNames.append(tlvTypeToString(record.type))+=", ";
+        if (logRecords)
+            recordNames.append(tlvTypeToString(record.type))+=", ";
         switch (record.type)
         {
             case TLV_TYPE_SIGNATURE:
             {
-                signature.assign(record.buf(), record.dataLen);
+                signature = record.view();
                 auto nextOffset = record.dataOffset+record.dataLen;
                 signedContent.assign(binaryMessage.buf()+nextOffset, binaryMessage.dataSize()-nextOffset);
                 break;
@@ -312,7 +339,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             }
             case TLV_TYPE_KEYBLOB:
             {
-                encryptedKey.assign(record.buf(), record.dataLen);
+                encryptedKey = record.view();
                 break;
             }
             //legacy key stuff
@@ -327,7 +354,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             case TLV_TYPE_KEYS:
             {
 //KEYS, not KEY, because these can be pairs of current+previous key, concatenated and encrypted together
-                encryptedKey.assign(record.buf(), record.dataLen);
+                encryptedKey = record.view();
                 break;
             }
             case TLV_TYPE_KEY_IDS:
@@ -362,7 +389,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             {
 //                if (type != SVCRYPTO_MSGTYPE_KEYED && type != SVCRYPTO_MSGTYPE_FOLLOWUP)
 //                    throw std::runtime_error("Payload record found in a non-regular message");
-                payload.assign(binaryMessage.buf()+record.dataOffset, record.dataLen);
+                payload = record.view();
                 break;
             }
             default:
@@ -378,6 +405,19 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
     }
 }
 
+void ParsedMessage::detach()
+{
+    if (mOwnData.buf())
+        return;
+    mOwnData.assign(mSource.buf(), mSource.dataSize());
+    for (StaticBuffer* slice: {&payload, &signedContent, &signature, &encryptedKey})
+    {
+        if (slice->buf())
+            slice->assign(mOwnData.buf()+(slice->buf()-mSource.buf()), slice->dataSize());
+    }
+    mSource.assign(mOwnData.buf(), mOwnData.dataSize());
+}
+
 void ParsedMessage::parsePayloadWithUtfBackrefs(const StaticBuffer &data, Message &msg)
 {
     Id chatid = mProtoHandler.chatid;
@@ -450,13 +490,14 @@ ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
     const StaticBuffer& privCu25519,
     const StaticBuffer& privEd25519,
     const StaticBuffer& privRsa,
-    karere::UserAttrCache& userAttrCache, SqliteDb &db, Id aChatId, void *ctx)
+    karere::UserAttrCache& userAttrCache, SharedKeyCache& sharedKeyCache,
+    VerifiedMsgCache* verifiedMsgCache, SqliteDb &db, Id aChatId, void *ctx)
 : chatd::ICrypto(ctx), mOwnHandle(ownHandle), myPrivCu25519(privCu25519),
  myPrivEd25519(privEd25519), myPrivRsaKey(privRsa),
- mUserAttrCache(userAttrCache), mDb(db), chatid(aChatId)
+ mUserAttrCache(userAttrCache), mSharedKeyCache(sharedKeyCache),
+ mVerifiedMsgCache(verifiedMsgCache), mDb(db), chatid(aChatId)
 {
     getPubKeyFromPrivKey(myPrivEd25519, kKeyTypeEd25519, myPubEd25519);
-    loadKeysFromDb();
     auto var = getenv("KRCHAT_FORCE_RSA");
     if (var)
     {
@@ -465,28 +506,76 @@ ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
     }
 }
 
-void ProtocolHandler::loadKeysFromDb()
+ProtocolHandler::KeyEntry* ProtocolHandler::findKey(UserKeyId ukid)
 {
-//    int oldest = time(NULL)-CHATD_MAX_EDIT_AGE-600;
-    SqliteStmt stmt(mDb, "select userid, keyid, key from sendkeys where chatid=?");
-    stmt << chatid;
-    while(stmt.step())
-    {
-        auto key = std::make_shared<SendKey>();
-        stmt.blobCol(2, *key);
-#ifndef NDEBUG
-        auto ret =
-#endif
-        mKeys.emplace(std::piecewise_construct,
-            std::forward_as_tuple(stmt.uint64Col(0), stmt.uint64Col(1)),
-            std::forward_as_tuple(key));
-        assert(ret.second);
+    auto it = mKeys.find(ukid);
+    if (it != mKeys.end())
+    {
+        auto& entry = it->second;
+        if (entry.key)
+        {
+            mKeyLru.splice(mKeyLru.begin(), mKeyLru, entry.lruIt);
+        }
+        return &entry;
+    }
+    SqliteStmt stmt(mDb, "select key from sendkeys where chatid=? and userid=? and keyid=?");
+    stmt << chatid << ukid.user << ukid.key;
+    if (!stmt.step())
+        return nullptr;
+
+    auto key = std::make_shared<SendKey>();
+    stmt.blobCol(0, *key);
+    auto& entry = mKeys[ukid];
+    setEntryKey(ukid, entry, key);
+    return &entry;
+}
+
+void ProtocolHandler::setEntryKey(UserKeyId ukid, KeyEntry& entry, const std::shared_ptr<SendKey>& key)
+{
+    assert(!entry.key);
+    entry.key = key;
+    mKeyLru.push_front(ukid);
+    entry.lruIt = mKeyLru.begin();
+    evictKeys();
+}
+
+// Never drops the most recently used key, which the caller may be using
+void ProtocolHandler::evictKeys()
+{
+    while ((mKeyLru.size() > mMaxKeysInRam) && (mKeyLru.size() > 1))
+    {
+        auto it = mKeys.find(mKeyLru.back());
+        assert(it != mKeys.end());
+        mKeyLru.pop_back();
+        if (it->second.pms) //someone is waiting for it (legacy)
+        {
+            it->second.key.reset();
+        }
+        else
+        {
+            mKeys.erase(it);
+        }
     }
-    STRONGVELOPE_LOG_DEBUG("(%" PRId64 "): Loaded %zu send keys from database", chatid, mKeys.size());
+}
+
+void ProtocolHandler::setMaxKeysInRam(size_t maxKeys)
+{
+    mMaxKeysInRam = maxKeys;
+    evictKeys();
+}
+
+void ProtocolHandler::pruneKeys(uint32_t maxAge)
+{
+    uint32_t now = time(NULL);
+    if (now < maxAge)
+        return;
+    mDb.query("delete from sendkeys where chatid=? and ts<? and not (userid=? and keyid=?)",
+        chatid, (int)(now - maxAge), mOwnHandle, (uint64_t)mCurrentKeyId);
+    STRONGVELOPE_LOG_DEBUG("Pruned send keys older than %u seconds from db", maxAge);
 }
 
 void ProtocolHandler::msgEncryptWithKey(Message& src, chatd::MsgCommand& dest,
-    const StaticBuffer& key)
+    const SendKey& key)
 {
     EncryptedMessage encryptedMessage(src, key);
     assert(!encryptedMessage.ciphertext.empty());
@@ -511,22 +600,16 @@ void ProtocolHandler::msgEncryptWithKey(Message& src, chatd::MsgCommand& dest,
 promise::Promise<std::shared_ptr<SendKey>>
 ProtocolHandler::computeSymmetricKey(karere::Id userid)
 {
-    auto it = mSymmKeyCache.find(userid);
-    if (it != mSymmKeyCache.end())
+    auto key = mSharedKeyCache.get(userid);
+    if (key)
     {
-        return it->second;
+        return key;
     }
     auto wptr = weakHandle();
     return mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY)
     .then([wptr, this, userid](const StaticBuffer* pubKey) -> promise::Promise<std::shared_ptr<SendKey>>
     {
         wptr.throwIfDeleted();
-        // We may have had 2 almost parallel requests, and the second may
-        // have put the key into the cache already
-        auto it = mSymmKeyCache.find(userid);
-        if (it != mSymmKeyCache.end())
-            return it->second;
-
         if (pubKey->empty())
             return promise::Error("Empty Cu25519 chat key for user "+userid.toString());
         Key<crypto_scalarmult_BYTES> sharedSecret;
@@ -535,11 +618,91 @@ ProtocolHandler::computeSymmetricKey(karere::Id userid)
         (void)ignore;
         auto result = std::make_shared<SendKey>();
         deriveSharedKey(sharedSecret, *result);
-        mSymmKeyCache.emplace(userid, result);
+        mSharedKeyCache.put(userid, *pubKey, result);
         return result;
     });
 }
 
+struct SharedKeyCache::PeerEntry
+{
+    SharedKeyCache& cache;
+    karere::Id userid;
+    Buffer pubKey; //the peer key that \c key was derived from
+    std::shared_ptr<SendKey> key;
+    karere::UserAttrCache::Handle cbHandle;
+    PeerEntry(SharedKeyCache& aCache, karere::Id aUserid)
+    : cache(aCache), userid(aUserid){}
+};
+
+SharedKeyCache::SharedKeyCache(karere::UserAttrCache& userAttrCache)
+: mUserAttrCache(userAttrCache), mHits(0), mMisses(0)
+{}
+
+SharedKeyCache::~SharedKeyCache()
+{
+    for (auto& item: mEntries)
+    {
+        mUserAttrCache.removeCb(item.second->cbHandle);
+    }
+}
+
+std::shared_ptr<SendKey> SharedKeyCache::get(karere::Id userid)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mEntries.find(userid);
+    if (it == mEntries.end() || !it->second->key)
+    {
+        mMisses++;
+        return nullptr;
+    }
+    mHits++;
+    return it->second->key;
+}
+
+void SharedKeyCache::put(karere::Id userid, const StaticBuffer& pubKey,
+    const std::shared_ptr<SendKey>& key)
+{
+    PeerEntry* entry;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto& ptr = mEntries[userid];
+        if (ptr)
+        {
+            ptr->pubKey.assign(pubKey.buf(), pubKey.dataSize());
+            ptr->key = key;
+            return;
+        }
+        ptr.reset(new PeerEntry(*this, userid));
+        ptr->pubKey.assign(pubKey.buf(), pubKey.dataSize());
+        ptr->key = key;
+        entry = ptr.get();
+    }
+    // Entries are never removed, so the pointer stays valid. The callback is
+    // called immediately with the current (same) key, which is a no-op
+    entry->cbHandle = mUserAttrCache.getAttr(userid,
+        ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY, entry, &SharedKeyCache::onPubKeyChange);
+}
+
+void SharedKeyCache::onPubKeyChange(Buffer* pubKey, void* userp)
+{
+    auto entry = static_cast<PeerEntry*>(userp);
+    std::lock_guard<std::mutex> lock(entry->cache.mMutex);
+    if (pubKey && !entry->pubKey.empty() && (pubKey->dataSize() == entry->pubKey.dataSize())
+     && (memcmp(pubKey->buf(), entry->pubKey.buf(), pubKey->dataSize()) == 0))
+        return;
+
+    KARERE_LOG_DEBUG(krLogChannel_strongvelope, "Cu25519 key of user %s changed, invalidating the keys shared with it",
+        entry->userid.toString().c_str());
+    entry->key.reset();
+    entry->pubKey.clear();
+}
+
+size_t SharedKeyCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mEntries.size();
+}
+
 Promise<std::shared_ptr<Buffer>>
 ProtocolHandler::encryptKeyTo(const std::shared_ptr<SendKey>& sendKey, karere::Id toUser)
 {
@@ -731,6 +894,16 @@ ProtocolHandler::msgEncrypt(Message* msg, MsgCommand* msgCmd)
     }
 }
 
+// Must match the sync paths of msgEncrypt()
+bool ProtocolHandler::canEncryptImmediately(const Message& msg) const
+{
+    if ((msg.keyid == CHATD_KEYID_INVALID) || (msg.keyid == CHATD_KEYID_UNCONFIRMED))
+        return mCurrentKey && !mParticipantsChanged;
+
+    auto it = mKeys.find(UserKeyId(mOwnHandle, msg.keyid));
+    return (it != mKeys.end()) && it->second.key;
+}
+
 Message* ProtocolHandler::legacyMsgDecrypt(const std::shared_ptr<ParsedMessage>& parsedMsg,
     Message* msg, const SendKey& key)
 {
@@ -768,6 +941,7 @@ ProtocolHandler::decryptChatTitle(const Buffer& data)
 promise::Promise<Message*> ProtocolHandler::handleManagementMessage(
         const std::shared_ptr<ParsedMessage>& parsedMsg, Message* msg)
 {
+    parsedMsg->detach(); //we clear msg, and the slices reference its data
     msg->userid = parsedMsg->sender;
     msg->clear();
 
@@ -848,10 +1022,26 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
         });
 
         auto wptr = weakHandle();
-        return promise::when(symPms, edPms)
-        .then([this, wptr, message, parsedMsg, ctx, isLegacy, keyid]() ->promise::Promise<Message*>
+        auto pms = promise::when(symPms, edPms);
+        if (!pms.done()) //the message may change until the keys arrive
+            parsedMsg->detach();
+        return pms.then([this, wptr, message, parsedMsg, ctx, isLegacy, keyid]() ->promise::Promise<Message*>
         {
             wptr.throwIfDeleted();
+            // If we have already authenticated this exact content, i.e. the
+            // history was lost and is being fetched again, skip verify and decrypt.
+            // Messages received as new can't have been authenticated before
+            VerifiedMsgCache::Hash hash;
+            bool useCache = mVerifiedMsgCache && !isLegacy;
+            if (useCache)
+            {
+                VerifiedMsgCache::hash(parsedMsg->source(), *ctx->sendKey, hash);
+                if (!message->receivedAsNew()
+                    && mVerifiedMsgCache->get(chatid, parsedMsg->sender, hash, ctx->edKey, *message))
+                {
+                    return message;
+                }
+            }
             if (!parsedMsg->verifySignature(ctx->edKey, *ctx->sendKey))
             {
                 return promise::Error("Signature invalid for message "+
@@ -865,6 +1055,8 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
 
             // Decrypt message payload.
             parsedMsg->symmetricDecrypt(*ctx->sendKey, *message);
+            if (useCache)
+                mVerifiedMsgCache->put(chatid, parsedMsg->sender, hash, ctx->edKey, *message);
             return message;
         });
     }
@@ -874,25 +1066,121 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
     }
 }
 
+/** Verifies the signature and decrypts the payload of a message on a worker
+ * thread. The message is parsed on the app thread, when the job is created.
+ * If a history message is in the verified message cache, the job has nothing to do */
+class MsgDecryptJob: public chatd::ICrypto::DecryptJob
+{
+protected:
+    Message* mMsg;
+    std::shared_ptr<ParsedMessage> mParsedMsg;
+    std::shared_ptr<SendKey> mSendKey;
+    EcKey mEdKey;
+    Message mOutput;
+    bool mSigOk = false;
+    std::string mError;
+    VerifiedMsgCache* mCache;
+    VerifiedMsgCache::Hash mHash;
+    bool mCached = false;
+    Id mChatid;
+public:
+    MsgDecryptJob(Message* msg, const std::shared_ptr<ParsedMessage>& parsedMsg,
+        const std::shared_ptr<SendKey>& sendKey, const Buffer& edKey,
+        VerifiedMsgCache* cache, Id chatid)
+    : mMsg(msg), mParsedMsg(parsedMsg), mSendKey(sendKey), mEdKey(edKey.buf(), edKey.dataSize()),
+      mOutput(msg->id(), msg->userid, msg->ts, msg->updated, Buffer(), false, msg->keyid),
+      mCache(cache), mChatid(chatid)
+    {
+        if (mCache)
+        {
+            VerifiedMsgCache::hash(mParsedMsg->source(), *mSendKey, mHash);
+            if (!msg->receivedAsNew())
+                mCached = mSigOk = mCache->get(mChatid, mParsedMsg->sender, mHash, mEdKey, mOutput);
+        }
+        if (!mCached)
+            mParsedMsg->detach(); //run() must not access msg
+    }
+    virtual void run()
+    {
+        if (mCached)
+            return;
+        try
+        {
+            mSigOk = mParsedMsg->verifySignature(mEdKey, *mSendKey);
+            if (mSigOk)
+                mParsedMsg->symmetricDecrypt(*mSendKey, mOutput);
+        }
+        catch(std::exception& e)
+        {
+            mError = e.what();
+        }
+    }
+    virtual Promise<Message*> finish()
+    {
+        if (!mError.empty())
+            return promise::Error(mError);
+        if (!mSigOk)
+            return promise::Error("Signature invalid for message "+
+                mMsg->id().toString(), EINVAL, SVCRYPTO_ERRTYPE);
+
+        mMsg->takeFrom(std::move(mOutput));
+        mMsg->backRefId = mOutput.backRefId;
+        mMsg->backRefs.swap(mOutput.backRefs);
+        mMsg->setEncrypted(0);
+        if (mCache && !mCached)
+            mCache->put(mChatid, mParsedMsg->sender, mHash, mEdKey, *mMsg);
+        return mMsg;
+    }
+};
+
+// Only for messages that msgDecrypt() would decrypt without any async operation
+chatd::ICrypto::DecryptJob* ProtocolHandler::msgDecryptJob(Message* message)
+{
+    if (message->empty() || (message->userid == API_USER))
+        return nullptr;
+    try
+    {
+        auto parsedMsg = std::make_shared<ParsedMessage>(*message, *this);
+        if (parsedMsg->protocolVersion <= 1) //legacy keys are extracted asynchronously
+            return nullptr;
+
+        auto entry = findKey(UserKeyId(message->userid, message->keyid));
+        if (!entry || !entry->key)
+            return nullptr;
+
+        auto edPms = mUserAttrCache.getAttr(parsedMsg->sender,
+            ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY);
+        if (!edPms.succeeded() || !edPms.value())
+            return nullptr;
+
+        message->type = parsedMsg->type;
+        return new MsgDecryptJob(message, parsedMsg, entry->key, *edPms.value(),
+            mVerifiedMsgCache, chatid);
+    }
+    catch(std::exception&)
+    {
+        return nullptr; //msgDecrypt() will report the error
+    }
+}
+
 Promise<void>
 ProtocolHandler::legacyExtractKeys(const std::shared_ptr<ParsedMessage>& parsedMsg)
 {
     if (parsedMsg->encryptedKey.empty())
         return promise::Error("legacyExtractKeys: No encrypted keys found in parsed message", EPROTO, SVCRYPTO_ERRTYPE);
+    parsedMsg->detach(); //keys are decrypted asynchronously
 
-    auto& key1 = mKeys[UserKeyId(parsedMsg->sender, parsedMsg->keyId)];
-    if (!key1.key)
+    UserKeyId ukid1(parsedMsg->sender, parsedMsg->keyId);
+    if (!findKey(ukid1))
     {
-        if (!key1.pms)
-            key1.pms.reset(new Promise<std::shared_ptr<SendKey>>);
+        mKeys[ukid1].pms.reset(new Promise<std::shared_ptr<SendKey>>);
     }
     if (parsedMsg->prevKeyId)
     {
-        auto& key2 = mKeys[UserKeyId(parsedMsg->sender, parsedMsg->prevKeyId)];
-        if (!key2.key)
+        UserKeyId ukid2(parsedMsg->sender, parsedMsg->prevKeyId);
+        if (!findKey(ukid2))
         {
-            if (!key2.pms)
-                key2.pms.reset(new Promise<std::shared_ptr<SendKey>>);
+            mKeys[ukid2].pms.reset(new Promise<std::shared_ptr<SendKey>>);
         }
     }
     auto wptr = weakHandle();
@@ -955,7 +1243,8 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
 {
     assert(key->dataSize() == SVCRYPTO_KEY_SIZE);
     STRONGVELOPE_LOG_DEBUG("Adding key %lld of user %s", ukid.key, ukid.user.toString().c_str());
-    auto& entry = mKeys[ukid];
+    auto found = findKey(ukid);
+    auto& entry = found ? *found : mKeys[ukid];
     if (entry.key)
     {
         if (memcmp(entry.key->buf(), key->buf(), SVCRYPTO_KEY_SIZE))
@@ -965,7 +1254,7 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
     }
     else
     {
-        entry.key = key;
+        setEntryKey(ukid, entry, key);
         try
         {
             mDb.query("insert or ignore into sendkeys(chatid, userid, keyid, key, ts) values(?,?,?,?,?)",
@@ -986,8 +1275,8 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
 promise::Promise<std::shared_ptr<SendKey>>
 ProtocolHandler::getKey(UserKeyId ukid, bool legacy)
 {
-    auto kit = mKeys.find(ukid);
-    if (kit == mKeys.end())
+    auto found = findKey(ukid);
+    if (!found)
     {
         if (legacy)
         {
@@ -1001,7 +1290,7 @@ ProtocolHandler::getKey(UserKeyId ukid, bool legacy)
             " from user "+ukid.user.toString()+" not found", SVCRYPTO_ENOKEY, SVCRYPTO_ERRTYPE);
         }
     }
-    auto& entry = kit->second;
+    auto& entry = *found;
     auto key = entry.key;
     if (key)
     {
@@ -1062,16 +1351,56 @@ ProtocolHandler::encryptKeyToAllParticipants(const std::shared_ptr<SendKey>& key
 {
     // Users and send key may change while we are getting pubkeys of current
     // users, so make a snapshot
-    auto keyCmd = new KeyCommand(Id::null());
     SetOfIds users = *mParticipants;
     if (extraUser)
     {
         users.insert(extraUser);
     }
-    std::vector<Promise<void>> promises;
-    promises.reserve(users.size());
-
+    // userid.8+keylen.2+key.16 per user, RSA-encrypted keys may still grow it
+    auto keyCmd = new KeyCommand(Id::null(), CHATD_KEYID_UNCONFIRMED,
+        17 + users.size() * (10 + SVCRYPTO_KEY_SIZE));
+
+    // Wrap the key in one pass for all users whose pairwise key is already known
+    std::vector<Id> known;
+    std::vector<std::shared_ptr<SendKey>> symKeys;
+    std::vector<Id> unknown;
+    known.reserve(users.size());
+    symKeys.reserve(users.size());
     for (auto& user: users)
+    {
+        auto symKey = mForceRsa ? nullptr : mSharedKeyCache.get(user);
+        if (symKey)
+        {
+            known.push_back(user);
+            symKeys.push_back(symKey);
+        }
+        else
+        {
+            unknown.push_back(user);
+        }
+    }
+    if (!known.empty())
+    {
+        std::vector<const SendKey*> keyPtrs;
+        keyPtrs.reserve(symKeys.size());
+        for (auto& symKey: symKeys)
+            keyPtrs.push_back(symKey.get());
+        Buffer wrapped(known.size() * AES::BLOCKSIZE);
+        aesECBEncryptBatch(*key, keyPtrs.data(), keyPtrs.size(), wrapped.ubuf());
+        for (size_t i = 0; i < known.size(); i++)
+        {
+            keyCmd->addKey(known[i], wrapped.buf() + i * AES::BLOCKSIZE, AES::BLOCKSIZE);
+        }
+    }
+    if (unknown.empty())
+    {
+        return std::make_pair(keyCmd, key);
+    }
+
+    // The rest need their public keys fetched, do it in parallel
+    std::vector<Promise<void>> promises;
+    promises.reserve(unknown.size());
+    for (auto& user: unknown)
     {
         auto pms = encryptKeyTo(key, user)
         .then([keyCmd, user](const std::shared_ptr<Buffer>& encryptedKey)
@@ -9,11 +9,17 @@
 #define STRONGVELOPE_H_
 #include <vector>
 #include <map>
+#include <memory>
+#include <list>
 #include <string>
+#include <mutex>
+#include <atomic>
 #include <assert.h>
 #include <iostream>
 #include <buffer.h>
+#include "keys.h"
 #include <karereId.h>
+#include <flatHashMap.h>
 #include <chatdMsg.h>
 #include <chatdICrypto.h>
 #include <promise.h>
@@ -117,50 +123,6 @@ enum: unsigned char
     SVCRYPTO_MSGTYPES_COUNT
 };
 
-template <size_t Size>
-class Key: public StaticBuffer
-{
-protected:
-    char mData[Size];
-public:
-    static size_t bufSize() { return Size; }
-    void setDataSize(size_t size)
-    {
-        if (size > Size)
-            throw std::runtime_error("Can't resize static buffer beyond its data block size");
-        mDataSize = size;
-    }
-    void assign(const char* src, size_t len)
-    {
-        if (len > Size)
-            throw std::runtime_error("Key::assign: source buffer is larger than our size");
-        memcpy(mData, src, len);
-        mDataSize = len;
-    }
-//    Key(const char* src, size_t len): StaticBuffer(mData, 0) { assign(src, len); }
-    Key(size_t len=Size)
-    {
-        //actual data is not initialized, but we need to tell StaticBuffer what is our
-        //max size
-        assert(len <= Size);
-        mBuf = mData;
-        mDataSize = len;
-    }
-    Key(const StaticBuffer& other)
-    {
-        mBuf = mData;
-        assign(other.buf(), other.dataSize());
-    }
-    Key(const char* data, size_t len)
-    {
-        assert(len == Size);
-        mBuf = mData;
-        assign(data, len);
-    }
-};
-typedef Key<16> SendKey;
-typedef Key<32> EcKey;
-
 class ProtocolHandler;
 /** Class to parse an encrypted message and store its attributes and content */
 struct ParsedMessage: public chatd::Message::ManagementInfo, public karere::DeleteTrackable
@@ -169,22 +131,36 @@ struct ParsedMessage: public chatd::Message::ManagementInfo, public karere::Dele
     uint8_t protocolVersion;
     karere::Id sender;
     Key<32> nonce;
-    Buffer payload;
-    Buffer signedContent;
-    Buffer signature;
+    // The buffers below are slices of the parsed message data, nothing is copied.
+    // See detach()
+    StaticBuffer payload{nullptr, 0};
+    StaticBuffer signedContent{nullptr, 0};
+    StaticBuffer signature{nullptr, 0};
     unsigned char type;
     chatd::BackRefId backRefId = 0;
     std::vector<chatd::BackRefId> backRefs;
     //legacy key stuff
     uint64_t keyId;
     uint64_t prevKeyId;
-    Buffer encryptedKey; //may contain also the prev key, concatenated
+    StaticBuffer encryptedKey{nullptr, 0}; //may contain also the prev key, concatenated
     ParsedMessage(const chatd::Message& src, ProtocolHandler& protoHandler);
+    /** @brief Copies the message data, so that the slices no longer reference the
+     * source message. Must be called before the parsed message is used
+     * asynchronously, as the source message may be modified or deleted meanwhile
+     */
+    void detach();
+    /** @brief The whole encrypted message data */
+    const StaticBuffer& source() const { return mSource; }
     bool verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey);
     void parsePayload(const StaticBuffer& data, chatd::Message& msg);
     void parsePayloadWithUtfBackrefs(const StaticBuffer& data, chatd::Message& msg);
-    void symmetricDecrypt(const StaticBuffer& key, chatd::Message& outMsg);
+    /** @brief Decrypts the payload directly into \c outMsg. If the payload is a slice
+     * of \c outMsg itself, it is decrypted in place, so this can be done only once */
+    void symmetricDecrypt(const SendKey& key, chatd::Message& outMsg);
     promise::Promise<chatd::Message*> decryptChatTitle(chatd::Message* msg);
+protected:
+    StaticBuffer mSource; //the message data that the slices reference
+    Buffer mOwnData{(size_t)0}; //copy of the message data, after detach()
 };
 
 
@@ -215,7 +191,7 @@ struct EncryptedMessage
     SendKey key;
     chatd::BackRefId backRefId;
     Key<SVCRYPTO_NONCE_SIZE> nonce;
-    EncryptedMessage(const chatd::Message& msg, const StaticBuffer& aKey);
+    EncryptedMessage(const chatd::Message& msg, const SendKey& aKey);
 };
 
 struct UserKeyId
@@ -223,6 +199,7 @@ struct UserKeyId
     karere::Id user;
     uint64_t key;
     explicit UserKeyId(karere::Id aUser, uint64_t aKey): user(aUser), key(aKey){}
+    bool operator==(UserKeyId other) const { return (user == other.user) && (key == other.key); }
     bool operator<(UserKeyId other) const
     {
 
@@ -232,8 +209,43 @@ struct UserKeyId
             return key < other.key;
     }
 };
+struct UserKeyIdHash
+{
+    size_t operator()(UserKeyId ukid) const
+    {
+        return karere::IdHash()(ukid.user.val ^ (ukid.key * 0x9e3779b97f4a7c15ULL));
+    }
+};
+
+/** @brief Client-wide cache of the x25519-derived pairwise keys, keyed by peer.
+ * Shared by the ProtocolHandlers of all chats, as the derived key depends only on
+ * our own Cu25519 key and the peer's public one. An entry is invalidated when the
+ * peer's Cu25519 public key changes in the UserAttrCache. Thread-safe.
+ */
+class SharedKeyCache
+{
+protected:
+    struct PeerEntry;
+    karere::UserAttrCache& mUserAttrCache;
+    std::map<karere::Id, std::unique_ptr<PeerEntry>> mEntries;
+    mutable std::mutex mMutex;
+    std::atomic<uint64_t> mHits;
+    std::atomic<uint64_t> mMisses;
+    static void onPubKeyChange(Buffer* pubKey, void* userp);
+public:
+    SharedKeyCache(karere::UserAttrCache& userAttrCache);
+    ~SharedKeyCache();
+    /** @brief Returns the key shared with \c userid, or an empty pointer */
+    std::shared_ptr<SendKey> get(karere::Id userid);
+    /** @brief Stores the key derived from the Cu25519 public key \c pubKey of \c userid */
+    void put(karere::Id userid, const StaticBuffer& pubKey, const std::shared_ptr<SendKey>& key);
+    uint64_t hits() const { return mHits; }
+    uint64_t misses() const { return mMisses; }
+    size_t size() const;
+};
 
 class TlvWriter;
+class VerifiedMsgCache;
 
 class ProtocolHandler: public chatd::ICrypto, public karere::DeleteTrackable
 {
@@ -255,23 +267,44 @@ protected:
     {
         std::shared_ptr<SendKey> key;
         std::shared_ptr<promise::Promise<std::shared_ptr<SendKey>>> pms;
+        std::list<UserKeyId>::iterator lruIt; //valid only if key is set
         KeyEntry(){}
-        KeyEntry(const std::shared_ptr<SendKey>& aKey): key(aKey){}
     };
-    std::map<UserKeyId, KeyEntry> mKeys;
-    std::map<karere::Id, std::shared_ptr<SendKey>> mSymmKeyCache;
+    /** The working set of send keys. Keys are loaded from the db on demand, and
+     * the least recently used ones are dropped when there are more than
+     * mMaxKeysInRam. Entries that are still being decrypted (only pms set) are
+     * never dropped */
+    karere::FlatHashMap<UserKeyId, KeyEntry, UserKeyIdHash> mKeys;
+    /** The ids of the entries in mKeys that have a key, most recently used first */
+    std::list<UserKeyId> mKeyLru;
+    size_t mMaxKeysInRam = kDefaultMaxKeysInRam;
+    SharedKeyCache& mSharedKeyCache;
+    VerifiedMsgCache* mVerifiedMsgCache; //optional
     karere::SetOfIds* mParticipants = nullptr;
     bool mParticipantsChanged = true;
     bool mIsDestroying = false;
 public:
+    enum { kDefaultMaxKeysInRam = 128 };
     karere::Id chatid;
     karere::Id ownHandle() const { return mOwnHandle; }
+    size_t keysInRam() const { return mKeyLru.size(); }
+    void setMaxKeysInRam(size_t maxKeys);
+    /** @brief Deletes from the db the keys of this chat that were received
+     * more than \c maxAge seconds ago, except the current send key. Messages
+     * that are not decrypted yet, or edits of them, need their key. Keys
+     * already loaded in RAM stay there until dropped */
+    void pruneKeys(uint32_t maxAge);
     ProtocolHandler(karere::Id ownHandle, const StaticBuffer& PrivCu25519,
         const StaticBuffer& PrivEd25519,
         const StaticBuffer& privRsa, karere::UserAttrCache& userAttrCache,
+        SharedKeyCache& sharedKeyCache, VerifiedMsgCache* verifiedMsgCache,
         SqliteDb& db, karere::Id aChatId, void *ctx);
 protected:
-    void loadKeysFromDb();
+    /** Returns the entry for that key from RAM or, if not there, from the db.
+     * \c nullptr if the key is not known */
+    KeyEntry* findKey(UserKeyId ukid);
+    void setEntryKey(UserKeyId ukid, KeyEntry& entry, const std::shared_ptr<SendKey>& key);
+    void evictKeys();
     promise::Promise<std::shared_ptr<SendKey>> getKey(UserKeyId ukid, bool legacy=false);
     void addDecryptedKey(UserKeyId ukid, const std::shared_ptr<SendKey>& key);
         /**
@@ -308,7 +341,7 @@ protected:
     encryptKeyToAllParticipants(const std::shared_ptr<SendKey>& key, uint64_t extraUser=0);
 
     void msgEncryptWithKey(chatd::Message &src, chatd::MsgCommand& dest,
-        const StaticBuffer& key);
+        const SendKey& key);
     promise::Promise<chatd::Message*> handleManagementMessage(
         const std::shared_ptr<ParsedMessage>& parsedMsg, chatd::Message* msg);
     chatd::Message* legacyMsgDecrypt(const std::shared_ptr<ParsedMessage>& parsedMsg,
@@ -329,7 +362,9 @@ public:
 //chatd::ICrypto interface
         promise::Promise<std::pair<chatd::MsgCommand*, chatd::KeyCommand*>>
             msgEncrypt(chatd::Message *message, chatd::MsgCommand* msgCmd);
+        virtual bool canEncryptImmediately(const chatd::Message& msg) const;
         virtual promise::Promise<chatd::Message*> msgDecrypt(chatd::Message* message);
+        virtual DecryptJob* msgDecryptJob(chatd::Message* message);
         virtual void onKeyReceived(uint32_t keyid, karere::Id sender,
             karere::Id receiver, const char* data, uint16_t dataLen);
         virtual void onKeyConfirmed(uint32_t keyxid, uint32_t keyid);
@@ -20,6 +20,8 @@ struct TlvRecord
             throw std::runtime_error("parseMessageContent: Unexpected length of TLV record with type "+std::to_string(type)+ ": expected "+std::to_string(expected)+" actual: "+std::to_string(dataLen));
     }
     char* buf() const { return sourceBuf.buf()+dataOffset; }
+    /** The payload data as a slice of the container, without copying it */
+    StaticBuffer view() const { return StaticBuffer(buf(), dataLen); }
     template <class T>
     T read() { validateDataLen(sizeof(T)); return sourceBuf.read<T>(dataOffset); }
     template <class T>
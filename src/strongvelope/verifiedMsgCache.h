@@ -0,0 +1,207 @@
+#ifndef STRONGVELOPE_VERIFIEDMSGCACHE_H
+#define STRONGVELOPE_VERIFIEDMSGCACHE_H
+
+#include "strongvelope.h"
+#include "sodium.h"
+#include <db.h>
+
+namespace strongvelope
+{
+/** @brief Persistent cache of authenticated and decrypted messages.
+ * When the local history is lost (db rebuilt or found corrupt, history truncated),
+ * the same messages are received again from the server. With this cache they are
+ * restored without verifying their signature and decrypting them again.
+ * It is kept in a separate db file, so that it survives rebuilds of the main one.
+ * An entry is used only for the exact same encrypted data and send key
+ * (see \c hash()), and the same Ed25519 key of the sender, otherwise the message
+ * is verified again.
+ * Writes are done by the background writer of the db, so that storing the
+ * messages doesn't delay their delivery. The number of entries is kept around
+ * \c kMaxEntries, by dropping the oldest ones every \c kPruneInterval writes.
+ * The ids of the cached messages are also kept in memory, so that lookups of
+ * messages that are not cached (i.e. all of them on a first history fetch) don't
+ * query the db, which would wait for the pending writes.
+ */
+class VerifiedMsgCache
+{
+public:
+    enum { kHashSize = 32, kMaxEntries = 100000, kPruneInterval = kMaxEntries / 10 };
+    typedef Key<kHashSize> Hash;
+protected:
+    SqliteDb mDb;
+    uint64_t mHits = 0;
+    uint64_t mMisses = 0;
+    unsigned mPutsSincePrune = 0;
+    struct Entry
+    {
+        karere::Id chatid;
+        int64_t rowid;
+        Entry(karere::Id aChatid, int64_t aRowid): chatid(aChatid), rowid(aRowid) {}
+    };
+    /** The cached messages by msgid, with the rowid of their entry */
+    karere::IdMap<Entry> mEntries;
+    int64_t mLastRowid = 0;
+    void prune()
+    {
+        // rowids grow with every insert, so this drops the oldest entries
+        mDb.query("delete from verified where rowid <= (select max(rowid) from verified) - ?",
+            (int)kMaxEntries);
+        int64_t oldest = mLastRowid - kMaxEntries;
+        for (auto it = mEntries.begin(); it != mEntries.end();)
+        {
+            if (it->second.rowid <= oldest)
+                it = mEntries.erase(it);
+            else
+                ++it;
+        }
+        mPutsSincePrune = 0;
+    }
+    void loadEntries()
+    {
+        mEntries.clear();
+        mLastRowid = 0;
+        SqliteStmt stmt(mDb, "select msgid, chatid, rowid from verified");
+        while (stmt.step())
+        {
+            int64_t rowid = stmt.int64Col(2);
+            mEntries.emplace(stmt.uint64Col(0), stmt.uint64Col(1), rowid);
+            if (rowid > mLastRowid)
+                mLastRowid = rowid;
+        }
+    }
+public:
+    bool open(const std::string& path)
+    {
+        mDb.setWriteErrorHandler([](const std::string& error)
+        {
+            STRONGVELOPE_LOG_WARNING("Error writing to the verified message cache: %s", error.c_str());
+        });
+        if (!mDb.open(path.c_str(), false, true))
+            return false;
+        try
+        {
+            mDb.simpleQuery(
+                "create table if not exists verified(chatid int64 not null, "
+                "msgid int64 not null, hash blob not null, userid int64 not null, "
+                "edkey blob not null, type tinyint, backrefid int64 not null, "
+                "backrefs blob, data blob, primary key(chatid, msgid))");
+            prune();
+            mDb.flushWrites(true);
+            loadEntries();
+        }
+        catch(std::exception&)
+        {
+            mDb.close();
+            return false;
+        }
+        return true;
+    }
+    ~VerifiedMsgCache() { close(); }
+    void close()
+    {
+        mDb.close();
+        mEntries.clear();
+    }
+    bool timedCommit() { return mDb.isOpen() && mDb.timedCommit(); }
+    uint64_t hits() const { return mHits; }
+    uint64_t misses() const { return mMisses; }
+    /** @brief Identifies the encrypted content of a message. Keyed with the send key,
+     * as the same encrypted data decrypts differently with a different key */
+    static void hash(const StaticBuffer& msgData, const StaticBuffer& sendKey, Hash& result)
+    {
+        crypto_generichash(result.ubuf(), kHashSize, msgData.ubuf(), msgData.dataSize(),
+            sendKey.ubuf(), sendKey.dataSize());
+    }
+    /** @brief If \c msg with encrypted content \c hash has been authenticated with
+     * the Ed25519 key \c edKey of \c sender, replaces the content of \c msg with the
+     * decrypted one and returns true
+     */
+    bool get(karere::Id chatid, karere::Id sender, const Hash& hash,
+        const StaticBuffer& edKey, chatd::Message& msg)
+    {
+        if (!mDb.isOpen())
+            return false;
+        auto it = mEntries.find(msg.id());
+        if (it == mEntries.end() || it->second.chatid != chatid)
+        {
+            mMisses++;
+            return false;
+        }
+        try
+        {
+            return doGet(chatid, sender, hash, edKey, msg);
+        }
+        catch(std::exception& e)
+        {
+            STRONGVELOPE_LOG_WARNING("Error reading from the verified message cache: %s", e.what());
+            return false;
+        }
+    }
+    /** @brief Stores the decrypted content of \c msg, which has been authenticated
+     * with the Ed25519 key \c edKey of \c sender */
+    void put(karere::Id chatid, karere::Id sender, const Hash& hash,
+        const StaticBuffer& edKey, const chatd::Message& msg)
+    {
+        StaticBuffer refs((const char*)msg.backRefs.data(),
+            msg.backRefs.size()*sizeof(chatd::BackRefId));
+        if (!mDb.isOpen())
+            return;
+        try
+        {
+            mDb.query("insert or replace into verified(chatid, msgid, hash, userid, edkey, "
+                "type, backrefid, backrefs, data) values(?,?,?,?,?,?,?,?,?)",
+                chatid, msg.id(), hash, sender, edKey, (int)msg.type, msg.backRefId,
+                refs, msg);
+            //the rowid of a new row is the highest one plus one
+            auto entry = mEntries.emplace(msg.id(), chatid, ++mLastRowid).first;
+            entry->second.chatid = chatid;
+            entry->second.rowid = mLastRowid;
+            if (++mPutsSincePrune >= kPruneInterval)
+                prune();
+        }
+        catch(std::exception& e)
+        {
+            STRONGVELOPE_LOG_WARNING("Error writing to the verified message cache: %s", e.what());
+        }
+    }
+protected:
+    bool doGet(karere::Id chatid, karere::Id sender, const Hash& hash,
+        const StaticBuffer& edKey, chatd::Message& msg)
+    {
+        SqliteStmt stmt(mDb, "select userid, edkey, type, backrefid, backrefs, data "
+            "from verified where chatid=? and msgid=? and hash=?");
+        stmt << chatid << msg.id() << hash;
+        if (!stmt.step())
+        {
+            mMisses++;
+            return false;
+        }
+        Key<32> storedEdKey;
+        storedEdKey.setDataSize(stmt.blobCol(1, storedEdKey.buf(), storedEdKey.bufSize()));
+        if (stmt.uint64Col(0) != sender || !storedEdKey.dataEquals(edKey))
+        {
+            //the sender's key has changed since, the message has to be verified again
+            mDb.query("delete from verified where chatid=? and msgid=?", chatid, msg.id());
+            mEntries.erase(msg.id());
+            mMisses++;
+            return false;
+        }
+        msg.type = stmt.intCol(2);
+        msg.backRefId = stmt.uint64Col(3);
+        msg.backRefs.clear();
+        auto refs = (const char*)sqlite3_column_blob(stmt, 4);
+        if (refs)
+            StaticBuffer(refs, sqlite3_column_bytes(stmt, 4)).read(0, msg.backRefs);
+        auto data = sqlite3_column_blob(stmt, 5);
+        auto size = sqlite3_column_bytes(stmt, 5);
+        if (data && size)
+            msg.assign(data, size);
+        else
+            msg.clear();
+        msg.setEncrypted(0);
+        mHits++;
+        return true;
+    }
+};
+}
+#endif
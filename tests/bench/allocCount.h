@@ -0,0 +1,80 @@
+/* Per-thread counting of heap allocations, for the benchmarks and checks.
+ * With glibc, malloc(), calloc(), realloc() and free() are replaced by wrappers
+ * around the glibc implementation, so allocations made by C code (Buffer,
+ * sqlite, libsodium) and by operator new are all counted, including those in
+ * shared libraries. Elsewhere only operator new/delete can be replaced, and
+ * kAllocCountScope tells which allocations are counted.
+ * This header defines the allocation functions, so it must be included by only
+ * one source file of an executable.
+ */
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <new>
+
+// Counted per thread, as the SDK and the worker pools run their own threads
+static thread_local size_t tAllocCount = 0; //calls that allocated a block
+static thread_local size_t tFreeCount = 0; //calls that released a block
+
+/** Blocks allocated and not freed by this thread */
+static inline long liveAllocs() { return (long)tAllocCount - (long)tFreeCount; }
+
+#ifdef __GLIBC__
+static const char* const kAllocCountScope = "malloc";
+
+extern "C"
+{
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size)
+{
+    tAllocCount++;
+    return __libc_malloc(size);
+}
+void* calloc(size_t count, size_t size)
+{
+    tAllocCount++;
+    return __libc_calloc(count, size);
+}
+void* realloc(void* ptr, size_t size)
+{
+    if (!ptr)
+        tAllocCount++;
+    else if (!size)
+        tFreeCount++;
+    return __libc_realloc(ptr, size);
+}
+void free(void* ptr)
+{
+    if (ptr)
+        tFreeCount++;
+    __libc_free(ptr);
+}
+}
+#else
+static const char* const kAllocCountScope = "operator_new";
+
+void* operator new(size_t size)
+{
+    tAllocCount++;
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* ptr) noexcept
+{
+    if (ptr)
+        tFreeCount++;
+    free(ptr);
+}
+void operator delete[](void* ptr) noexcept { operator delete(ptr); }
+#endif
+
+#endif
@@ -0,0 +1,127 @@
+/* Model of NEWMSGID/MSGID dispatch in chatd::Client. This does not run any
+ * chatd code: the send queues and the index are modelled with std::list and
+ * std::map, to compare the complexity of the two approaches in isolation.
+ * OP_NEWMSGID carries no chatid, so the confirmation has to be routed to the
+ * chat that has the msgxid at the front of its send queue. This compares the
+ * old approach (try every chat until one accepts it) with a msgxid->Chat
+ * index, for a client that is a member of N chats and sends to all of them.
+ * The confirmation by the real chatd::Client is measured by
+ * chatd_msgxid_confirm_bench (msgxidConfirmBench.cpp).
+ *
+ * Usage: chatd_msgxid_model_bench [confirmsPerChat] [N1 N2 ...]
+ */
+#include <karereId.h>
+#include <chrono>
+#include <list>
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using karere::Id;
+
+struct BenchChat
+{
+    Id chatid;
+    std::list<Id> sending; //msgxids, in send order
+    size_t confirmed = 0;
+    bool confirm(Id msgxid)
+    {
+        // same check as Chat::msgRemoveFromSending()
+        if (sending.empty() || sending.front() != msgxid)
+            return false;
+        sending.pop_front();
+        confirmed++;
+        return true;
+    }
+};
+
+struct Workload
+{
+    std::map<Id, std::shared_ptr<BenchChat>> chats;
+    std::vector<Id> confirms; //msgxids in the order the server confirms them
+    Workload(size_t numChats, size_t perChat, uint64_t seed)
+    {
+        std::mt19937_64 rng(seed);
+        std::vector<BenchChat*> order;
+        for (size_t i = 0; i < numChats; i++)
+        {
+            auto chat = std::make_shared<BenchChat>();
+            chat->chatid = rng();
+            chats.emplace(chat->chatid, chat);
+            order.push_back(chat.get());
+        }
+        // send round-robin to all chats, server confirms in the same order
+        for (size_t n = 0; n < perChat; n++)
+        {
+            for (auto chat: order)
+            {
+                Id msgxid(rng());
+                chat->sending.push_back(msgxid);
+                confirms.push_back(msgxid);
+            }
+        }
+    }
+};
+
+static double benchLinear(size_t numChats, size_t perChat)
+{
+    Workload w(numChats, perChat, 1);
+    auto start = std::chrono::steady_clock::now();
+    for (auto msgxid: w.confirms)
+    {
+        for (auto& chat: w.chats)
+        {
+            if (chat.second->confirm(msgxid))
+                break;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / w.confirms.size();
+}
+
+static double benchIndexed(size_t numChats, size_t perChat)
+{
+    Workload w(numChats, perChat, 1);
+    // filled when messages are posted to the send queue
+    std::map<Id, BenchChat*> chatForMsgxid;
+    for (auto& chat: w.chats)
+    {
+        for (auto msgxid: chat.second->sending)
+            chatForMsgxid[msgxid] = chat.second.get();
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (auto msgxid: w.confirms)
+    {
+        auto it = chatForMsgxid.find(msgxid);
+        if (it == chatForMsgxid.end())
+            continue;
+        BenchChat* chat = it->second;
+        chatForMsgxid.erase(it);
+        chat->confirm(msgxid);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / w.confirms.size();
+}
+
+int main(int argc, char** argv)
+{
+    size_t perChat = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 10;
+    std::vector<size_t> sizes;
+    for (int i = 2; i < argc; i++)
+        sizes.push_back(strtoul(argv[i], nullptr, 10));
+    if (sizes.empty())
+        sizes = {10, 100, 1000, 5000};
+
+    printf("model of msgxid dispatch, not chatd code\n");
+    printf("%8s %10s %16s %16s\n", "chats", "confirms", "linear ns/op", "indexed ns/op");
+    for (auto n: sizes)
+    {
+        double linear = benchLinear(n, perChat);
+        double indexed = benchIndexed(n, perChat);
+        printf("%8zu %10zu %16.1f %16.1f\n", n, n * perChat, linear, indexed);
+    }
+    return 0;
+}
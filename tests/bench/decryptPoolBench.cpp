@@ -0,0 +1,419 @@
+/* Benchmark of the decryption of a backlog of received messages by chatd::Chat,
+ * on the app thread and on the decrypt pool (chatd::Client::setDecryptThreads())
+ * with a range of thread counts. The messages are encrypted by a strongvelope
+ * ProtocolHandler, and fed to the chatd connection as NEWMSG frames, as after a
+ * reconnect. There is no server and no login: keys resolve synchronously, as in
+ * strongvelope_bench.
+ * Checks that the messages are notified to the listener in order and with the
+ * right content, and prints the time to deliver the whole backlog as JSON.
+ * Then the decryption of the first message is held, as if its key was being
+ * fetched, with and without chatd::Client::kOptDecryptAhead. Checks that nothing
+ * is notified before it, and that the following messages are decrypted meanwhile
+ * in kOptDecryptAhead mode. The time to deliver the backlog once it is released
+ * is printed in the "decrypt_ahead" results.
+ *
+ * Usage: chatd_decryptpool_bench [message count] [thread counts]
+ * where thread counts is a comma separated list, i.e. chatd_decryptpool_bench 5000 0,1,2,4
+ */
+#include <chatClient.h>
+#include <chatdDb.h>
+#include <strongvelope/strongvelope.h>
+#include <sodium.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace karere;
+using namespace strongvelope;
+
+// The app message loop: calls marshalled by the decrypt pool are run by the
+// benchmark thread, which plays the app thread
+static std::mutex gMsgMutex;
+static std::condition_variable gMsgCond;
+static std::deque<void*> gMsgs;
+
+static void postMessage(void* msg, void* /*appCtx*/)
+{
+    {
+        std::lock_guard<std::mutex> lock(gMsgMutex);
+        gMsgs.push_back(msg);
+    }
+    gMsgCond.notify_one();
+}
+
+static void processMessages(const std::function<bool()>& done)
+{
+    while (!done())
+    {
+        void* msg;
+        {
+            std::unique_lock<std::mutex> lock(gMsgMutex);
+            if (!gMsgCond.wait_for(lock, std::chrono::seconds(30), []() { return !gMsgs.empty(); }))
+                throw std::runtime_error("Timed out waiting for the decrypted messages");
+            msg = gMsgs.front();
+            gMsgs.pop_front();
+        }
+        megaProcessMessage(msg);
+    }
+}
+
+static bool noPendingMessages()
+{
+    std::lock_guard<std::mutex> lock(gMsgMutex);
+    return gMsgs.empty();
+}
+
+class BenchApp: public IApp
+{
+public:
+    virtual IContactListHandler* contactListHandler() { return nullptr; }
+    virtual IChatListHandler* chatListHandler() { return nullptr; }
+    virtual void onPresenceConfigChanged(const presenced::Config& config, bool pending) {}
+    virtual void onIncomingContactRequest(const mega::MegaContactRequest& req) {}
+#ifndef KARERE_DISABLE_WEBRTC
+    virtual rtcModule::IEventHandler*
+        onIncomingCall(const std::shared_ptr<rtcModule::ICallAnswer>& ans) { return nullptr; }
+#endif
+};
+
+template <class T>
+static T check(const promise::Promise<T>& pms, const char* what)
+{
+    if (!pms.succeeded())
+        throw std::runtime_error(std::string(what)+" did not complete synchronously"
+            +(pms.done() ? ": "+pms.error().msg() : std::string()));
+    return pms.value();
+}
+
+// Gives access to the connection of a chat, to feed it with received frames
+class BenchChatdClient: public chatd::Client
+{
+public:
+    using chatd::Client::Client;
+    WebsocketsClient& conn(Id chatid) { return chatidConn(chatid); }
+};
+
+// Holds the decryption of one message until release() is called, as if its key
+// was being fetched
+class HoldingHandler: public ProtocolHandler
+{
+    chatd::Message* mHeldMsg = nullptr;
+    promise::Promise<chatd::Message*> mHeldPms;
+public:
+    using ProtocolHandler::ProtocolHandler;
+    Id heldMsgid = Id::null();
+    size_t decrypted = 0; //messages other than the held one, on the app thread or the pool
+    virtual promise::Promise<chatd::Message*> msgDecrypt(chatd::Message* message)
+    {
+        if (message->id() != heldMsgid)
+        {
+            decrypted++;
+            return ProtocolHandler::msgDecrypt(message);
+        }
+        mHeldMsg = message;
+        return mHeldPms;
+    }
+    virtual DecryptJob* msgDecryptJob(chatd::Message* message)
+    {
+        if (message->id() == heldMsgid)
+            return nullptr;
+        auto job = ProtocolHandler::msgDecryptJob(message);
+        if (job)
+            decrypted++;
+        return job;
+    }
+    void release()
+    {
+        if (!mHeldMsg)
+            throw std::runtime_error("The held message was not decrypted");
+        mHeldPms.resolve(check(ProtocolHandler::msgDecrypt(mHeldMsg), "msgDecrypt"));
+    }
+};
+
+// Checks that the messages are notified in order, and with the right content
+class BenchListener: public chatd::Listener
+{
+    SqliteDb& mDb;
+public:
+    chatd::Idx firstIdx = CHATD_IDX_INVALID;
+    size_t received = 0;
+    size_t errors = 0;
+    BenchListener(SqliteDb& db): mDb(db) {}
+    virtual void init(chatd::Chat& chat, chatd::DbInterface*& dbIntf)
+    {
+        dbIntf = new ChatdSqliteDb(chat, mDb);
+    }
+    virtual void onRecvNewMessage(chatd::Idx idx, chatd::Message& msg, chatd::Message::Status status)
+    {
+        if (firstIdx == CHATD_IDX_INVALID)
+            firstIdx = idx;
+        auto expected = "message "+std::to_string(received);
+        if ((idx != firstIdx + (chatd::Idx)received) || msg.isEncrypted()
+            || (std::string(msg.buf(), msg.dataSize()) != expected))
+        {
+            if (!errors++)
+                fprintf(stderr, "Message %zu notified out of order or not decrypted (idx %d)\n",
+                    received, idx - firstIdx);
+        }
+        received++;
+    }
+};
+
+struct User
+{
+    Id id;
+    EcKey privCu;
+    EcKey privEd; //the seed only, as ProtocolHandler takes it
+};
+
+struct Result
+{
+    unsigned threads;
+    bool decryptAhead;
+    size_t ahead; //messages decrypted while the first one was held
+    double ms;
+    double msgsPerSec;
+};
+
+static void openDb(SqliteDb& db)
+{
+    if (!db.open(":memory:", false))
+        throw std::runtime_error("Can't open in-memory db");
+    db.simpleQuery(gDbSchema);
+}
+
+struct MemoryDb: public SqliteDb
+{
+    MemoryDb() { openDb(*this); }
+    ~MemoryDb() { close(); }
+};
+
+static std::vector<unsigned> parseCounts(const char* arg)
+{
+    std::vector<unsigned> result;
+    std::istringstream is(arg);
+    std::string item;
+    while (std::getline(is, item, ','))
+        result.push_back(strtoul(item.c_str(), nullptr, 10));
+    return result;
+}
+
+class Bench
+{
+    BenchApp mApp;
+    Client mClient;
+    std::unique_ptr<UserAttrCache> mAttrCache;
+    std::unique_ptr<SharedKeyCache> mSenderKeys;
+    std::unique_ptr<SharedKeyCache> mReceiverKeys;
+    User mSender;
+    User mReceiver;
+    SetOfIds mParticipants;
+    const Id mChatid = Id(0xc4a7);
+    const KeyId mKeyid = 1;
+    std::string mReceiverKey; //the send key, as encrypted to the receiver in NEWKEY
+    std::vector<Buffer> mFrames;
+    size_t mCount = 0;
+    void addUser(User& user);
+public:
+    Bench(mega::MegaApi& sdk);
+    ~Bench()
+    {
+        mSenderKeys.reset();
+        mReceiverKeys.reset();
+        mAttrCache.reset();
+        mClient.db.close();
+    }
+    void encrypt(size_t count);
+    Result run(unsigned threads, bool hold, bool decryptAhead);
+};
+
+Bench::Bench(mega::MegaApi& sdk)
+: mClient(sdk, nullptr, mApp, "", 0)
+{
+    openDb(mClient.db);
+    mSender.id = Id(0x1000);
+    mReceiver.id = Id(0x1001);
+    addUser(mSender);
+    addUser(mReceiver);
+    mParticipants.insert(mSender.id);
+    mParticipants.insert(mReceiver.id);
+    mAttrCache.reset(new UserAttrCache(mClient));
+    mSenderKeys.reset(new SharedKeyCache(*mAttrCache));
+    mReceiverKeys.reset(new SharedKeyCache(*mAttrCache));
+}
+
+void Bench::addUser(User& user)
+{
+    unsigned char pubCu[crypto_scalarmult_BYTES];
+    randombytes_buf(user.privCu.ubuf(), 32);
+    crypto_scalarmult_base(pubCu, user.privCu.ubuf());
+    unsigned char pubEd[crypto_sign_PUBLICKEYBYTES];
+    unsigned char privEd[crypto_sign_SECRETKEYBYTES];
+    randombytes_buf(user.privEd.ubuf(), 32);
+    crypto_sign_seed_keypair(pubEd, privEd, user.privEd.ubuf());
+    mClient.db.query("insert into userattrs(userid, type, data) values(?,?,?)",
+        user.id, (int)mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY,
+        StaticBuffer((const char*)pubCu, sizeof(pubCu)));
+    mClient.db.query("insert into userattrs(userid, type, data) values(?,?,?)",
+        user.id, (int)mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY,
+        StaticBuffer((const char*)pubEd, sizeof(pubEd)));
+}
+
+// Encrypts the backlog once, as NEWMSG frames of up to 100 messages
+void Bench::encrypt(size_t count)
+{
+    MemoryDb senderDb;
+    ProtocolHandler alice(mSender.id, mSender.privCu, mSender.privEd, StaticBuffer(nullptr, 0),
+        *mAttrCache, *mSenderKeys, nullptr, senderDb, mChatid, nullptr);
+    alice.setUsers(&mParticipants);
+
+    // Post a send key to the group and keep the receiver's part, as chatd would
+    chatd::Message first(0, mSender.id, 0, 0, Buffer("x", 1));
+    chatd::MsgCommand firstCmd(chatd::OP_NEWMSG, mChatid, mSender.id, 1, 0, 0, CHATD_KEYID_INVALID);
+    auto keyCmd = check(alice.msgEncrypt(&first, &firstCmd), "msgEncrypt").second;
+    assert(keyCmd);
+    for (size_t offset = 17; offset < keyCmd->dataSize();)
+    {
+        Id userid = keyCmd->read<uint64_t>(offset);
+        auto keylen = keyCmd->read<uint16_t>(offset + 8);
+        if (userid == mReceiver.id)
+            mReceiverKey.assign(keyCmd->buf() + offset + 10, keylen);
+        offset += 10 + keylen;
+    }
+    alice.onKeyConfirmed(CHATD_KEYID_UNCONFIRMED, mKeyid);
+
+    mFrames.clear();
+    mCount = count;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i % 100 == 0)
+            mFrames.emplace_back();
+        auto text = "message "+std::to_string(i);
+        chatd::Message msg(0, mSender.id, 0, 0, Buffer(text.c_str(), text.size()));
+        msg.keyid = mKeyid;
+        chatd::MsgCommand cmd(chatd::OP_NEWMSG, mChatid, mSender.id, Id(0x10000 + i),
+            1500000000 + i, 0, mKeyid);
+        check(alice.msgEncrypt(&msg, &cmd), "msgEncrypt");
+        mFrames.back().append(cmd.buf(), cmd.dataSize());
+    }
+}
+
+Result Bench::run(unsigned threads, bool hold, bool decryptAhead)
+{
+    // Start from an empty history every time
+    mClient.db.query("delete from history where chatid = ?", mChatid);
+    mClient.db.query("delete from chat_vars where chatid = ?", mChatid);
+
+    MemoryDb receiverDb;
+    BenchListener listener(mClient.db);
+    size_t ahead = 0;
+    double ms;
+    {
+        BenchChatdClient client(&mClient, mReceiver.id);
+        client.setDecryptThreads(threads);
+        if (decryptAhead)
+            client.options |= chatd::Client::kOptDecryptAhead;
+        auto bob = new HoldingHandler(mReceiver.id, mReceiver.privCu, mReceiver.privEd,
+            StaticBuffer(nullptr, 0), *mAttrCache, *mReceiverKeys, nullptr, receiverDb, mChatid, nullptr);
+        if (hold)
+            bob->heldMsgid = Id(0x10000);
+        client.createChat(mChatid, 0, "", &listener, mParticipants, bob, 0, true);
+        bob->onKeyReceived(mKeyid, mSender.id, mReceiver.id, mReceiverKey.c_str(), mReceiverKey.size());
+
+        auto& conn = client.conn(mChatid);
+        auto start = std::chrono::steady_clock::now();
+        for (auto& frame: mFrames)
+            conn.wsHandleMsgCb(frame.buf(), frame.dataSize());
+        if (hold)
+        {
+            if (client.decryptPool())
+                client.decryptPool()->waitIdle();
+            processMessages(noPendingMessages);
+            if (listener.received)
+                throw std::runtime_error(std::to_string(listener.received)+
+                    " messages notified before the held one");
+            ahead = bob->decrypted;
+            if (decryptAhead && (mCount > 1) && !ahead)
+                throw std::runtime_error("No message decrypted ahead of the held one");
+            if (!decryptAhead && ahead)
+                throw std::runtime_error("Messages decrypted ahead without kOptDecryptAhead");
+            start = std::chrono::steady_clock::now();
+            bob->release();
+        }
+        processMessages([&listener, this]() { return listener.received >= mCount; });
+        ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        processMessages(noPendingMessages);
+    }
+    processMessages(noPendingMessages);
+
+    if (listener.errors)
+        throw std::runtime_error(std::to_string(listener.errors)+" messages notified out of order "
+            "or not decrypted, with "+std::to_string(threads)+" decrypt threads");
+    return {threads, decryptAhead, ahead, ms, mCount * 1000.0 / ms};
+}
+
+static void printResults(const char* name, const std::vector<Result>& results, bool last)
+{
+    printf("  \"%s\": [\n", name);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        auto& r = results[i];
+        printf("    {\"threads\": %u, \"decrypt_ahead\": %s, \"decrypted_ahead\": %zu, "
+            "\"ms\": %.1f, \"msgs_per_sec\": %.1f, \"speedup\": %.2f}%s\n",
+            r.threads, r.decryptAhead ? "true" : "false", r.ahead, r.ms, r.msgsPerSec,
+            results[0].ms / r.ms, (i + 1 < results.size()) ? "," : "");
+    }
+    printf("  ]%s\n", last ? "" : ",");
+}
+
+int main(int argc, char** argv)
+{
+    size_t count = 5000;
+    std::vector<unsigned> threadCounts = {0, 1, 2, 4, 8};
+    if (argc > 1)
+        count = std::max(1, atoi(argv[1]));
+    if (argc > 2)
+        threadCounts = parseCounts(argv[2]);
+    if (sodium_init() == -1)
+        return 1;
+    megaPostMessageToGui = postMessage;
+    krLoggerChannels[krLogChannel_chatd].logLevel = krLogLevelError;
+    krLoggerChannels[krLogChannel_strongvelope].logLevel = krLogLevelError;
+    krLoggerChannels[krLogChannel_megasdk].logLevel = krLogLevelError;
+
+    // Never logged in, only needed by karere::Client and the attribute cache
+    mega::MegaApi sdk("chatd_decryptpool_bench", (const char*)nullptr, "chatd_decryptpool_bench");
+    std::vector<Result> results;
+    std::vector<Result> aheadResults;
+    int ret = 0;
+    try
+    {
+        Bench bench(sdk);
+        bench.encrypt(count);
+        for (auto threads: threadCounts)
+            results.push_back(bench.run(threads, false, false));
+        // The first one is the baseline, that waits for the held message
+        aheadResults.push_back(bench.run(0, true, false));
+        for (auto threads: threadCounts)
+            aheadResults.push_back(bench.run(threads, true, true));
+    }
+    catch(std::exception& e)
+    {
+        fprintf(stderr, "Error: %s\n", e.what());
+        ret = 1;
+    }
+
+    printf("{\n  \"messages\": %zu,\n", count);
+    printResults("results", results, false);
+    printResults("decrypt_ahead", aheadResults, true);
+    printf("}\n");
+    return ret;
+}
@@ -0,0 +1,154 @@
+/* Benchmark of the RAM history buffer layout of chatd::Chat. Compares the old
+ * layout (a vector of individually allocated messages, each with its own heap
+ * payload) with chatd::HistoryList (messages in chunks, payloads in per-chunk
+ * blocks), for loading N messages as from the db, scrolling through them, and
+ * freeing them.
+ *
+ * Usage: chatd_historylist_bench [scrollPasses] [N1 N2 ...]
+ */
+#include <chatdHistoryList.h>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using karere::Id;
+using chatd::Message;
+using chatd::HistoryList;
+
+struct DbRow
+{
+    Id msgid;
+    Id userid;
+    uint32_t ts;
+    std::string data;
+};
+
+// Mostly short text messages, with some attachments and management messages
+static std::vector<DbRow> makeRows(size_t count, uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    std::vector<DbRow> rows(count);
+    for (auto& row: rows)
+    {
+        row.msgid = rng();
+        row.userid = rng() % 16;
+        row.ts = 1500000000 + rng() % 10000000;
+        auto kind = rng() % 100;
+        size_t len = (kind < 80) ? 20 + rng() % 300 : (kind < 95) ? 300 + rng() % 1500 : rng() % 40;
+        row.data.resize(len);
+        for (auto& ch: row.data)
+            ch = (char)rng();
+    }
+    return rows;
+}
+
+typedef std::chrono::steady_clock Clock;
+static double nsPerMsg(Clock::time_point start, size_t count)
+{
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / count;
+}
+
+struct Result
+{
+    double load;
+    double scroll;
+    double free;
+    uint64_t checksum;
+};
+
+template <class F>
+static uint64_t scroll(size_t count, unsigned passes, F&& at)
+{
+    uint64_t sum = 0;
+    for (unsigned pass = 0; pass < passes; pass++)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            const Message& msg = *at(i);
+            sum += msg.ts + msg.dataSize();
+            if (msg.dataSize())
+                sum += (unsigned char)msg.buf()[0] + (unsigned char)msg.buf()[msg.dataSize()-1];
+        }
+    }
+    return sum;
+}
+
+static Result benchVector(const std::vector<DbRow>& rows, unsigned passes)
+{
+    Result result;
+    auto start = Clock::now();
+    std::vector<std::unique_ptr<Message>> list;
+    for (auto& row: rows)
+    {
+        // as the db layer did: the blob is copied to a Buffer, which the message takes
+        Buffer buf(row.data.data(), row.data.size());
+        list.emplace_back(new Message(row.msgid, row.userid, row.ts, 0, std::move(buf),
+            false, 1, Message::kMsgNormal));
+    }
+    result.load = nsPerMsg(start, rows.size());
+
+    start = Clock::now();
+    result.checksum = scroll(list.size(), passes, [&list](size_t i) { return list[i].get(); });
+    result.scroll = nsPerMsg(start, rows.size() * passes);
+
+    start = Clock::now();
+    list.clear();
+    list.shrink_to_fit();
+    result.free = nsPerMsg(start, rows.size());
+    return result;
+}
+
+static Result benchHistoryList(const std::vector<DbRow>& rows, unsigned passes)
+{
+    Result result;
+    auto start = Clock::now();
+    std::unique_ptr<HistoryList> list(new HistoryList);
+    for (auto& row: rows)
+    {
+        auto msg = list->stage(row.msgid, row.userid, row.ts, 0, row.data.data(),
+            row.data.size(), 1, Message::kMsgNormal);
+        list->push_back(msg);
+    }
+    result.load = nsPerMsg(start, rows.size());
+
+    start = Clock::now();
+    auto& ref = *list;
+    result.checksum = scroll(ref.size(), passes, [&ref](size_t i) { return ref[i]; });
+    result.scroll = nsPerMsg(start, rows.size() * passes);
+
+    start = Clock::now();
+    list.reset();
+    result.free = nsPerMsg(start, rows.size());
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned passes = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 5;
+    std::vector<size_t> sizes;
+    for (int i = 2; i < argc; i++)
+        sizes.push_back(strtoul(argv[i], nullptr, 10));
+    if (sizes.empty())
+        sizes = {1000, 10000, 100000, 500000};
+
+    printf("%8s | %10s %10s %10s | %10s %10s %10s   (ns/msg)\n", "msgs",
+        "vec load", "vec scroll", "vec free", "list load", "list scrl", "list free");
+    for (auto n: sizes)
+    {
+        auto rows = makeRows(n, 1);
+        auto vec = benchVector(rows, passes);
+        auto list = benchHistoryList(rows, passes);
+        if (vec.checksum != list.checksum)
+        {
+            fprintf(stderr, "Checksum mismatch for %zu messages\n", n);
+            return 1;
+        }
+        printf("%8zu | %10.1f %10.1f %10.1f | %10.1f %10.1f %10.1f\n", n,
+            vec.load, vec.scroll, vec.free, list.load, list.scroll, list.free);
+    }
+    return 0;
+}
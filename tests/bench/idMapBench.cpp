@@ -0,0 +1,149 @@
+/* Benchmark of the id-keyed indexes (i.e. Chat::mIdToIndexMap): std::map, as
+ * they used to be, std::unordered_map, and karere::IdMap. Measures insert,
+ * lookup of present and absent ids, erase, and the memory per entry, counted
+ * as the live allocated bytes after the inserts.
+ *
+ * Usage: chatd_idmap_bench [lookupsPerEntry] [N1 N2 ...]
+ */
+#include <flatHashMap.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <new>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using karere::Id;
+typedef int Idx;
+
+// live allocated bytes, each block is prefixed with its size
+static size_t gAllocBytes = 0;
+enum { kAllocHeader = 16 };
+void* operator new(size_t size)
+{
+    auto ptr = (char*)malloc(size + kAllocHeader);
+    if (!ptr)
+        throw std::bad_alloc();
+    *(size_t*)ptr = size;
+    gAllocBytes += size;
+    return ptr + kAllocHeader;
+}
+void operator delete(void* ptr) noexcept
+{
+    if (!ptr)
+        return;
+    // through a uintptr_t, so the compiler doesn't see an access before the object
+    auto block = (char*)((uintptr_t)ptr - kAllocHeader);
+    gAllocBytes -= *(volatile size_t*)block;
+    free(block);
+}
+
+typedef std::chrono::steady_clock Clock;
+static double nsPerOp(Clock::time_point start, size_t count)
+{
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / count;
+}
+
+struct Result
+{
+    double insert;
+    double hit;
+    double miss;
+    double erase;
+    double bytesPerEntry;
+    uint64_t checksum;
+};
+
+template <class Map>
+static Result bench(const std::vector<Id>& ids, const std::vector<Id>& absent, unsigned lookups)
+{
+    Result result;
+    result.checksum = 0;
+    size_t allocStart = gAllocBytes;
+    std::unique_ptr<Map> map(new Map);
+    auto start = Clock::now();
+    Idx idx = 0;
+    for (auto id: ids)
+        (*map)[id] = idx++;
+    result.insert = nsPerOp(start, ids.size());
+    result.bytesPerEntry = (double)(gAllocBytes - allocStart) / ids.size();
+
+    // look up in a different order than inserted
+    std::vector<Id> order(ids);
+    std::mt19937_64 rng(2);
+    std::shuffle(order.begin(), order.end(), rng);
+    start = Clock::now();
+    for (unsigned i = 0; i < lookups; i++)
+    {
+        for (auto id: order)
+        {
+            auto it = map->find(id);
+            if (it != map->end())
+                result.checksum += it->second;
+        }
+    }
+    result.hit = nsPerOp(start, order.size() * lookups);
+
+    start = Clock::now();
+    for (unsigned i = 0; i < lookups; i++)
+    {
+        for (auto id: absent)
+            result.checksum += (map->find(id) == map->end());
+    }
+    result.miss = nsPerOp(start, absent.size() * lookups);
+
+    start = Clock::now();
+    for (auto id: order)
+        map->erase(id);
+    result.erase = nsPerOp(start, order.size());
+    return result;
+}
+
+struct StdIdHash
+{
+    size_t operator()(const Id& id) const { return std::hash<uint64_t>()(id.val); }
+};
+
+int main(int argc, char** argv)
+{
+    unsigned lookups = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 4;
+    std::vector<size_t> sizes;
+    for (int i = 2; i < argc; i++)
+        sizes.push_back(strtoul(argv[i], nullptr, 10));
+    if (sizes.empty())
+        sizes = {100, 10000, 100000, 1000000};
+
+    printf("%-14s %9s | %9s %9s %9s %9s (ns/op) | %11s\n", "map", "entries",
+        "insert", "hit", "miss", "erase", "bytes/entry");
+    for (auto n: sizes)
+    {
+        std::mt19937_64 rng(1);
+        std::vector<Id> ids(n), absent(n);
+        for (auto& id: ids)
+            id = rng();
+        for (auto& id: absent)
+            id = rng();
+
+        Result results[3] = {
+            bench<std::map<Id, Idx>>(ids, absent, lookups),
+            bench<std::unordered_map<Id, Idx, StdIdHash>>(ids, absent, lookups),
+            bench<karere::IdMap<Idx>>(ids, absent, lookups)
+        };
+        const char* names[3] = {"std::map", "unordered_map", "karere::IdMap"};
+        for (int i = 0; i < 3; i++)
+        {
+            if (results[i].checksum != results[0].checksum)
+            {
+                fprintf(stderr, "Checksum mismatch for %s\n", names[i]);
+                return 1;
+            }
+            auto& r = results[i];
+            printf("%-14s %9zu | %9.1f %9.1f %9.1f %9.1f         | %11.1f\n", names[i], n,
+                r.insert, r.hit, r.miss, r.erase, r.bytesPerEntry);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+/* Benchmark of send key rotation in strongvelope.
+ * On every rotation the new send key is wrapped (AES-ECB) with the pairwise
+ * key of every participant and the results are collected in a NEWKEY command.
+ * This compares the old path (one promise, cipher object and output buffer
+ * per participant, command grown on every append) with the batched one
+ * (one cipher object for all known pairwise keys, command sized up front),
+ * for groups of N participants whose pairwise keys are all cached.
+ *
+ * Usage: strongvelope_keyrotation_bench [rotations] [N1 N2 ...]
+ */
+#include <chatdMsg.h>
+#include <base/promise.h>
+#include <cryptopp/aes.h>
+#include <cryptopp/modes.h>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using karere::Id;
+enum { kKeySize = CryptoPP::AES::BLOCKSIZE };
+struct SendKey //same layout as strongvelope::SendKey data
+{
+    unsigned char data[kKeySize];
+};
+
+struct Group
+{
+    std::vector<Id> users;
+    std::vector<std::shared_ptr<SendKey>> symKeys; //pairwise keys, as in SharedKeyCache
+    SendKey sendKey;
+    Group(size_t size, uint64_t seed)
+    {
+        std::mt19937_64 rng(seed);
+        for (size_t i = 0; i < size; i++)
+        {
+            users.push_back(Id(rng()));
+            auto key = std::make_shared<SendKey>();
+            for (size_t j = 0; j < kKeySize; j++)
+                key->data[j] = (unsigned char)rng();
+            symKeys.push_back(key);
+        }
+        for (size_t j = 0; j < kKeySize; j++)
+            sendKey.data[j] = (unsigned char)rng();
+    }
+};
+
+// encryptKeyToAllParticipants() before batching: encryptKeyTo() per user
+static size_t rotatePerUser(const Group& g)
+{
+    auto keyCmd = new chatd::KeyCommand(Id::null());
+    std::vector<promise::Promise<void>> promises;
+    promises.reserve(g.users.size());
+    for (size_t i = 0; i < g.users.size(); i++)
+    {
+        auto user = g.users[i];
+        promise::Promise<std::shared_ptr<SendKey>> symPms(g.symKeys[i]);
+        auto pms = symPms.then([&g](const std::shared_ptr<SendKey>& symkey)
+        {
+            auto result = std::make_shared<Buffer>((size_t)kKeySize);
+            result->setDataSize(kKeySize);
+            CryptoPP::ECB_Mode<CryptoPP::AES>::Encryption aes(symkey->data, kKeySize);
+            aes.ProcessData(result->ubuf(), g.sendKey.data, kKeySize);
+            return result;
+        })
+        .then([keyCmd, user](const std::shared_ptr<Buffer>& encryptedKey)
+        {
+            keyCmd->addKey(user, encryptedKey->buf(), encryptedKey->dataSize());
+        });
+        promises.push_back(pms);
+    }
+    size_t size = 0;
+    promise::when(promises)
+    .then([keyCmd, &size]()
+    {
+        size = keyCmd->dataSize();
+        delete keyCmd;
+    });
+    return size;
+}
+
+// encryptKeyToAllParticipants() with all pairwise keys known
+static size_t rotateBatched(const Group& g)
+{
+    auto keyCmd = new chatd::KeyCommand(Id::null(), CHATD_KEYID_UNCONFIRMED,
+        17 + g.users.size() * (10 + kKeySize));
+    std::vector<const SendKey*> keyPtrs;
+    keyPtrs.reserve(g.symKeys.size());
+    for (auto& symKey: g.symKeys)
+        keyPtrs.push_back(symKey.get());
+    Buffer wrapped(g.users.size() * kKeySize);
+    CryptoPP::AES::Encryption aes; // same as aesECBEncryptBatch()
+    for (size_t i = 0; i < keyPtrs.size(); i++)
+    {
+        aes.SetKey(keyPtrs[i]->data, kKeySize);
+        aes.ProcessBlock(g.sendKey.data, wrapped.ubuf() + i * kKeySize);
+    }
+    for (size_t i = 0; i < g.users.size(); i++)
+        keyCmd->addKey(g.users[i], wrapped.buf() + i * kKeySize, kKeySize);
+    size_t size = keyCmd->dataSize();
+    delete keyCmd;
+    return size;
+}
+
+template <class F>
+static double bench(size_t groupSize, size_t rotations, F&& func)
+{
+    Group g(groupSize, 1);
+    size_t check = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rotations; i++)
+        check += func(g);
+    auto end = std::chrono::steady_clock::now();
+    if (check != rotations * (17 + groupSize * (10 + kKeySize)))
+    {
+        fprintf(stderr, "Unexpected NEWKEY command size\n");
+        exit(1);
+    }
+    return std::chrono::duration<double, std::micro>(end - start).count() / rotations;
+}
+
+int main(int argc, char** argv)
+{
+    size_t rotations = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 200;
+    std::vector<size_t> sizes;
+    for (int i = 2; i < argc; i++)
+        sizes.push_back(strtoul(argv[i], nullptr, 10));
+    if (sizes.empty())
+        sizes = {2, 10, 50, 100, 500, 1000};
+
+    printf("%8s %18s %18s\n", "users", "per-user us/rot", "batched us/rot");
+    for (auto n: sizes)
+    {
+        double perUser = bench(n, rotations, rotatePerUser);
+        double batched = bench(n, rotations, rotateBatched);
+        printf("%8zu %18.1f %18.1f\n", n, perUser, batched);
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+/* Checks that received messages that borrow their data from a frame (see
+ * chatd::Message::mFrame) free everything they allocate, when their content is
+ * replaced in the ways strongvelope does on decryption: a decrypted text built
+ * via writableBlock(), which is empty for deleted messages and then cleared,
+ * or content set via assign(). Exits with 1 if any case leaks.
+ *
+ * Usage: chatd_message_frame_check [iterations]
+ */
+#include <chatdMsg.h>
+#include "allocCount.h"
+#include <functional>
+#include <memory>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+using chatd::Message;
+
+static size_t gIterations = 1000;
+static int gFailed = 0;
+
+static void check(const char* name, const std::shared_ptr<Buffer>& frame,
+    const std::function<void(Message&)>& replace)
+{
+    long before = liveAllocs();
+    for (size_t i = 0; i < gIterations; i++)
+    {
+        std::unique_ptr<Message> msg(new Message(i+1, 1, 0, 0, frame, frame->buf() + 16, 100));
+        if (!msg->referencesFrame())
+        {
+            printf("FAIL %s: the message does not reference the frame\n", name);
+            gFailed++;
+            return;
+        }
+        replace(*msg);
+        if (msg->referencesFrame())
+        {
+            printf("FAIL %s: the frame is still referenced\n", name);
+            gFailed++;
+            return;
+        }
+    }
+    long leaked = liveAllocs() - before;
+    if (leaked)
+    {
+        printf("FAIL %s: %ld blocks leaked in %zu iterations\n", name, leaked, gIterations);
+        gFailed++;
+    }
+    else
+    {
+        printf("ok   %s\n", name);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1)
+        gIterations = strtoul(argv[1], nullptr, 10);
+
+    std::shared_ptr<Buffer> frame = std::make_shared<Buffer>((size_t)512);
+    memset(frame->writePtr(0, 512), 'x', 512);
+
+    // MSGUPD of a deleted message: the decrypted text is empty
+    check("writableBlock() then clear()", frame, [](Message& msg)
+    {
+        msg.writableBlock(64);
+        msg.clear();
+    });
+    check("writableBlock(), content, then clear()", frame, [](Message& msg)
+    {
+        memset(msg.writableBlock(64), 'y', 64);
+        msg.clear();
+    });
+    check("clear() while borrowed", frame, [](Message& msg)
+    {
+        msg.clear();
+    });
+    check("writableBlock() then assign()", frame, [](Message& msg)
+    {
+        char* data = msg.writableBlock(64);
+        memset(data, 'y', 64);
+        msg.assign(data, 64);
+    });
+    check("assign() from the frame", frame, [](Message& msg)
+    {
+        msg.assign(msg.buf() + 10, 50);
+    });
+    check("detachFrame()", frame, [](Message& msg)
+    {
+        msg.detachFrame();
+    });
+    return gFailed ? 1 : 0;
+}
@@ -0,0 +1,258 @@
+/* Benchmark of the confirmation of sent messages by chatd::Client, for a client
+ * that is a member of N chats and sends to all of them. The messages are
+ * submitted via Chat::msgSubmit() round-robin to all chats, while offline, so
+ * they stay in the send queues. Then the NEWMSGID (or MSGID) responses of the
+ * server are fed to the chatd connection in the same order, so each one goes
+ * through Client::msgConfirm() (or onMsgAlreadySent()) and the msgxid index to
+ * the right chat. There is no server and no login, as in strongvelope_bench.
+ * Checks that every message is confirmed (or rejected), and prints the time per
+ * confirmation as JSON. It should not grow with the number of chats.
+ *
+ * Usage: chatd_msgxid_confirm_bench [confirmsPerChat] [chat counts]
+ * where chat counts is a comma separated list, i.e. chatd_msgxid_confirm_bench 10 10,1000
+ */
+#include <chatClient.h>
+#include <chatdDb.h>
+#include <strongvelope/strongvelope.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace karere;
+using namespace strongvelope;
+
+// The app message loop: msgSubmit() marshals the submission, which is run by
+// the benchmark thread, which plays the app thread
+static std::mutex gMsgMutex;
+static std::deque<void*> gMsgs;
+
+static void postMessage(void* msg, void* /*appCtx*/)
+{
+    std::lock_guard<std::mutex> lock(gMsgMutex);
+    gMsgs.push_back(msg);
+}
+
+static void processMessages()
+{
+    for (;;)
+    {
+        void* msg;
+        {
+            std::lock_guard<std::mutex> lock(gMsgMutex);
+            if (gMsgs.empty())
+                return;
+            msg = gMsgs.front();
+            gMsgs.pop_front();
+        }
+        megaProcessMessage(msg);
+    }
+}
+
+class BenchApp: public IApp
+{
+public:
+    virtual IContactListHandler* contactListHandler() { return nullptr; }
+    virtual IChatListHandler* chatListHandler() { return nullptr; }
+    virtual void onPresenceConfigChanged(const presenced::Config& config, bool pending) {}
+    virtual void onIncomingContactRequest(const mega::MegaContactRequest& req) {}
+#ifndef KARERE_DISABLE_WEBRTC
+    virtual rtcModule::IEventHandler*
+        onIncomingCall(const std::shared_ptr<rtcModule::ICallAnswer>& ans) { return nullptr; }
+#endif
+};
+
+// Gives access to the connection of a chat, to feed it with received frames
+class BenchChatdClient: public chatd::Client
+{
+public:
+    using chatd::Client::Client;
+    WebsocketsClient& conn(Id chatid) { return chatidConn(chatid); }
+};
+
+// Counts the confirmations and rejections of all chats
+class BenchListener: public chatd::Listener
+{
+    SqliteDb& mDb;
+public:
+    size_t confirmed = 0;
+    size_t rejected = 0;
+    BenchListener(SqliteDb& db): mDb(db) {}
+    virtual void init(chatd::Chat& chat, chatd::DbInterface*& dbIntf)
+    {
+        dbIntf = new ChatdSqliteDb(chat, mDb);
+    }
+    virtual void onMessageConfirmed(Id msgxid, const chatd::Message& msg, chatd::Idx idx)
+    {
+        confirmed++;
+    }
+    virtual void onMessageRejected(const chatd::Message& msg, uint8_t reason)
+    {
+        rejected++;
+    }
+};
+
+struct Result
+{
+    const char* op;
+    size_t chats;
+    size_t confirms;
+    double nsPerConfirm;
+};
+
+static std::vector<size_t> parseCounts(const char* arg)
+{
+    std::vector<size_t> result;
+    std::istringstream is(arg);
+    std::string item;
+    while (std::getline(is, item, ','))
+        result.push_back(strtoul(item.c_str(), nullptr, 10));
+    return result;
+}
+
+class Bench
+{
+    BenchApp mApp;
+    Client mClient;
+    std::unique_ptr<UserAttrCache> mAttrCache;
+    std::unique_ptr<SharedKeyCache> mKeys;
+    SqliteDb mCryptoDb;
+    const Id mUserid = Id(0x1000);
+    SetOfIds mParticipants;
+    EcKey mPrivCu;
+    EcKey mPrivEd;
+public:
+    Bench(mega::MegaApi& sdk);
+    ~Bench()
+    {
+        mKeys.reset();
+        mAttrCache.reset();
+        mCryptoDb.close();
+        mClient.db.close();
+    }
+    Result run(uint8_t opcode, size_t numChats, size_t perChat);
+};
+
+Bench::Bench(mega::MegaApi& sdk)
+: mClient(sdk, nullptr, mApp, "", 0)
+{
+    if (!mClient.db.open(":memory:", false) || !mCryptoDb.open(":memory:", false))
+        throw std::runtime_error("Can't open in-memory db");
+    mClient.db.simpleQuery(gDbSchema);
+    mCryptoDb.simpleQuery(gDbSchema);
+    mParticipants.insert(mUserid);
+    mParticipants.insert(Id(0x1001));
+    // Messages are not sent, so the keys are not used
+    memset(mPrivCu.buf(), 1, 32);
+    memset(mPrivEd.buf(), 2, 32);
+    mAttrCache.reset(new UserAttrCache(mClient));
+    mKeys.reset(new SharedKeyCache(*mAttrCache));
+}
+
+Result Bench::run(uint8_t opcode, size_t numChats, size_t perChat)
+{
+    // Start from empty send queues and history every time
+    mClient.db.query("delete from sending");
+    mClient.db.query("delete from history");
+    mClient.db.query("delete from chat_vars");
+
+    BenchListener listener(mClient.db);
+    double ns;
+    size_t total = numChats * perChat;
+    {
+        BenchChatdClient client(&mClient, mUserid);
+        std::vector<chatd::Chat*> chats;
+        for (size_t i = 0; i < numChats; i++)
+        {
+            Id chatid(0xc4a70000 + i);
+            auto crypto = new ProtocolHandler(mUserid, mPrivCu, mPrivEd, StaticBuffer(nullptr, 0),
+                *mAttrCache, *mKeys, nullptr, mCryptoDb, chatid, nullptr);
+            chats.push_back(&client.createChat(chatid, 0, "", &listener, mParticipants,
+                crypto, 0, true));
+        }
+
+        // Send round-robin to all chats, the server confirms in the same order
+        std::vector<Id> msgxids;
+        msgxids.reserve(total);
+        for (size_t n = 0; n < perChat; n++)
+        {
+            for (auto chat: chats)
+                msgxids.push_back(chat->msgSubmit("message", 7, chatd::Message::kMsgNormal, nullptr)->id());
+        }
+        processMessages();
+
+        std::vector<Buffer> frames;
+        for (size_t i = 0; i < total; i++)
+        {
+            if (i % 100 == 0)
+                frames.emplace_back();
+            chatd::Command cmd = chatd::Command(opcode) + msgxids[i] + Id(0x10000 + i);
+            frames.back().append(cmd.buf(), cmd.dataSize());
+        }
+
+        auto& conn = client.conn(chats[0]->chatId());
+        auto start = std::chrono::steady_clock::now();
+        for (auto& frame: frames)
+            conn.wsHandleMsgCb(frame.buf(), frame.dataSize());
+        ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        processMessages();
+    }
+    processMessages();
+
+    size_t done = (opcode == chatd::OP_NEWMSGID) ? listener.confirmed : listener.rejected;
+    if (done != total)
+        throw std::runtime_error(std::to_string(done)+" of "+std::to_string(total)+
+            " messages confirmed with "+chatd::Command::opcodeToStr(opcode)+", in "+
+            std::to_string(numChats)+" chats");
+    return {chatd::Command::opcodeToStr(opcode), numChats, total, ns / total};
+}
+
+int main(int argc, char** argv)
+{
+    size_t perChat = 10;
+    std::vector<size_t> chatCounts = {10, 100, 1000, 5000};
+    if (argc > 1)
+        perChat = std::max(1, atoi(argv[1]));
+    if (argc > 2)
+        chatCounts = parseCounts(argv[2]);
+    megaPostMessageToGui = postMessage;
+    krLoggerChannels[krLogChannel_chatd].logLevel = krLogLevelError;
+    krLoggerChannels[krLogChannel_strongvelope].logLevel = krLogLevelError;
+    krLoggerChannels[krLogChannel_megasdk].logLevel = krLogLevelError;
+
+    // Never logged in, only needed by karere::Client and the attribute cache
+    mega::MegaApi sdk("chatd_msgxid_confirm_bench", (const char*)nullptr, "chatd_msgxid_confirm_bench");
+    std::vector<Result> results;
+    int ret = 0;
+    try
+    {
+        Bench bench(sdk);
+        for (auto opcode: {chatd::OP_NEWMSGID, chatd::OP_MSGID})
+        {
+            for (auto n: chatCounts)
+                results.push_back(bench.run(opcode, n, perChat));
+        }
+    }
+    catch(std::exception& e)
+    {
+        fprintf(stderr, "Error: %s\n", e.what());
+        ret = 1;
+    }
+
+    printf("{\n  \"confirms_per_chat\": %zu,\n  \"results\": [\n", perChat);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        auto& r = results[i];
+        printf("    {\"op\": \"%s\", \"chats\": %zu, \"confirms\": %zu, \"ns_per_confirm\": %.1f}%s\n",
+            r.op, r.chats, r.confirms, r.nsPerConfirm, (i + 1 < results.size()) ? "," : "");
+    }
+    printf("  ]\n}\n");
+    return ret;
+}
@@ -0,0 +1,360 @@
+/* Benchmark of the strongvelope message and key operations, as run by
+ * ProtocolHandler: msgEncrypt() (with the current key and with a new key for
+ * the whole group), msgDecrypt(), ParsedMessage parsing, signMessage(),
+ * ParsedMessage::verifySignature(), encryptKeyToAllParticipants() and
+ * legacyDecryptKeys(), over a range of payload and group sizes.
+ * There is no server and no login: the public keys of the generated users are
+ * put in the user attribute cache db, which is in memory, as are the key dbs
+ * of the sender and the receiver, so all keys resolve synchronously.
+ * Results are printed as JSON on stdout: ops/sec, heap allocations per op
+ * and p50/p99 latency in microseconds. With glibc, allocations are counted at
+ * malloc() level, so Buffer, sqlite and libsodium allocations are included.
+ * Otherwise only operator new is counted, as reported by "allocs_counted".
+ *
+ * Usage: strongvelope_bench [iterations] [payload sizes] [group sizes]
+ * where sizes are comma separated lists, i.e. strongvelope_bench 2000 16,4096 2,100
+ */
+#include <chatClient.h>
+#include <strongvelope/strongvelope.h>
+#include "allocCount.h"
+#include <sodium.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace karere;
+using namespace strongvelope;
+
+class BenchApp: public IApp
+{
+public:
+    virtual IContactListHandler* contactListHandler() { return nullptr; }
+    virtual IChatListHandler* chatListHandler() { return nullptr; }
+    virtual void onPresenceConfigChanged(const presenced::Config& config, bool pending) {}
+    virtual void onIncomingContactRequest(const mega::MegaContactRequest& req) {}
+#ifndef KARERE_DISABLE_WEBRTC
+    virtual rtcModule::IEventHandler*
+        onIncomingCall(const std::shared_ptr<rtcModule::ICallAnswer>& ans) { return nullptr; }
+#endif
+};
+
+// Exposes the internals that are benchmarked on their own
+class BenchHandler: public ProtocolHandler
+{
+public:
+    using ProtocolHandler::ProtocolHandler;
+    using ProtocolHandler::signMessage;
+    using ProtocolHandler::encryptKeyToAllParticipants;
+    using ProtocolHandler::legacyDecryptKeys;
+    SendKey currentKey() const { return *mCurrentKey; }
+};
+
+struct User
+{
+    Id id;
+    EcKey privCu;
+    EcKey privEd; //the seed only, as ProtocolHandler takes it
+};
+
+struct Result
+{
+    std::string op;
+    size_t payload;
+    size_t group;
+    double opsPerSec;
+    double allocsPerOp;
+    double p50;
+    double p99;
+};
+
+static std::vector<Result> gResults;
+static unsigned gIterations = 2000;
+
+/* Runs \c op gIterations times. \c prepare is run before each op and is
+ * not measured */
+static void measure(const char* name, size_t payload, size_t group,
+    const std::function<void()>& prepare, const std::function<void()>& op)
+{
+    std::vector<double> latencies;
+    latencies.reserve(gIterations);
+    size_t allocs = 0;
+    double total = 0;
+    for (unsigned i = 0; i < gIterations; i++)
+    {
+        if (prepare)
+            prepare();
+        auto before = tAllocCount;
+        auto start = std::chrono::steady_clock::now();
+        op();
+        auto elapsed = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - start).count();
+        allocs += tAllocCount - before;
+        total += elapsed;
+        latencies.push_back(elapsed);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    gResults.push_back({name, payload, group, gIterations * 1000000.0 / total,
+        (double)allocs / gIterations, latencies[latencies.size() / 2],
+        latencies[(latencies.size() * 99) / 100]});
+}
+
+static std::vector<size_t> parseSizes(const char* arg)
+{
+    std::vector<size_t> result;
+    std::istringstream is(arg);
+    std::string item;
+    while (std::getline(is, item, ','))
+        result.push_back(strtoul(item.c_str(), nullptr, 10));
+    return result;
+}
+
+static void openDb(SqliteDb& db)
+{
+    if (!db.open(":memory:", false))
+        throw std::runtime_error("Can't open in-memory db");
+    db.simpleQuery(gDbSchema);
+}
+
+struct MemoryDb: public SqliteDb
+{
+    MemoryDb() { openDb(*this); }
+    ~MemoryDb() { close(); }
+};
+
+template <class T>
+static T check(const promise::Promise<T>& pms, const char* what)
+{
+    if (!pms.succeeded())
+        throw std::runtime_error(std::string(what)+" did not complete synchronously"
+            +(pms.done() ? ": "+pms.error().msg() : std::string()));
+    return pms.value();
+}
+
+class Bench
+{
+    BenchApp mApp;
+    Client mClient;
+    std::unique_ptr<UserAttrCache> mAttrCache;
+    std::vector<User> mUsers;
+    SetOfIds mParticipants;
+public:
+    Bench(mega::MegaApi& sdk, size_t maxUsers)
+    : mClient(sdk, nullptr, mApp, "", 0)
+    {
+        openDb(mClient.db);
+        for (size_t i = 0; i < maxUsers; i++)
+        {
+            User user;
+            user.id = Id(0x1000 + i);
+            unsigned char pubCu[crypto_scalarmult_BYTES];
+            randombytes_buf(user.privCu.ubuf(), 32);
+            crypto_scalarmult_base(pubCu, user.privCu.ubuf());
+            unsigned char pubEd[crypto_sign_PUBLICKEYBYTES];
+            unsigned char privEd[crypto_sign_SECRETKEYBYTES];
+            randombytes_buf(user.privEd.ubuf(), 32);
+            crypto_sign_seed_keypair(pubEd, privEd, user.privEd.ubuf());
+            mClient.db.query("insert into userattrs(userid, type, data) values(?,?,?)",
+                user.id, (int)mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY,
+                StaticBuffer((const char*)pubCu, sizeof(pubCu)));
+            mClient.db.query("insert into userattrs(userid, type, data) values(?,?,?)",
+                user.id, (int)mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY,
+                StaticBuffer((const char*)pubEd, sizeof(pubEd)));
+            mUsers.push_back(user);
+        }
+        mAttrCache.reset(new UserAttrCache(mClient));
+    }
+    ~Bench()
+    {
+        mAttrCache.reset();
+        mClient.db.close();
+    }
+    void run(size_t group, const std::vector<size_t>& payloads);
+};
+
+void Bench::run(size_t groupSize, const std::vector<size_t>& payloads)
+{
+    if (groupSize < 2 || groupSize > mUsers.size())
+        throw std::runtime_error("Invalid group size");
+    mParticipants.clear();
+    for (size_t i = 0; i < groupSize; i++)
+        mParticipants.insert(mUsers[i].id);
+
+    const Id chatid(0xc4a7);
+    auto& sender = mUsers[0];
+    auto& receiver = mUsers[1];
+    MemoryDb senderDb, receiverDb;
+    SharedKeyCache senderKeys(*mAttrCache), receiverKeys(*mAttrCache);
+    BenchHandler alice(sender.id, sender.privCu, sender.privEd, StaticBuffer(nullptr, 0),
+        *mAttrCache, senderKeys, nullptr, senderDb, chatid, nullptr);
+    BenchHandler bob(receiver.id, receiver.privCu, receiver.privEd, StaticBuffer(nullptr, 0),
+        *mAttrCache, receiverKeys, nullptr, receiverDb, chatid, nullptr);
+    alice.setUsers(&mParticipants);
+    bob.setUsers(&mParticipants);
+
+    // Post a send key to the group and pass it to the receiver, as chatd would.
+    // Messages are encrypted with that key, later keys are only confirmed
+    const KeyId keyid = 1;
+    KeyId lastKeyid = keyid;
+    chatd::Message first(0, sender.id, 0, 0, Buffer("x", 1));
+    chatd::MsgCommand firstCmd(chatd::OP_NEWMSG, chatid, sender.id, 1, 0, 0, CHATD_KEYID_INVALID);
+    auto encrypted = check(alice.msgEncrypt(&first, &firstCmd), "msgEncrypt");
+    auto keyCmd = encrypted.second;
+    assert(keyCmd);
+    for (size_t offset = 17; offset < keyCmd->dataSize();)
+    {
+        Id userid = keyCmd->read<uint64_t>(offset);
+        auto keylen = keyCmd->read<uint16_t>(offset + 8);
+        if (userid == receiver.id)
+            bob.onKeyReceived(keyid, sender.id, receiver.id, keyCmd->buf() + offset + 10, keylen);
+        offset += 10 + keylen;
+    }
+    alice.onKeyConfirmed(CHATD_KEYID_UNCONFIRMED, keyid);
+    auto sendKey = alice.currentKey();
+
+    auto sharedKey = std::make_shared<SendKey>(sendKey);
+    measure("encryptKeyToAllParticipants", 0, groupSize, nullptr, [&]()
+    {
+        auto result = check(alice.encryptKeyToAllParticipants(sharedKey), "encryptKeyToAllParticipants");
+        delete result.first;
+    });
+
+    // A legacy key message to the receiver, with the current and previous keys
+    // AES-encrypted with the pairwise key. The content is random, as only the
+    // decryption cost is of interest
+    chatd::Message legacyMsg(2, sender.id, 0, 0, Buffer("\x01", 1));
+    auto legacy = std::make_shared<ParsedMessage>(legacyMsg, bob);
+    legacy->sender = sender.id;
+    legacy->target = receiver.id;
+    randombytes_buf(legacy->nonce.ubuf(), SVCRYPTO_NONCE_SIZE);
+    legacy->nonce.setDataSize(SVCRYPTO_NONCE_SIZE);
+    char legacyKeys[2 * SVCRYPTO_KEY_SIZE];
+    randombytes_buf(legacyKeys, sizeof(legacyKeys));
+    legacy->encryptedKey.assign(legacyKeys, sizeof(legacyKeys));
+    measure("legacyDecryptKeys", 0, groupSize, nullptr, [&]()
+    {
+        check(bob.legacyDecryptKeys(legacy), "legacyDecryptKeys");
+    });
+
+    for (auto payloadSize: payloads)
+    {
+        std::string text(payloadSize, 'a');
+        chatd::Message msg(0, sender.id, 0, 0, Buffer(text.c_str(), text.size()));
+        std::unique_ptr<chatd::MsgCommand> cmd;
+        auto prepareMsg = [&]()
+        {
+            msg.keyid = CHATD_KEYID_INVALID;
+            cmd.reset(new chatd::MsgCommand(chatd::OP_NEWMSG, chatid, sender.id,
+                1, 0, 0, CHATD_KEYID_INVALID));
+        };
+        measure("msgEncrypt", payloadSize, groupSize, prepareMsg, [&]()
+        {
+            check(alice.msgEncrypt(&msg, cmd.get()), "msgEncrypt");
+        });
+        measure("msgEncryptNewKey", payloadSize, groupSize, [&]()
+        {
+            prepareMsg();
+            alice.resetSendKey();
+        },
+        [&]()
+        {
+            check(alice.msgEncrypt(&msg, cmd.get()), "msgEncrypt");
+        });
+        // The last new key is left unconfirmed otherwise
+        alice.onKeyConfirmed(CHATD_KEYID_UNCONFIRMED, ++lastKeyid);
+
+        // Encrypt with the key that the receiver has
+        prepareMsg();
+        msg.keyid = keyid;
+        cmd->setKeyId(keyid);
+        check(alice.msgEncrypt(&msg, cmd.get()), "msgEncrypt");
+
+        auto data = cmd->msg();
+        chatd::Message received(1, sender.id, 0, 0, data.buf(), data.dataSize(), false, keyid);
+        measure("ParsedMessage", payloadSize, groupSize, nullptr, [&]()
+        {
+            ParsedMessage parsed(received, bob);
+        });
+
+        ParsedMessage parsed(received, bob);
+        EcKey pubEd;
+        getPubKeyFromPrivKey(sender.privEd, kKeyTypeEd25519, pubEd);
+        Key<64> signature;
+        measure("signMessage", payloadSize, groupSize, nullptr, [&]()
+        {
+            alice.signMessage(parsed.signedContent, parsed.protocolVersion, parsed.type,
+                sendKey, signature);
+        });
+        measure("verifySignature", payloadSize, groupSize, nullptr, [&]()
+        {
+            if (!parsed.verifySignature(pubEd, sendKey))
+                throw std::runtime_error("Signature verification failed");
+        });
+
+        chatd::Message target(1, sender.id, 0, 0, Buffer(), false, keyid);
+        measure("msgDecrypt", payloadSize, groupSize, [&]()
+        {
+            // msgDecrypt() decrypts in place
+            target.assign(data.buf(), data.dataSize());
+            target.setEncrypted(1);
+        },
+        [&]()
+        {
+            auto result = check(bob.msgDecrypt(&target), "msgDecrypt");
+            if (result->dataSize() != payloadSize)
+                throw std::runtime_error("Decrypted message has wrong size");
+        });
+    }
+}
+
+static void printResults()
+{
+    printf("{\n  \"iterations\": %u,\n  \"allocs_counted\": \"%s\",\n  \"results\": [\n",
+        gIterations, kAllocCountScope);
+    for (size_t i = 0; i < gResults.size(); i++)
+    {
+        auto& r = gResults[i];
+        printf("    {\"op\": \"%s\", \"payload\": %zu, \"group\": %zu, \"ops_per_sec\": %.1f, "
+            "\"allocs_per_op\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f}%s\n",
+            r.op.c_str(), r.payload, r.group, r.opsPerSec, r.allocsPerOp, r.p50, r.p99,
+            (i + 1 < gResults.size()) ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<size_t> payloads = {16, 256, 4096, 65536};
+    std::vector<size_t> groups = {2, 10, 100};
+    if (argc > 1)
+        gIterations = std::max(1, atoi(argv[1]));
+    if (argc > 2)
+        payloads = parseSizes(argv[2]);
+    if (argc > 3)
+        groups = parseSizes(argv[3]);
+    if (sodium_init() == -1)
+        return 1;
+    krLoggerChannels[krLogChannel_strongvelope].logLevel = krLogLevelError;
+    krLoggerChannels[krLogChannel_megasdk].logLevel = krLogLevelError;
+
+    // Never logged in, only needed by karere::Client and the attribute cache
+    mega::MegaApi sdk("strongvelope_bench", (const char*)nullptr, "strongvelope_bench");
+    int ret = 0;
+    try
+    {
+        Bench bench(sdk, *std::max_element(groups.begin(), groups.end()));
+        for (auto group: groups)
+            bench.run(group, payloads);
+    }
+    catch(std::exception& e)
+    {
+        fprintf(stderr, "Error: %s\n", e.what());
+        ret = 1;
+    }
+    printResults();
+    return ret;
+}
@@ -3032,6 +3032,20 @@ void TestChatRoomListener::onMessageUpdate(MegaChatApi *api, MegaChatMessage *ms
     }
 }
 
+void TestChatRoomListener::onMessageStatusRangeChange(MegaChatApi *api, MegaChatHandle chatid, int fromIndex, int toIndex, int status)
+{
+    unsigned int apiIndex = getMegaChatApiIndex(api);
+
+    std::stringstream buffer;
+    buffer << "[api: " << apiIndex << "] Messages " << fromIndex << "-" << toIndex << " changed status to " << status;
+    t->postLog(buffer.str());
+
+    if (status == MegaChatMessage::STATUS_DELIVERED)
+    {
+        msgDelivered[apiIndex] = true;
+    }
+}
+
 unsigned int TestChatRoomListener::getMegaChatApiIndex(MegaChatApi *api)
 {
     int apiIndex = -1;
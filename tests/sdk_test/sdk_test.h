@@ -354,6 +354,7 @@ public:
     virtual void onMessageLoaded(megachat::MegaChatApi* megaChatApi, megachat::MegaChatMessage *msg);   // loaded by getMessages()
     virtual void onMessageReceived(megachat::MegaChatApi* megaChatApi, megachat::MegaChatMessage *msg);
     virtual void onMessageUpdate(megachat::MegaChatApi* megaChatApi, megachat::MegaChatMessage *msg);   // new or updated
+    virtual void onMessageStatusRangeChange(megachat::MegaChatApi* megaChatApi, megachat::MegaChatHandle chatid, int fromIndex, int toIndex, int status);
 
 private:
     unsigned int getMegaChatApiIndex(megachat::MegaChatApi *api);